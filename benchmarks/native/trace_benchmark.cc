@@ -0,0 +1,556 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+// Microbenchmarks of the native sampling path: hashing traces, adding them to
+// and extracting them from the signal-safe tables, harvesting the tables into
+// the aggregated tree, and populating and recording the frames of a real
+// Python stack through Profiler::Handle.
+//
+// Synthetic benchmarks use traces of fake frames, whose code object pointers
+// are never dereferenced. Python benchmarks run an embedded interpreter, in
+// which each thread calls into the benchmark from a Python stack of the
+// requested depth, with get_thread_state_func stubbed to return the thread
+// state of the calling thread.
+//
+// Each result is printed on its own line as space-separated key=value pairs,
+// so that results can be compared across runs, see --help. ns_per_sample is
+// the wall time per operation on each thread, so with several threads it
+// includes the cost of contention.
+
+#include <Python.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>  // NOLINT
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <string>
+#include <thread>  // NOLINT
+#include <vector>
+
+#include "populate_frames.h"
+#include "profiler.h"
+#include "stacktraces.h"
+
+namespace {
+
+// Smallest stack depth, which the Python stacks can't go below.
+const int kMinDepth = 4;
+
+struct Options {
+  std::vector<int> depths = {8, 32, 128};
+  std::vector<int> cardinalities = {16, 256, 2048};
+  std::vector<int> threads = {1, 4};
+  // Number of samples per thread of each benchmark.
+  int64_t samples = 200000;
+  // Only the benchmarks whose name contains filter are run.
+  std::string filter;
+};
+
+// Key of a result line: the benchmark and its parameters.
+struct Params {
+  const char *name;
+  int depth;
+  int cardinality;
+  int threads;
+};
+
+void PrintResult(const Params &params, const std::string &values) {
+  printf("benchmark=%s depth=%d cardinality=%d threads=%d %s\n", params.name,
+         params.depth, params.cardinality, params.threads, values.c_str());
+  fflush(stdout);
+}
+
+std::string Format(const char *fmt, ...) {
+  char buffer[256];
+  va_list args;
+  va_start(args, fmt);
+  vsnprintf(buffer, sizeof(buffer), fmt, args);
+  va_end(args);
+  return buffer;
+}
+
+std::string ProbeStats(const TraceTableStats &stats) {
+  return Format("mean_probe=%.3f max_probe=%lld table_full=%lld arena_full=%lld",
+                stats.add_count > 0
+                    ? static_cast<double>(stats.probe_count) / stats.add_count
+                    : 0.0,
+                static_cast<long long>(stats.max_probe_length),  // NOLINT
+                static_cast<long long>(stats.table_full_count),  // NOLINT
+                static_cast<long long>(stats.arena_full_count));  // NOLINT
+}
+
+int64_t NowNanos() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Runs body(thread_index) on num_threads threads started together, and
+// returns the elapsed wall time in nanoseconds.
+int64_t RunThreads(int num_threads, const std::function<void(int)> &body) {
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+  std::vector<std::thread> threads;
+  for (int i = 0; i < num_threads; i++) {
+    threads.emplace_back([&, i]() {
+      ready++;
+      while (!go.load()) {
+        std::this_thread::yield();
+      }
+      body(i);
+    });
+  }
+  while (ready.load() < num_threads) {
+    std::this_thread::yield();
+  }
+  int64_t start = NowNanos();
+  go = true;
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  return NowNanos() - start;
+}
+
+// A set of distinct synthetic traces sharing their root frames, as traces
+// sampled from one program do, and a sequence of samples drawn from them.
+class SyntheticTraces {
+ public:
+  SyntheticTraces(int depth, int cardinality, int64_t num_samples)
+      : depth_(depth), frames_(static_cast<size_t>(depth) * cardinality) {
+    for (int t = 0; t < cardinality; t++) {
+      CallFrame *trace = &frames_[static_cast<size_t>(t) * depth];
+      for (int i = 0; i < depth; i++) {
+        // Fake code object pointers, aligned like real ones.
+        uintptr_t code = 0x100000 + 64 * static_cast<uintptr_t>(i);
+        trace[depth - 1 - i] = {i + 1, 0, reinterpret_cast<PyCodeObject *>(code)};
+      }
+      // The leaf frames tell the traces apart.
+      trace[0].lineno = 1000 + t;
+      trace[1].lineno = 1000 + t % 7;
+    }
+    // Skewed towards few hot traces, as real profiles are.
+    uint64_t state = 88172645463325252ULL;
+    samples_.resize(num_samples);
+    for (int64_t i = 0; i < num_samples; i++) {
+      state ^= state << 13;
+      state ^= state >> 7;
+      state ^= state << 17;
+      double u = (state >> 11) * (1.0 / 9007199254740992.0);
+      samples_[i] = static_cast<int>(cardinality * u * u);
+    }
+  }
+
+  // Returns the index-th distinct trace.
+  CallTrace Trace(int index) {
+    CallTrace trace;
+    trace.num_frames = depth_;
+    trace.frames = &frames_[static_cast<size_t>(index) * depth_];
+    return trace;
+  }
+
+  // Returns the trace of the sample-th sample.
+  CallTrace Sample(int64_t sample) { return Trace(samples_[sample]); }
+
+  int64_t NumSamples() const { return samples_.size(); }
+
+ private:
+  int depth_;
+  std::vector<CallFrame> frames_;
+  std::vector<int> samples_;
+};
+
+// Table capacity which holds every trace of the benchmark.
+int64_t TableEntries(int cardinality) {
+  return std::max<int64_t>(AsyncSafeTraceMultiset::kDefaultMaxEntries,
+                           2 * cardinality);
+}
+
+int64_t ArenaFrames(int depth, int cardinality) {
+  return TableEntries(cardinality) * depth;
+}
+
+void BenchmarkCalculateHash(const Options &options, int depth) {
+  Params params = {"CalculateHash", depth, 1, 1};
+  SyntheticTraces traces(depth, 1, 1);
+  CallTrace trace = traces.Trace(0);
+  uint64_t sink = 0;
+  int64_t start = NowNanos();
+  for (int64_t i = 0; i < options.samples; i++) {
+    sink += CalculateHash(trace.num_frames, trace.frames);
+    // Keeps the hash from being hoisted out of the loop.
+    asm volatile("" : "+r"(sink));
+  }
+  int64_t elapsed = NowNanos() - start;
+  PrintResult(params, Format("ns_per_sample=%.2f",
+                             static_cast<double>(elapsed) / options.samples));
+}
+
+void BenchmarkAsyncSafeAdd(const Options &options, int depth, int cardinality,
+                           int num_threads) {
+  Params params = {"AsyncSafeTraceMultiset::Add", depth, cardinality,
+                   num_threads};
+  SyntheticTraces traces(depth, cardinality, options.samples);
+  AsyncSafeTraceMultiset table(TableEntries(cardinality),
+                               ArenaFrames(depth, cardinality));
+  int64_t elapsed = RunThreads(num_threads, [&](int) {
+    for (int64_t i = 0; i < traces.NumSamples(); i++) {
+      CallTrace trace = traces.Sample(i);
+      table.Add(&trace);
+    }
+  });
+  PrintResult(params,
+              Format("ns_per_sample=%.2f ",
+                     static_cast<double>(elapsed) / options.samples) +
+                  ProbeStats(table.Stats()));
+}
+
+void BenchmarkShardedAdd(const Options &options, int depth, int cardinality,
+                         int num_threads) {
+  Params params = {"ShardedTraceMultiset::Add", depth, cardinality,
+                   num_threads};
+  SyntheticTraces traces(depth, cardinality, options.samples);
+  ShardedTraceMultiset table(TableEntries(cardinality),
+                             ArenaFrames(depth, cardinality));
+  int64_t elapsed = RunThreads(num_threads, [&](int) {
+    for (int64_t i = 0; i < traces.NumSamples(); i++) {
+      CallTrace trace = traces.Sample(i);
+      table.Add(&trace);
+    }
+  });
+  PrintResult(params,
+              Format("ns_per_sample=%.2f ",
+                     static_cast<double>(elapsed) / options.samples) +
+                  ProbeStats(table.Stats()));
+}
+
+void BenchmarkExtract(const Options &options, int depth, int cardinality) {
+  Params params = {"AsyncSafeTraceMultiset::Extract", depth, cardinality, 1};
+  SyntheticTraces traces(depth, cardinality, options.samples);
+  AsyncSafeTraceMultiset table(TableEntries(cardinality),
+                               ArenaFrames(depth, cardinality));
+  std::vector<CallFrame> frames(depth);
+  int64_t extracted = 0;
+  int64_t elapsed = 0;
+  int64_t rounds = std::max<int64_t>(1, options.samples / table.MaxEntries());
+  for (int64_t round = 0; round < rounds; round++) {
+    for (int t = 0; t < cardinality; t++) {
+      CallTrace trace = traces.Trace(t);
+      table.Add(&trace);
+    }
+    int64_t start = NowNanos();
+    for (int64_t location = 0; location < table.MaxEntries(); location++) {
+      int64_t count, weight;
+      if (table.Extract(location, depth, frames.data(), &count, &weight) > 0) {
+        extracted++;
+      }
+    }
+    elapsed += NowNanos() - start;
+  }
+  PrintResult(params,
+              Format("ns_per_entry=%.2f ns_per_scan=%.0f",
+                     extracted > 0 ? static_cast<double>(elapsed) / extracted
+                                   : 0.0,
+                     static_cast<double>(elapsed) / rounds));
+}
+
+void BenchmarkHarvestSamples(const Options &options, int depth,
+                             int cardinality) {
+  Params params = {"HarvestSamples", depth, cardinality, 1};
+  SyntheticTraces traces(depth, cardinality, options.samples);
+  ShardedTraceMultiset table(TableEntries(cardinality),
+                             ArenaFrames(depth, cardinality), 1);
+  CallingContextTree tree;
+  // Samples added between two flushes, as at 100 Hz over 100 ms per thread.
+  const int64_t kSamplesPerFlush = 1000;
+  int64_t flushes = 0;
+  int64_t entries = 0;
+  int64_t elapsed = 0;
+  for (int64_t i = 0; i < traces.NumSamples(); i += kSamplesPerFlush) {
+    int64_t end = std::min(traces.NumSamples(), i + kSamplesPerFlush);
+    for (int64_t j = i; j < end; j++) {
+      CallTrace trace = traces.Sample(j);
+      table.Add(&trace);
+    }
+    int64_t start = NowNanos();
+    entries += HarvestSamples(&table, &tree);
+    elapsed += NowNanos() - start;
+    flushes++;
+  }
+  PrintResult(params,
+              Format("ns_per_flush=%.0f ns_per_entry=%.2f tree_nodes=%zu",
+                     static_cast<double>(elapsed) / flushes,
+                     entries > 0 ? static_cast<double>(elapsed) / entries : 0.0,
+                     tree.NumNodes()));
+}
+
+void BenchmarkTraceMultisetAdd(const Options &options, int depth,
+                               int cardinality) {
+  Params params = {"TraceMultiset::Add", depth, cardinality, 1};
+  SyntheticTraces traces(depth, cardinality, options.samples);
+  TraceMultiset multiset;
+  int64_t start = NowNanos();
+  for (int64_t i = 0; i < traces.NumSamples(); i++) {
+    CallTrace trace = traces.Sample(i);
+    multiset.Add(trace.num_frames, trace.frames, 1);
+  }
+  int64_t elapsed = NowNanos() - start;
+  PrintResult(params, Format("ns_per_sample=%.2f",
+                             static_cast<double>(elapsed) / options.samples));
+}
+
+// The Python benchmarks call back into _trace_benchmark.run() from a Python
+// stack of the requested depth.
+
+thread_local PyThreadState *stub_thread_state = nullptr;
+
+PyThreadState *StubThreadState() { return stub_thread_state; }
+
+// A profiler which is never started, used to record samples through
+// Profiler::Handle into its tables and flush them.
+class BenchmarkProfiler : public Profiler {
+ public:
+  BenchmarkProfiler() : Profiler(0, 0) {}
+
+ protected:
+  bool CollectTraces() override { return true; }
+
+  const char *ProfileType() const override { return "benchmark"; }
+};
+
+// The benchmark run by _trace_benchmark.run(), with the Python stack of the
+// calling thread in place.
+std::function<void()> python_benchmark;
+
+PyObject *RunPythonBenchmark(PyObject *self, PyObject *args) {
+  stub_thread_state = PyThreadState_Get();
+  python_benchmark();
+  Py_RETURN_NONE;
+}
+
+PyMethodDef kBenchmarkMethods[] = {
+    {"run", RunPythonBenchmark, METH_NOARGS, "Runs the current benchmark."},
+    {nullptr, nullptr, 0, nullptr}};
+
+struct PyModuleDef kBenchmarkModule = {PyModuleDef_HEAD_INIT,
+                                       "_trace_benchmark", nullptr, -1,
+                                       kBenchmarkMethods};
+
+PyObject *InitBenchmarkModule() { return PyModule_Create(&kBenchmarkModule); }
+
+// Calls _trace_benchmark.run() from num_threads Python threads, each with a
+// stack of depth frames: the 3 frames of threading.Thread, followed by
+// recursive calls. The benchmark runs without GIL, as signal handlers do.
+const char kPythonDriver[] = R"(
+import threading
+import _trace_benchmark
+
+def recurse(depth):
+  if depth <= 1:
+    return _trace_benchmark.run()
+  return recurse(depth - 1)
+
+def drive(depth, num_threads):
+  threads = [threading.Thread(target=recurse, args=(depth - 3,))
+             for _ in range(num_threads)]
+  for thread in threads:
+    thread.start()
+  for thread in threads:
+    thread.join()
+)";
+
+PyObject *python_drive = nullptr;
+
+// Runs body on num_threads Python threads at the given depth, with GIL
+// released around it. Returns the elapsed wall time in nanoseconds.
+int64_t RunPython(int depth, int num_threads, const std::function<void()> &body) {
+  std::atomic<int> ready(0);
+  std::atomic<bool> go(false);
+  python_benchmark = [&]() {
+    Py_BEGIN_ALLOW_THREADS;
+    ready++;
+    while (!go.load()) {
+      std::this_thread::yield();
+    }
+    body();
+    Py_END_ALLOW_THREADS;
+  };
+  int64_t start = 0;
+  std::thread starter([&]() {
+    while (ready.load() < num_threads) {
+      std::this_thread::yield();
+    }
+    start = NowNanos();
+    go = true;
+  });
+  PyObject *result =
+      PyObject_CallFunction(python_drive, "ii", depth, num_threads);
+  int64_t end = NowNanos();
+  starter.join();
+  if (result == nullptr) {
+    PyErr_Print();
+    exit(1);
+  }
+  Py_DECREF(result);
+  return end - start;
+}
+
+void BenchmarkPopulateFrames(const Options &options, int depth) {
+  Params params = {"PopulateFrames", depth, 1, 1};
+  int num_frames = 0;
+  int64_t elapsed = RunPython(depth, 1, [&]() {
+    CallFrame frames[kMaxFramesToCapture];
+    for (int64_t i = 0; i < options.samples; i++) {
+      num_frames = PopulateFrames(frames, stub_thread_state);
+    }
+  });
+  PrintResult(params,
+              Format("ns_per_sample=%.2f frames=%d",
+                     static_cast<double>(elapsed) / options.samples,
+                     num_frames));
+}
+
+void BenchmarkHandle(const Options &options, int depth, int num_threads) {
+  Params params = {"Profiler::Handle", depth, 1, num_threads};
+  BenchmarkProfiler profiler;
+  GetThreadStateFunc original = get_thread_state_func;
+  get_thread_state_func = &StubThreadState;
+  int64_t elapsed = RunPython(depth, num_threads, [&]() {
+    for (int64_t i = 0; i < options.samples; i++) {
+      Profiler::Handle(SIGPROF, nullptr, nullptr);
+    }
+  });
+  get_thread_state_func = original;
+  int64_t start = NowNanos();
+  int entries = profiler.FinalFlush();
+  int64_t flush = NowNanos() - start;
+  PrintResult(params,
+              Format("ns_per_sample=%.2f flush_ns=%lld flushed_entries=%d",
+                     static_cast<double>(elapsed) / options.samples,
+                     static_cast<long long>(flush), entries));  // NOLINT
+}
+
+bool Selected(const Options &options, const char *name) {
+  return strstr(name, options.filter.c_str()) != nullptr;
+}
+
+std::vector<int> ParseList(const char *value) {
+  std::vector<int> list;
+  const char *p = value;
+  while (*p != '\0') {
+    char *end;
+    list.push_back(strtol(p, &end, 10));
+    if (*end != ',') {
+      break;
+    }
+    p = end + 1;
+  }
+  return list;
+}
+
+void Usage(const char *program) {
+  fprintf(stderr,
+          "Usage: %s [--depths=8,32,128] [--cardinalities=16,256,2048] "
+          "[--threads=1,4] [--samples=200000] [--filter=NAME]\n"
+          "Prints one line of key=value pairs per benchmark and parameters.\n",
+          program);
+}
+
+}  // namespace
+
+int main(int argc, char **argv) {
+  Options options;
+  for (int i = 1; i < argc; i++) {
+    const char *arg = argv[i];
+    if (strncmp(arg, "--depths=", 9) == 0) {
+      options.depths = ParseList(arg + 9);
+    } else if (strncmp(arg, "--cardinalities=", 16) == 0) {
+      options.cardinalities = ParseList(arg + 16);
+    } else if (strncmp(arg, "--threads=", 10) == 0) {
+      options.threads = ParseList(arg + 10);
+    } else if (strncmp(arg, "--samples=", 10) == 0) {
+      options.samples = strtoll(arg + 10, nullptr, 10);
+    } else if (strncmp(arg, "--filter=", 9) == 0) {
+      options.filter = arg + 9;
+    } else {
+      Usage(argv[0]);
+      return strcmp(arg, "--help") == 0 ? 0 : 2;
+    }
+  }
+  for (int depth : options.depths) {
+    if (depth < kMinDepth || depth > kMaxFramesToCapture) {
+      fprintf(stderr, "Depths must be between %d and %d\n", kMinDepth,
+              kMaxFramesToCapture);
+      return 2;
+    }
+  }
+
+  for (int depth : options.depths) {
+    if (Selected(options, "CalculateHash")) {
+      BenchmarkCalculateHash(options, depth);
+    }
+    for (int cardinality : options.cardinalities) {
+      if (Selected(options, "AsyncSafeTraceMultiset::Add")) {
+        for (int num_threads : options.threads) {
+          BenchmarkAsyncSafeAdd(options, depth, cardinality, num_threads);
+        }
+      }
+      if (Selected(options, "ShardedTraceMultiset::Add")) {
+        for (int num_threads : options.threads) {
+          BenchmarkShardedAdd(options, depth, cardinality, num_threads);
+        }
+      }
+      if (Selected(options, "AsyncSafeTraceMultiset::Extract")) {
+        BenchmarkExtract(options, depth, cardinality);
+      }
+      if (Selected(options, "HarvestSamples")) {
+        BenchmarkHarvestSamples(options, depth, cardinality);
+      }
+      if (Selected(options, "TraceMultiset::Add")) {
+        BenchmarkTraceMultisetAdd(options, depth, cardinality);
+      }
+    }
+  }
+
+  if (!Selected(options, "PopulateFrames") &&
+      !Selected(options, "Profiler::Handle")) {
+    return 0;
+  }
+  PyImport_AppendInittab("_trace_benchmark", &InitBenchmarkModule);
+  Py_Initialize();
+  PyObject *globals = PyDict_New();
+  PyDict_SetItemString(globals, "__builtins__", PyEval_GetBuiltins());
+  PyObject *result =
+      PyRun_String(kPythonDriver, Py_file_input, globals, globals);
+  if (result == nullptr) {
+    PyErr_Print();
+    return 1;
+  }
+  Py_DECREF(result);
+  python_drive = PyDict_GetItemString(globals, "drive");
+  for (int depth : options.depths) {
+    if (Selected(options, "PopulateFrames")) {
+      BenchmarkPopulateFrames(options, depth);
+    }
+    if (Selected(options, "Profiler::Handle")) {
+      for (int num_threads : options.threads) {
+        BenchmarkHandle(options, depth, num_threads);
+      }
+    }
+  }
+  return 0;
+}
@@ -0,0 +1,267 @@
+# Copyright 2026 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""End-to-end overhead benchmark of the native CPU profiler.
+
+Runs representative Python workloads with and without a concurrent call to
+_profiler.profile_cpu, as the agent's polling thread makes, at several sampling
+periods, and reports how profiling changes them. It needs no network and no
+credentials, only the built _profiler extension.
+
+Each result is printed to stdout as one JSON object per line, with the
+workload, the period, and:
+  throughput_delta_pct: Change of operations per second, in percent.
+  p99_latency_delta_pct: Change of the 99th percentile operation latency.
+  samples: Number of samples in the profile.
+  handler_us_per_sample: Average time spent in the signal handler, and
+    max_handler_us the longest, as measured by the profiler, see
+    _profiler.stats().
+  dropped_samples: Number of samples which didn't fit in the trace table.
+  end_pause_ms: Longest operation running between the end of the profile
+    duration and the return of profile_cpu, while the last traces are
+    aggregated and resolved, partly with GIL held. It compares with
+    baseline_max_latency_ms, the longest operation without profiling.
+  end_overrun_ms: Time profile_cpu took past the profile duration.
+
+Usage:
+  python3 benchmarks/overhead_benchmark.py [--workloads=cpu,io] \
+      [--periods=1,10,100] [--seconds=5] [--repeats=3]
+"""
+
+import argparse
+import json
+import socket
+import statistics
+import sys
+import threading
+import time
+
+from googlecloudprofiler import _profiler
+
+
+def _cpu_op():
+  total = 0
+  for i in range(2000):
+    total += i * i
+  return total
+
+
+def _recurse(depth):
+  if depth == 0:
+    return _cpu_op()
+  return _recurse(depth - 1)
+
+
+def _recursion_op():
+  return _recurse(200)
+
+
+class _EchoServer:
+  """Echoes messages over a local socket pair, from its own thread."""
+
+  def __init__(self):
+    self._client, self._server = socket.socketpair()
+    self._thread = threading.Thread(target=self._serve, daemon=True)
+    self._thread.start()
+
+  def _serve(self):
+    while True:
+      data = self._server.recv(4096)
+      if not data:
+        return
+      self._server.sendall(data)
+
+  def roundtrip(self):
+    self._client.sendall(b'x' * 512)
+    received = 0
+    while received < 512:
+      received += len(self._client.recv(4096))
+
+  def close(self):
+    self._client.close()
+    self._server.close()
+
+
+def _io_worker(deadline, latencies):
+  echo = _EchoServer()
+  try:
+    while time.monotonic() < deadline:
+      start = time.monotonic()
+      echo.roundtrip()
+      end = time.monotonic()
+      latencies.append((end, end - start))
+  finally:
+    echo.close()
+
+
+def _op_worker(op):
+
+  def worker(deadline, latencies):
+    while time.monotonic() < deadline:
+      start = time.monotonic()
+      op()
+      end = time.monotonic()
+      latencies.append((end, end - start))
+
+  return worker
+
+
+# Each workload is a worker function and the number of threads running it.
+_WORKLOADS = {
+    'cpu': (_op_worker(_cpu_op), 1),
+    'io': (_io_worker, 4),
+    'recursion': (_op_worker(_recursion_op), 1),
+    'threads': (_op_worker(_cpu_op), 32),
+}
+
+
+class _Worker(threading.Thread):
+  """Runs a worker function, recording the latencies of its operations."""
+
+  def __init__(self, target, deadline):
+    super().__init__()
+    self._target_func = target
+    self._deadline = deadline
+    self.latencies = []
+
+  def run(self):
+    self._target_func(self._deadline, self.latencies)
+
+
+def _run(workload, seconds, period_ms):
+  """Runs a workload for seconds, profiling it when period_ms is set.
+
+  Returns:
+    A dict with the latencies of the operations as (end time, latency) pairs,
+    the profile, the statistics of the profiler and the times around
+    profiling.
+  """
+  worker, num_threads = _WORKLOADS[workload]
+  result = {}
+  profiler = None
+  if period_ms:
+    # Profiles most of the run, so that the profile ends while the workload is
+    # running. The profile is collected from its own thread, as the agent does,
+    # and starts before the workers: a thread waiting for GIL behind many busy
+    # workers may not get it before they're done.
+    duration = seconds * 0.8
+
+    def profile():
+      result['profile_end'] = time.monotonic() + duration
+      result['traces'] = _profiler.profile_cpu(int(duration * 1e9), period_ms)
+      result['profile_return'] = time.monotonic()
+      result['stats'] = _profiler.stats()
+
+    profiler = threading.Thread(target=profile)
+    profiler.start()
+  start = time.monotonic()
+  deadline = start + seconds
+  threads = [_Worker(worker, deadline) for _ in range(num_threads)]
+  for thread in threads:
+    thread.start()
+  for thread in threads:
+    thread.join()
+  if profiler is not None:
+    profiler.join()
+  result['latencies'] = [l for thread in threads for l in thread.latencies]
+  result['elapsed'] = max(end for end, _ in result['latencies']) - start
+  return result
+
+
+def _p99(latencies):
+  values = sorted(latency for _, latency in latencies)
+  return values[min(len(values) - 1, int(len(values) * 0.99))]
+
+
+def _measure(workload, seconds, period_ms, repeats):
+  """Returns the median metrics of repeats runs."""
+  runs = []
+  for _ in range(repeats):
+    run = _run(workload, seconds, period_ms)
+    ops = len(run['latencies'])
+    metrics = {
+        'throughput': ops / run['elapsed'],
+        'p99_latency': _p99(run['latencies']),
+        'max_latency': max(latency for _, latency in run['latencies']),
+    }
+    if period_ms:
+      stats = run['stats']
+      metrics['samples'] = sum(run['traces'].values())
+      metrics['dropped_samples'] = (stats['table_full_samples'] +
+                                    stats['arena_full_samples'])
+      metrics['handler_nanos'] = (stats['handler_nanos'] / stats['signals']
+                                  if stats['signals'] else 0.0)
+      metrics['max_handler_nanos'] = stats['max_handler_nanos']
+      metrics['end_overrun'] = run['profile_return'] - run['profile_end']
+      metrics['end_pause'] = max(
+          [latency for end, latency in run['latencies']
+           if end >= run['profile_end'] and
+           end - latency <= run['profile_return']] or [0.0])
+    runs.append(metrics)
+  return {key: statistics.median(run[key] for run in runs) for key in runs[0]}
+
+
+def _delta_pct(value, baseline):
+  return round(100.0 * (value - baseline) / baseline, 2) if baseline else None
+
+
+def main(argv):
+  parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+  parser.add_argument(
+      '--workloads',
+      default=','.join(_WORKLOADS),
+      help='Comma-separated workloads among %s.' % ', '.join(_WORKLOADS))
+  parser.add_argument(
+      '--periods',
+      default='1,10,100',
+      help='Comma-separated sampling periods in milliseconds.')
+  parser.add_argument(
+      '--seconds', type=float, default=5, help='Duration of each run.')
+  parser.add_argument(
+      '--repeats',
+      type=int,
+      default=3,
+      help='Number of runs of each configuration, whose median is reported.')
+  args = parser.parse_args(argv)
+
+  for workload in args.workloads.split(','):
+    if workload not in _WORKLOADS:
+      parser.error('unknown workload %s' % workload)
+    baseline = _measure(workload, args.seconds, None, args.repeats)
+    for period_ms in [int(p) for p in args.periods.split(',')]:
+      profiled = _measure(workload, args.seconds, period_ms, args.repeats)
+      result = {
+          'workload': workload,
+          'period_ms': period_ms,
+          'baseline_throughput': round(baseline['throughput'], 2),
+          'throughput': round(profiled['throughput'], 2),
+          'throughput_delta_pct': _delta_pct(profiled['throughput'],
+                                             baseline['throughput']),
+          'baseline_p99_latency_ms': round(baseline['p99_latency'] * 1e3, 3),
+          'p99_latency_ms': round(profiled['p99_latency'] * 1e3, 3),
+          'p99_latency_delta_pct': _delta_pct(profiled['p99_latency'],
+                                              baseline['p99_latency']),
+          'baseline_max_latency_ms': round(baseline['max_latency'] * 1e3, 3),
+          'samples': profiled['samples'],
+          'dropped_samples': profiled['dropped_samples'],
+          'handler_us_per_sample': round(profiled['handler_nanos'] / 1e3, 3),
+          'max_handler_us': round(profiled['max_handler_nanos'] / 1e3, 3),
+          'end_pause_ms': round(profiled['end_pause'] * 1e3, 3),
+          'end_overrun_ms': round(profiled['end_overrun'] * 1e3, 3),
+      }
+      print(json.dumps(result, sort_keys=True))
+      sys.stdout.flush()
+
+
+if __name__ == '__main__':
+  main(sys.argv[1:])
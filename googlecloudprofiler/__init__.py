@@ -17,6 +17,7 @@ import logging
 import sys
 from googlecloudprofiler import __version__ as version
 from googlecloudprofiler import client
+from googlecloudprofiler import sample_labels
 
 _started = False
 
@@ -31,13 +32,19 @@ def start(service=None,
           disable_cpu_profiling=False,
           disable_wall_profiling=False,
           period_ms=10,
-          discovery_service_url=None):
+          discovery_service_url=None,
+          enable_heap_profiling=False,
+          enable_contention_profiling=False,
+          enable_native_frames=False,
+          cpu_overhead_budget=None,
+          enable_continuous_profiling=False,
+          enable_thread_labels=False):
   """Starts the profiler.
 
   This function starts a daemon thread which polls the profiler server for
   instructions, and collects and uploads profiles as requested. It should only
   be called once. Subsequent calls will be ignored. If wall profiling is
-  enabled, this function must be called on the main thread.
+  enabled on Mac, this function must be called on the main thread.
 
   Args:
     service: A string specifying the name of the service under which the
@@ -73,28 +80,71 @@ def start(service=None,
     disable_wall_profiling: An optional bool specifying whether or not the Wall
       time profiling should be disabled. Wall profiling is supported for Python
       2 and Python 3.6 and higher. This flag is ignored on unsupported Python
-      versions. It defaults to False for the supported versions. The current
-      wall time profiling avoids dependency on any native code by using Python
-      signal module. It only profiles the main thread. The start function must
-      be called from the main thread if wall time profiling is enabled.
-      Using SIGALRM signal after starting the profiler will cause problems:
-      registering a handler for SIGALRM will prevent the profiler from
-      working. SIGALRM will be trigger by the profiler at unpredictable time.
-      Wall profiling has some other limitations as documented in the
-      pythonprofiler module.
+      versions. It defaults to False for the supported versions. On Linux,
+      wall time profiling is native and samples all Python threads. On other
+      Operating Systems, it avoids dependency on any native code by using
+      Python signal module and only profiles the main thread. In that case, the
+      start function must be called from the main thread if wall time
+      profiling is enabled. Using SIGALRM signal after starting the profiler
+      will cause problems: registering a handler for SIGALRM will prevent the
+      profiler from working. SIGALRM will be trigger by the profiler at
+      unpredictable time. Wall profiling has some other limitations as
+      documented in the pythonprofiler module.
     period_ms: An optional integer specifying the sampling interval in
-      milliseconds. Applies to both CPU profiling and wall profiling. Defaults
-      to 10.
+      milliseconds. Applies to CPU, wall and contention profiling. Defaults to
+      10.
     discovery_service_url: Optional discovery service URL override. Only useful
       to developers of the profiler (to specify API key to use with a testing
       API endpoint).
+    enable_heap_profiling: An optional bool specifying whether or not the heap
+      profiling should be enabled. Heap profiling is only supported on Linux.
+      It samples the allocations made through the Python memory allocators
+      while a profile is collected, and reports the allocations made during
+      the collection and those still live at its end. Defaults to False.
+    enable_contention_profiling: An optional bool specifying whether or not the
+      GIL contention profiling should be enabled. It is only supported on
+      Linux. It samples all Python threads every period_ms, and reports the
+      time each Python stack spent holding the GIL, waiting for it, and after
+      releasing it, e.g. to sleep or to block in I/O. Waiting for the GIL is
+      only told apart on x86-64 with Python 3.9 to 3.11, elsewhere it's
+      reported as released. Defaults to False.
+    enable_native_frames: An optional bool specifying whether or not CPU
+      profiles should show the native C/C++ frames along with the Python
+      frames, e.g. the functions of C extensions. Native frames are unwound
+      with frame pointers, so native code built without them is only shown
+      partially. Defaults to False.
+    cpu_overhead_budget: An optional float specifying the target fraction of
+      one CPU spent on CPU profiling, e.g. 0.005 for 0.5%. When specified, the
+      CPU sampling interval starts at period_ms and is adapted during each
+      profile to stay near the target: it grows when sampling costs more and
+      shrinks when the process is idle, within 1 to 100 milliseconds. Samples
+      are weighted by the interval in effect. Defaults to None, which keeps
+      the interval fixed.
+    enable_continuous_profiling: An optional bool specifying whether or not
+      CPU time should be sampled all the time, every 100 milliseconds, into a
+      ring of 10-second windows, rather than only while a profile is
+      collected. CPU profiles are then built from the windows of the profile
+      duration, and lag behind by up to one window. It is only supported on
+      Linux. As it holds the native sampler, heap and GIL contention
+      profiling are disabled and wall profiling falls back to the Python
+      implementation. period_ms, enable_native_frames and cpu_overhead_budget
+      don't apply to it. Defaults to False.
+    enable_thread_labels: An optional bool specifying whether or not the
+      samples of CPU, wall and GIL contention profiles should be labelled with
+      the ID and the name of the thread they were taken on, as 'thread_id' and
+      'thread_name', the name being the one given by the threading module or
+      else the operating system's. The samples of different threads are then
+      kept apart, which makes profiles larger. Only the first 256 threads
+      sampled in a profile are labelled. It is only supported on Linux, and
+      not by the Python implementation of the wall profiler. Defaults to
+      False, which merges the samples of all threads.
 
   Raises:
     ValueError: If arguments are invalid or if necessary information can't be
       determined from the environment and arguments. Or if service name doesn't
       match '^[a-z0-9]([-a-z0-9_.]{0,253}[a-z0-9])?$'. Or if called from
-      a non-main thread when Wall time profiling is enabled. Or if no profiling
-      mode is enabled.
+      a non-main thread when Wall time profiling is enabled on Mac. Or if no
+      profiling mode is enabled.
     NotImplementedError: If not run on Linux or Mac.
   """
   global _started
@@ -125,9 +175,73 @@ def start(service=None,
   project_id = profiler_client.setup_auth(project_id, service_account_json_file)
   profiler_client.config(project_id, service, service_version,
                          disable_cpu_profiling, disable_wall_profiling,
-                         period_ms, discovery_service_url)
+                         period_ms, discovery_service_url,
+                         enable_heap_profiling, enable_contention_profiling,
+                         enable_native_frames, cpu_overhead_budget,
+                         enable_continuous_profiling, enable_thread_labels)
   logger.info('Google Cloud Profiler Python agent version: %s',
               version.__version__)
   profiler_client.start()
 
   _started = True
+
+
+def labels(**kwargs):
+  """Returns a context manager labelling the samples taken in its block.
+
+  The labels are attached to the samples of the CPU, wall and GIL contention
+  profiles, like the labels of Go's pprof, e.g. to split the CPU time of a
+  server by endpoint and tenant:
+
+    with googlecloudprofiler.labels(endpoint='/search', tenant=tenant):
+      handle(request)
+
+  Labels nest, the inner blocks adding to or overriding the labels of the
+  outer ones. They follow the current context of the contextvars module, so
+  that concurrent asyncio tasks of a thread are labelled separately. A task or
+  thread started in the block is not labelled, unless it enters a block of
+  its own, e.g. with labels(**sample_labels.current()).
+
+  Each distinct set of labels is kept for the lifetime of the process, and
+  only the first 4096 sets label samples, so label values should be picked
+  from a bounded set, e.g. endpoint names rather than request IDs. Labels are
+  only supported on Linux, and have no effect elsewhere or on the Python
+  implementation of the wall profiler.
+
+  Args:
+    **kwargs: The labels, whose values are converted to strings.
+
+  Returns:
+    A context manager.
+  """
+  return sample_labels.labels(**kwargs)
+
+
+def start_burst(period_us, duration, **kwargs):
+  """Starts a high-frequency CPU profile in the background.
+
+  It's meant for in-process watchdogs, e.g. to capture the next few seconds in
+  detail when a latency objective is missed. It returns at once, and the
+  profile is collected natively. It is independent from start(), and is only
+  supported on Linux.
+
+  Args:
+    period_us: An integer specifying the sampling interval in microseconds,
+      at least 10. Periods below a millisecond are supported.
+    duration: A number specifying the duration of the capture in seconds.
+    **kwargs: Options of cpu_profiler.start_burst().
+
+  Returns:
+    A handle whose collect() method waits for the end of the capture and
+    returns a gzip-compressed profile proto, and whose done() method tells
+    whether it ended.
+
+  Raises:
+    NotImplementedError: If not run on Linux.
+    RuntimeError: If another capture or profile is in progress.
+  """
+  if not sys.platform.startswith('linux'):
+    raise NotImplementedError('%s OS is not supported.' % (sys.platform))
+  # pylint: disable=g-import-not-at-top
+  from googlecloudprofiler import cpu_profiler
+  return cpu_profiler.start_burst(period_us, duration, **kwargs)
@@ -34,10 +34,17 @@ from googlecloudprofiler import __version__ as version
 from googlecloudprofiler import backoff
 # pylint: disable=g-import-not-at-top
 if sys.platform.startswith('linux'):
+  from googlecloudprofiler import contention_profiler
   from googlecloudprofiler import cpu_profiler
+  from googlecloudprofiler import heap_profiler
+  from googlecloudprofiler import wall_profiler
 else:
-  # CPU profiling is only supported on Linux.
+  # CPU, heap, contention and native wall profiling are only supported on
+  # Linux.
+  contention_profiler = None
   cpu_profiler = None
+  heap_profiler = None
+  wall_profiler = None
 from googlecloudprofiler import pythonprofiler
 import httplib2
 import requests
@@ -99,6 +106,7 @@ class Client:
     self._backoff = backoff.Backoff()
     self._filter_log()
     self._started = False
+    self._continuous = False
     self._profiler_service = None
 
   def setup_auth(self, project_id=None, service_account_json_file=None):
@@ -132,7 +140,10 @@ class Client:
     return project_id
 
   def config(self, project_id, service, service_version, disable_cpu_profiling,
-             disable_wall_profiling, period_ms, discovery_service_url):
+             disable_wall_profiling, period_ms, discovery_service_url,
+             enable_heap_profiling=False, enable_contention_profiling=False,
+             enable_native_frames=False, cpu_overhead_budget=None,
+             enable_continuous_profiling=False, enable_thread_labels=False):
     """Sets up the client config.
 
     Args:
@@ -154,6 +165,21 @@ class Client:
       period_ms: An integer specifying the sampling interval in milliseconds.
       discovery_service_url: A URL that points to the location of the discovery
         service.
+      enable_heap_profiling: A bool specifying whether or not the HEAP
+        profiling should be enabled. See docs in __init__.py for more details.
+      enable_contention_profiling: A bool specifying whether or not the GIL
+        CONTENTION profiling should be enabled. See docs in __init__.py for
+        more details.
+      enable_native_frames: A bool specifying whether or not CPU profiles
+        should have native frames. See docs in __init__.py for more details.
+      cpu_overhead_budget: An optional float specifying the target fraction of
+        one CPU spent on CPU profiling. See docs in __init__.py for more
+        details.
+      enable_continuous_profiling: A bool specifying whether or not CPU
+        profiles should be built from an always-on sampler. See docs in
+        __init__.py for more details.
+      enable_thread_labels: A bool specifying whether or not samples should be
+        labelled with their thread. See docs in __init__.py for more details.
 
     Raises:
       ValueError: If the project ID or service can't be determined from the
@@ -162,8 +188,19 @@ class Client:
         enabled.
     """
     self._profilers = {}
-    self._config_cpu_profiling(disable_cpu_profiling, period_ms)
-    self._config_wall_profiling(disable_wall_profiling, period_ms)
+    self._config_cpu_profiling(disable_cpu_profiling, period_ms,
+                               enable_native_frames, cpu_overhead_budget,
+                               enable_continuous_profiling,
+                               enable_thread_labels)
+    # The continuous CPU profiler holds the native sampler, which the other
+    # native profilers would need for each of their profiles.
+    self._continuous = (
+        enable_continuous_profiling and 'CPU' in self._profilers)
+    self._config_wall_profiling(disable_wall_profiling, period_ms,
+                                self._continuous, enable_thread_labels)
+    self._config_heap_profiling(enable_heap_profiling, self._continuous)
+    self._config_contention_profiling(enable_contention_profiling, period_ms,
+                                      self._continuous, enable_thread_labels)
     if not self._profilers:
       raise ValueError('No profiling mode is enabled.')
 
@@ -214,20 +251,25 @@ class Client:
 
     Raises:
       ValueError: If called from a non-main thread when Wall time profiling
-        is enabled.
+        is enabled on an Operating System other than Linux.
     """
     if self._started:
       logger.warning('Profiler already started, will not start again')
       return
 
-    if 'WALL' in self._profilers:
+    if isinstance(self._profilers.get('WALL'), pythonprofiler.WallProfiler):
       self._profilers['WALL'].register_handler()
+    if self._continuous:
+      self._profilers['CPU'].start()
     self._polling_thread = threading.Thread(target=self._poll_profiler_service)
     self._polling_thread.name = 'Profiler API polling thread'
     self._polling_thread.daemon = True
     self._polling_thread.start()
 
-  def _config_cpu_profiling(self, disable_cpu_profiling, period_ms):
+  def _config_cpu_profiling(self, disable_cpu_profiling, period_ms,
+                            enable_native_frames, cpu_overhead_budget=None,
+                            enable_continuous_profiling=False,
+                            thread_labels=False):
     """Adds CPU profiler if CPU profiling is supported and not disabled."""
     cpu_profiling_supported = cpu_profiler is not None
     if not cpu_profiling_supported:
@@ -235,16 +277,56 @@ class Client:
                   'System. Linux is the only supported Operating System.')
     elif disable_cpu_profiling:
       logger.info('CPU profiling is disabled by disable_cpu_profiling')
+    elif enable_continuous_profiling:
+      self._profilers['CPU'] = cpu_profiler.ContinuousCPUProfiler(
+          thread_labels=thread_labels)
     else:
-      self._profilers['CPU'] = cpu_profiler.CPUProfiler(period_ms)
-
-  def _config_wall_profiling(self, disable_wall_profiling, period_ms):
+      self._profilers['CPU'] = cpu_profiler.CPUProfiler(
+          period_ms,
+          native_frames=enable_native_frames,
+          overhead_budget=cpu_overhead_budget,
+          thread_labels=thread_labels)
+
+  def _config_wall_profiling(self, disable_wall_profiling, period_ms,
+                             continuous=False, thread_labels=False):
     """Adds wall profiler if wall profiling is supported and not disabled."""
     if disable_wall_profiling:
       logger.info('Wall profiling is disabled by disable_wall_profiling')
+    elif wall_profiler is not None and not continuous:
+      self._profilers['WALL'] = wall_profiler.WallProfiler(
+          period_ms, thread_labels=thread_labels)
     else:
       self._profilers['WALL'] = pythonprofiler.WallProfiler(period_ms)
 
+  def _config_heap_profiling(self, enable_heap_profiling, continuous=False):
+    """Adds heap profiler if heap profiling is supported and enabled."""
+    if not enable_heap_profiling:
+      return
+    if continuous:
+      logger.info('Heap profiling is disabled by continuous profiling')
+    elif heap_profiler is None:
+      logger.info('Heap profiling is not supported on the current Operating '
+                  'System. Linux is the only supported Operating System.')
+    else:
+      self._profilers['HEAP'] = heap_profiler.HeapProfiler()
+
+  def _config_contention_profiling(self, enable_contention_profiling,
+                                   period_ms, continuous=False,
+                                   thread_labels=False):
+    """Adds contention profiler if it is supported and enabled."""
+    if not enable_contention_profiling:
+      return
+    if continuous:
+      logger.info('GIL contention profiling is disabled by continuous '
+                  'profiling')
+    elif contention_profiler is None:
+      logger.info('GIL contention profiling is not supported on the current '
+                  'Operating System. Linux is the only supported Operating '
+                  'System.')
+    else:
+      self._profilers['CONTENTION'] = contention_profiler.ContentionProfiler(
+          period_ms, thread_labels=thread_labels)
+
   def _build_service(self):
     """Builds a discovery client for talking to the Profiler."""
     http = httplib2.Http(timeout=_PROFILER_SERVICE_TIMEOUT_SEC)
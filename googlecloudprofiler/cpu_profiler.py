@@ -13,9 +13,10 @@
 # limitations under the License.
 """CPU time profiler."""
 
+import atexit
 import logging
+import time
 from googlecloudprofiler import _profiler
-from googlecloudprofiler import builder
 
 logger = logging.getLogger(__name__)
 
@@ -27,15 +28,66 @@ class CPUProfiler:
   a gzip-compressed profile proto.
   """
 
-  def __init__(self, period_ms=10):
+  def __init__(self,
+               period_ms=10,
+               per_thread_timers=False,
+               max_traces=None,
+               max_arena_frames=None,
+               native_frames=False,
+               overhead_budget=None,
+               timeline_records=None,
+               thread_labels=False):
     """Constructs the CPU time profiler.
 
     Args:
       period_ms: An optional integer specifying the sampling interval in
         milliseconds. Defaults to 10.
+      per_thread_timers: An optional bool specifying whether each thread's CPU
+        time should be measured by a timer of its own, instead of a single
+        process-wide timer. This avoids losing samples when many threads are
+        busy at the same time. Defaults to False.
+      max_traces: An optional integer specifying the maximum number of distinct
+        traces recorded during a profile. Samples of traces which don't fit
+        are reported as unknown. Defaults to the native default.
+      max_arena_frames: An optional integer specifying the maximum number of
+        frames recorded across all distinct traces during a profile. Defaults
+        to the native default.
+      native_frames: An optional bool specifying whether native C/C++ frames
+        should be unwound and shown along with the Python frames. Native code
+        is only unwound past when built with frame pointers. Defaults to
+        False.
+      overhead_budget: An optional float specifying the target fraction of one
+        CPU spent on profiling, e.g. 0.005. When specified, the sampling
+        interval starts at period_ms and is adapted during the profile to stay
+        near the target, between 1 and 100 milliseconds. Defaults to None,
+        which keeps the sampling interval fixed.
+      timeline_records: An optional integer specifying the number of samples
+        whose time, thread and trace are recorded in a ring, in addition to
+        the aggregated profile. The timeline of the last profile is returned
+        by timeline.last(). At most 1048576. Defaults to None, which records no
+        timeline.
+      thread_labels: An optional bool specifying whether samples should be
+        labelled with the ID and the name of the thread they were taken on,
+        keeping apart the traces of different threads. Only the first 256
+        threads sampled in a profile are labelled. Defaults to False, which
+        merges the samples of all threads.
     """
     self._profile_type = 'CPU'
     self._period_ms = period_ms
+    self._per_thread_timers = per_thread_timers
+    self._options = {}
+    if native_frames:
+      self._options['native_frames'] = True
+    if max_traces is not None:
+      self._options['max_traces'] = max_traces
+    if max_arena_frames is not None:
+      self._options['max_arena_frames'] = max_arena_frames
+    if overhead_budget is not None:
+      self._options['overhead_budget'] = overhead_budget
+    if timeline_records is not None:
+      self._options['timeline_records'] = timeline_records
+    if thread_labels:
+      self._options['thread_labels'] = True
 
   def profile(self, duration_ns):
     """Profiles the CPU time usage for the given duration.
@@ -46,14 +98,191 @@ class CPUProfiler:
     Returns:
       A bytes object containing gzip-compressed profile proto.
     """
-    traces = self._profile(duration_ns)
-    return self._build_profile(duration_ns, traces)
+    # The profile proto is built natively from the collected traces, which
+    # avoids holding the GIL while building it in Python.
+    return _profiler.profile_cpu_serialized(duration_ns, self._period_ms,
+                                            self._per_thread_timers,
+                                            **self._options)
 
-  def _profile(self, duration_ns):
-    return _profiler.profile_cpu(duration_ns, self._period_ms)
 
-  def _build_profile(self, duration_ns, traces):
-    profile_builder = builder.Builder()
-    profile_builder.populate_profile(traces, self._profile_type, 'nanoseconds',
-                                     self._period_ms * 1000 * 1000, duration_ns)
-    return profile_builder.emit()
+class ContinuousCPUProfiler:
+  """Continuous CPU time profiler.
+
+  The profiler samples the CPU time usage all the time, at a low rate, into a
+  ring of fixed-length windows kept natively. A profile is built on demand
+  from the windows overlapping a time range, without starting a collection of
+  its own. While it runs, no other native profile can be collected.
+  """
+
+  def __init__(self,
+               period_ms=100,
+               window_ms=10000,
+               max_windows=30,
+               per_thread_timers=False,
+               max_traces=None,
+               max_arena_frames=None,
+               thread_labels=False):
+    """Constructs the continuous CPU time profiler.
+
+    Args:
+      period_ms: An optional integer specifying the sampling interval in
+        milliseconds. Defaults to 100.
+      window_ms: An optional integer specifying the length of a window in
+        milliseconds. Defaults to 10000.
+      max_windows: An optional integer specifying the number of windows kept,
+        the oldest being dropped first. Defaults to 30, i.e. the last 5
+        minutes with the default window length.
+      per_thread_timers: An optional bool specifying whether each thread's CPU
+        time should be measured by a timer of its own, see CPUProfiler.
+        Defaults to False.
+      max_traces: An optional integer specifying the maximum number of distinct
+        traces recorded between two flushes of the native trace table.
+        Defaults to the native default.
+      max_arena_frames: An optional integer specifying the maximum number of
+        frames recorded across these traces. Defaults to the native default.
+      thread_labels: An optional bool specifying whether samples should be
+        labelled with their thread, see CPUProfiler. Up to 256 threads are
+        labelled per window. Defaults to False.
+    """
+    self._profile_type = 'CPU'
+    self._options = {
+        'period_msec': period_ms,
+        'window_nanos': window_ms * 1000 * 1000,
+        'max_windows': max_windows,
+        'per_thread_timers': per_thread_timers,
+        'thread_labels': thread_labels,
+    }
+    if max_traces is not None:
+      self._options['max_traces'] = max_traces
+    if max_arena_frames is not None:
+      self._options['max_arena_frames'] = max_arena_frames
+
+  def start(self):
+    """Starts sampling, until stop() is called or the process exits."""
+    _profiler.start_continuous(**self._options)
+    atexit.register(self.stop)
+
+  def stop(self):
+    """Stops sampling. The windows collected can still be exported."""
+    _profiler.stop_continuous()
+
+  def windows(self):
+    """Returns the (start, end) times of the windows kept, oldest first.
+
+    Returns:
+      A list of pairs of integers, in nanoseconds since the epoch.
+    """
+    return _profiler.continuous_windows()
+
+  def export(self, start_ns=0, end_ns=0):
+    """Merges the windows overlapping a time range into a profile.
+
+    Args:
+      start_ns: An optional integer specifying the start of the range in
+        nanoseconds since the epoch. Defaults to 0.
+      end_ns: An optional integer specifying the end of the range in
+        nanoseconds since the epoch, or 0 for no end. Defaults to 0.
+
+    Returns:
+      A bytes object containing gzip-compressed profile proto.
+    """
+    return _profiler.continuous_profile(start_ns, end_ns)
+
+  def profile(self, duration_ns):
+    """Returns the CPU time usage of the last duration.
+
+    The profile is made of the windows which ended during the last duration,
+    after waiting for it, so it lags behind by up to one window.
+
+    Args:
+      duration_ns: An integer specifying the duration to profile in nanoseconds.
+
+    Returns:
+      A bytes object containing gzip-compressed profile proto.
+    """
+    time.sleep(duration_ns / 1e9)
+    return self.export(time.time_ns() - duration_ns)
+
+
+class BurstCapture:
+  """A high-frequency CPU profile collected in the background.
+
+  It's returned by start_burst(). The profile is collected natively, so no
+  Python thread is blocked until collect() is called.
+  """
+
+  def __init__(self, burst_id):
+    self._id = burst_id
+
+  def done(self):
+    """Returns whether the capture ended, so that collect() won't block."""
+    return _profiler.burst_done(self._id)
+
+  def collect(self):
+    """Waits for the capture to end, and returns its profile.
+
+    It can only be called once.
+
+    Returns:
+      A bytes object containing gzip-compressed profile proto.
+    """
+    return _profiler.collect_burst(self._id)
+
+
+def start_burst(period_us,
+                duration,
+                max_traces=None,
+                max_arena_frames=None,
+                native_frames=False,
+                timeline_records=None,
+                thread_labels=False):
+  """Starts a high-frequency CPU profile, and returns without waiting for it.
+
+  The threads are sampled by high-resolution timers, so periods below a
+  millisecond are supported. Each thread gets a signal every period even when
+  it's idle, so short periods cost more with many threads.
+
+  A single capture runs at a time, and it holds the native profiler while it
+  samples, so the agent's CPU, wall, heap and contention profiles fail
+  meanwhile. Its profile is built when it ends, and kept until it's collected.
+  A capture which ended but wasn't collected is discarded when another one
+  starts.
+
+  Args:
+    period_us: An integer specifying the sampling interval in microseconds,
+      at least 10.
+    duration: A number specifying the duration of the capture in seconds.
+    max_traces: An optional integer specifying the maximum number of distinct
+      traces recorded between two flushes of the native trace table, every 100
+      milliseconds. Defaults to the native default.
+    max_arena_frames: An optional integer specifying the maximum number of
+      frames recorded across these traces. Defaults to the native default.
+    native_frames: An optional bool specifying whether native C/C++ frames
+      should be shown along with the Python frames, see CPUProfiler. Defaults
+      to False.
+    timeline_records: An optional integer specifying the number of samples
+      recorded in a timeline, see CPUProfiler. The timeline is returned by
+      timeline.last() once the capture is collected. Defaults to None.
+    thread_labels: An optional bool specifying whether samples should be
+      labelled with their thread, see CPUProfiler. Defaults to False.
+
+  Returns:
+    A BurstCapture, whose collect() method returns the profile.
+
+  Raises:
+    RuntimeError: If another capture or profile is in progress.
+    ValueError: If the arguments are invalid.
+  """
+  options = {}
+  if native_frames:
+    options['native_frames'] = True
+  if max_traces is not None:
+    options['max_traces'] = max_traces
+  if max_arena_frames is not None:
+    options['max_arena_frames'] = max_arena_frames
+  if timeline_records is not None:
+    options['timeline_records'] = timeline_records
+  if thread_labels:
+    options['thread_labels'] = True
+  return BurstCapture(
+      _profiler.start_burst(period_us, int(duration * 1e9), **options))
@@ -0,0 +1,51 @@
+# Copyright 2026 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Native heap profiler."""
+
+import logging
+from googlecloudprofiler import _profiler
+
+logger = logging.getLogger(__name__)
+
+
+class HeapProfiler:
+  """Heap profiler.
+
+  Samples the allocations made through the Python memory allocators while
+  collecting, by wrapping them with PyMem_SetAllocator. The profile has the
+  number and size of the allocations made during the collection, and of those
+  still live at its end. Allocations made before the collection started are
+  not accounted for.
+  """
+
+  def __init__(self, sampling_bytes=512 * 1024):
+    """Constructs the heap profiler.
+
+    Args:
+      sampling_bytes: An optional integer specifying the mean number of bytes
+        allocated between two samples. Defaults to 512 KiB.
+    """
+    self._profile_type = 'HEAP'
+    self._sampling_bytes = sampling_bytes
+
+  def profile(self, duration_ns):
+    """Profiles the allocations for the given duration.
+
+    Args:
+      duration_ns: An integer specifying the duration to profile in nanoseconds.
+
+    Returns:
+      A bytes object containing gzip-compressed profile proto.
+    """
+    return _profiler.profile_heap(duration_ns, self._sampling_bytes)
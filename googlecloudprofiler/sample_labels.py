@@ -0,0 +1,58 @@
+# Copyright 2026 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Application-defined labels of the samples of the native profilers."""
+
+import contextlib
+import contextvars
+
+try:
+  from googlecloudprofiler import _profiler  # pylint: disable=g-import-not-at-top
+except ImportError:
+  _profiler = None
+
+# The labels in effect in the current context, as a dict, and the ID of their
+# native label set.
+_current = contextvars.ContextVar('googlecloudprofiler_labels',
+                                  default=({}, 0))
+
+
+def current():
+  """Returns the labels in effect in the current context, as a dict."""
+  return dict(_current.get()[0])
+
+
+@contextlib.contextmanager
+def labels(**kwargs):
+  """Labels the samples taken while the block runs, see __init__.labels()."""
+  outer_labels, _ = _current.get()
+  inner_labels = dict(outer_labels)
+  inner_labels.update((key, str(value)) for key, value in kwargs.items())
+  label_set = 0
+  if _profiler is not None:
+    label_set = _profiler.intern_labels(tuple(inner_labels.items()))
+  token = _current.set((inner_labels, label_set))
+  # Setting the variable creates the current context if there was none, which
+  # the native table is keyed by.
+  context, outer_label_set = (None, 0)
+  if _profiler is not None:
+    context, outer_label_set = _profiler.set_context_labels(label_set)
+  try:
+    yield
+  finally:
+    # The block may end in another context than it started in, e.g. when a
+    # coroutine is finalized by the garbage collector, so the mapping of the
+    # context it started in is restored.
+    if context is not None:
+      _profiler.set_context_labels(outer_label_set, context)
+    _current.reset(token)
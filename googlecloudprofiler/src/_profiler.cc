@@ -14,23 +14,415 @@
 
 #include <Python.h>
 
+#include <algorithm>
+#include <memory>
+
+#include "burst_profiler.h"
 #include "clock.h"
+#include "continuous_profiler.h"
+#include "heap_profiler.h"
 #include "profiler.h"
+#include "profile_builder.h"
+#include "profiler_stats.h"
+#include "sample_labels.h"
+#include "timeline.h"
 
 namespace {
-PyObject* ProfileCPU(PyObject* self, PyObject* args) {
+// Parses the arguments of profile_cpu and profile_cpu_serialized, and
+// creates the profiler. Returns nullptr with a Python exception set if the
+// arguments are invalid.
+CPUProfiler* NewCPUProfiler(PyObject* args, PyObject* kwargs) {
+  static const char* kwlist[] = {
+      "duration_nanos",   "period_msec",   "per_thread_timers", "max_traces",
+      "max_arena_frames", "native_frames", "overhead_budget",
+      "timeline_records", "thread_labels",     nullptr};
+  uint64_t duration_nanos = 0;
+  uint64_t period_msec = 0;
+  int per_thread_timers = 0;
+  int native_frames = 0;
+  double overhead_budget = 0;
+  long long max_traces =  // NOLINT
+      AsyncSafeTraceMultiset::kDefaultMaxEntries;
+  long long max_arena_frames =  // NOLINT
+      AsyncSafeTraceMultiset::kDefaultMaxArenaFrames;
+  long long timeline_records = 0;  // NOLINT
+  int thread_labels = 0;
+  if (!PyArg_ParseTupleAndKeywords(
+          args, kwargs, "LL|pLLpdLp", const_cast<char**>(kwlist),
+          &duration_nanos, &period_msec, &per_thread_timers, &max_traces,
+          &max_arena_frames, &native_frames, &overhead_budget,
+          &timeline_records, &thread_labels)) {
+    return nullptr;
+  }
+  if (max_traces <= 0 || max_arena_frames <= 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "max_traces and max_arena_frames must be positive");
+    return nullptr;
+  }
+  if (timeline_records < 0 ||
+      timeline_records > SampleTimeline::kMaxCapacity) {
+    PyErr_Format(
+        PyExc_ValueError, "timeline_records must be between 0 and %lld",
+        static_cast<long long>(SampleTimeline::kMaxCapacity));  // NOLINT
+    return nullptr;
+  }
+  if (overhead_budget < 0 || overhead_budget >= 1) {
+    PyErr_SetString(PyExc_ValueError,
+                    "overhead_budget must be at least 0 and less than 1");
+    return nullptr;
+  }
+
+  CPUProfiler* p = new CPUProfiler(
+      duration_nanos, period_msec * kNanosPerMilli, per_thread_timers,
+      max_traces, max_arena_frames, native_frames, overhead_budget);
+  p->EnableTimeline(timeline_records);
+  p->EnableThreadLabels(thread_labels);
+  return p;
+}
+
+PyObject* ProfileCPU(PyObject* self, PyObject* args, PyObject* kwargs) {
+  std::unique_ptr<CPUProfiler> p(NewCPUProfiler(args, kwargs));
+  if (p == nullptr) {
+    return nullptr;
+  }
+  return p->Collect();
+}
+
+PyObject* ProfileCPUSerialized(PyObject* self, PyObject* args,
+                               PyObject* kwargs) {
+  std::unique_ptr<CPUProfiler> p(NewCPUProfiler(args, kwargs));
+  if (p == nullptr) {
+    return nullptr;
+  }
+  return p->CollectProfile();
+}
+
+// Parses the arguments of profile_wall and profile_contention. Returns false
+// with a Python exception set if the arguments are invalid.
+bool ParseWallArgs(PyObject* args, PyObject* kwargs, uint64_t* duration_nanos,
+                   uint64_t* period_msec, int* thread_labels) {
+  static const char* kwlist[] = {"duration_nanos", "period_msec",
+                                 "thread_labels", nullptr};
+  return PyArg_ParseTupleAndKeywords(args, kwargs, "LL|p",
+                                     const_cast<char**>(kwlist),
+                                     duration_nanos, period_msec,
+                                     thread_labels);
+}
+
+PyObject* ProfileWall(PyObject* self, PyObject* args, PyObject* kwargs) {
   uint64_t duration_nanos = 0;
   uint64_t period_msec = 0;
-  if (!PyArg_ParseTuple(args, "LL", &duration_nanos, &period_msec)) {
+  int thread_labels = 0;
+  if (!ParseWallArgs(args, kwargs, &duration_nanos, &period_msec,
+                     &thread_labels)) {
     return nullptr;
   }
 
-  CPUProfiler p(duration_nanos, period_msec * kNanosPerMilli);
-  return p.Collect();
+  WallProfiler p(duration_nanos, period_msec * kNanosPerMilli);
+  p.EnableThreadLabels(thread_labels);
+  return p.CollectProfile();
+}
+
+PyObject* ProfileContention(PyObject* self, PyObject* args,
+                            PyObject* kwargs) {
+  uint64_t duration_nanos = 0;
+  uint64_t period_msec = 0;
+  int thread_labels = 0;
+  if (!ParseWallArgs(args, kwargs, &duration_nanos, &period_msec,
+                     &thread_labels)) {
+    return nullptr;
+  }
+
+  ContentionProfiler p(duration_nanos, period_msec * kNanosPerMilli);
+  p.EnableThreadLabels(thread_labels);
+  return p.CollectProfile();
+}
+
+PyObject* ProfileHeap(PyObject* self, PyObject* args, PyObject* kwargs) {
+  static const char* kwlist[] = {"duration_nanos", "sampling_bytes",
+                                 "max_traces", "max_arena_frames", nullptr};
+  uint64_t duration_nanos = 0;
+  long long sampling_bytes =  // NOLINT
+      HeapProfiler::kDefaultSamplingBytes;
+  long long max_traces =  // NOLINT
+      AsyncSafeTraceMultiset::kDefaultMaxEntries;
+  long long max_arena_frames =  // NOLINT
+      AsyncSafeTraceMultiset::kDefaultMaxArenaFrames;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "L|LLL",
+                                   const_cast<char**>(kwlist), &duration_nanos,
+                                   &sampling_bytes, &max_traces,
+                                   &max_arena_frames)) {
+    return nullptr;
+  }
+  if (sampling_bytes <= 0 || max_traces <= 0 || max_arena_frames <= 0) {
+    PyErr_SetString(
+        PyExc_ValueError,
+        "sampling_bytes, max_traces and max_arena_frames must be positive");
+    return nullptr;
+  }
+
+  HeapProfiler p(duration_nanos, sampling_bytes, max_traces, max_arena_frames);
+  return p.CollectProfile();
+}
+
+PyObject* StartContinuous(PyObject* self, PyObject* args, PyObject* kwargs) {
+  static const char* kwlist[] = {
+      "period_msec", "window_nanos",     "max_windows",   "per_thread_timers",
+      "max_traces",  "max_arena_frames", "thread_labels", nullptr};
+  long long period_msec = 100;                    // NOLINT
+  long long window_nanos = 10 * kNanosPerSecond;  // NOLINT
+  long long max_windows = 30;                     // NOLINT
+  int per_thread_timers = 0;
+  long long max_traces =  // NOLINT
+      AsyncSafeTraceMultiset::kDefaultMaxEntries;
+  long long max_arena_frames =  // NOLINT
+      AsyncSafeTraceMultiset::kDefaultMaxArenaFrames;
+  int thread_labels = 0;
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|LLLpLLp",
+                                   const_cast<char**>(kwlist), &period_msec,
+                                   &window_nanos, &max_windows,
+                                   &per_thread_timers, &max_traces,
+                                   &max_arena_frames, &thread_labels)) {
+    return nullptr;
+  }
+  if (period_msec <= 0 || window_nanos <= 0 || max_windows <= 0 ||
+      max_traces <= 0 || max_arena_frames <= 0) {
+    PyErr_SetString(PyExc_ValueError,
+                    "period_msec, window_nanos, max_windows, max_traces and "
+                    "max_arena_frames must be positive");
+    return nullptr;
+  }
+
+  if (!ContinuousProfiler::Start(period_msec * kNanosPerMilli, window_nanos,
+                                 max_windows, per_thread_timers, max_traces,
+                                 max_arena_frames, thread_labels)) {
+    return nullptr;
+  }
+  Py_RETURN_NONE;
+}
+
+PyObject* StopContinuous(PyObject* self, PyObject* args) {
+  ContinuousProfiler::Stop();
+  Py_RETURN_NONE;
+}
+
+PyObject* ContinuousWindows(PyObject* self, PyObject* args) {
+  return ContinuousProfiler::Windows();
+}
+
+PyObject* ContinuousProfile(PyObject* self, PyObject* args, PyObject* kwargs) {
+  static const char* kwlist[] = {"start_nanos", "end_nanos", nullptr};
+  long long start_nanos = 0;  // NOLINT
+  long long end_nanos = 0;    // NOLINT
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|LL",
+                                   const_cast<char**>(kwlist), &start_nanos,
+                                   &end_nanos)) {
+    return nullptr;
+  }
+  return ContinuousProfiler::Export(start_nanos, end_nanos);
+}
+
+PyObject* StartBurst(PyObject* self, PyObject* args, PyObject* kwargs) {
+  static const char* kwlist[] = {
+      "period_usec",   "duration_nanos",   "max_traces",    "max_arena_frames",
+      "native_frames", "timeline_records", "thread_labels", nullptr};
+  long long period_usec = 0;     // NOLINT
+  long long duration_nanos = 0;  // NOLINT
+  int native_frames = 0;
+  long long max_traces =  // NOLINT
+      AsyncSafeTraceMultiset::kDefaultMaxEntries;
+  long long max_arena_frames =  // NOLINT
+      AsyncSafeTraceMultiset::kDefaultMaxArenaFrames;
+  long long timeline_records = 0;  // NOLINT
+  int thread_labels = 0;
+  if (!PyArg_ParseTupleAndKeywords(
+          args, kwargs, "LL|LLpLp", const_cast<char**>(kwlist), &period_usec,
+          &duration_nanos, &max_traces, &max_arena_frames, &native_frames,
+          &timeline_records, &thread_labels)) {
+    return nullptr;
+  }
+  if (period_usec * kNanosPerMicro < BurstProfiler::kMinPeriodNanos) {
+    PyErr_Format(PyExc_ValueError, "period_usec must be at least %lld",
+                 static_cast<long long>(  // NOLINT
+                     BurstProfiler::kMinPeriodNanos / kNanosPerMicro));
+    return nullptr;
+  }
+  if (duration_nanos <= 0 || max_traces <= 0 || max_arena_frames <= 0) {
+    PyErr_SetString(
+        PyExc_ValueError,
+        "duration_nanos, max_traces and max_arena_frames must be positive");
+    return nullptr;
+  }
+  if (timeline_records < 0 ||
+      timeline_records > SampleTimeline::kMaxCapacity) {
+    PyErr_Format(
+        PyExc_ValueError, "timeline_records must be between 0 and %lld",
+        static_cast<long long>(SampleTimeline::kMaxCapacity));  // NOLINT
+    return nullptr;
+  }
+
+  int64_t id = BurstProfiler::Start(
+      period_usec * kNanosPerMicro, duration_nanos, max_traces,
+      max_arena_frames, native_frames, timeline_records, thread_labels);
+  if (id == 0) {
+    return nullptr;
+  }
+  return PyLong_FromLongLong(id);
+}
+
+PyObject* BurstDone(PyObject* self, PyObject* args) {
+  long long id = 0;  // NOLINT
+  if (!PyArg_ParseTuple(args, "L", &id)) {
+    return nullptr;
+  }
+  return BurstProfiler::Done(id);
+}
+
+PyObject* CollectBurst(PyObject* self, PyObject* args) {
+  long long id = 0;  // NOLINT
+  if (!PyArg_ParseTuple(args, "L", &id)) {
+    return nullptr;
+  }
+  return BurstProfiler::Collect(id);
+}
+
+PyObject* Timeline(PyObject* self, PyObject* args, PyObject* kwargs) {
+  static const char* kwlist[] = {"format", nullptr};
+  const char* format = "pprof";
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|s",
+                                   const_cast<char**>(kwlist), &format)) {
+    return nullptr;
+  }
+  std::string format_name(format);
+  if (format_name != "pprof" && format_name != "binary") {
+    PyErr_SetString(PyExc_ValueError, "format must be 'pprof' or 'binary'");
+    return nullptr;
+  }
+  const ResolvedTimeline* timeline = Profiler::LastTimeline();
+  if (timeline == nullptr) {
+    Py_RETURN_NONE;
+  }
+  if (format_name == "binary") {
+    std::string encoded = EncodeTimeline(*timeline);
+    return PyBytes_FromStringAndSize(encoded.data(), encoded.size());
+  }
+  ProfileBuilder builder;
+  AddTimelineSamples(*timeline, &builder);
+  if (!timeline->records.empty()) {
+    builder.SetDurationNanos(timeline->records.back().timestamp_nanos -
+                             timeline->records.front().timestamp_nanos);
+  }
+  builder.AddComment("profiler.dropped_records=" +
+                     std::to_string(timeline->dropped_records));
+  return GzipCompress(builder.Serialize());
+}
+
+PyObject* InternLabels(PyObject* self, PyObject* args) {
+  PyObject* py_labels = nullptr;
+  if (!PyArg_ParseTuple(args, "O", &py_labels)) {
+    return nullptr;
+  }
+  PyObject* py_items = PySequence_Fast(py_labels, "labels must be a sequence");
+  if (py_items == nullptr) {
+    return nullptr;
+  }
+  SampleLabels::LabelSet labels;
+  Py_ssize_t size = PySequence_Fast_GET_SIZE(py_items);
+  for (Py_ssize_t i = 0; i < size; i++) {
+    const char* key = nullptr;
+    const char* value = nullptr;
+    if (!PyArg_ParseTuple(PySequence_Fast_GET_ITEM(py_items, i), "ss", &key,
+                          &value)) {
+      Py_DECREF(py_items);
+      return nullptr;
+    }
+    labels.emplace_back(key, value);
+  }
+  Py_DECREF(py_items);
+  std::sort(labels.begin(), labels.end());
+  return PyLong_FromUnsignedLong(SampleLabels::Intern(labels));
+}
+
+PyObject* SetContextLabels(PyObject* self, PyObject* args) {
+  unsigned int id = 0;
+  PyObject* context = Py_None;
+  if (!PyArg_ParseTuple(args, "I|O", &id, &context)) {
+    return nullptr;
+  }
+  if (context == Py_None) {
+    // The thread state holds the current context once a context variable
+    // was used by the thread.
+    context = SampleLabels::CurrentContext();
+    if (context == nullptr) {
+      return Py_BuildValue("(OI)", Py_None, 0u);
+    }
+  } else if (!PyContext_CheckExact(context)) {
+    PyErr_SetString(PyExc_TypeError, "context must be a contextvars.Context");
+    return nullptr;
+  }
+  unsigned int previous_id = SampleLabels::Set(context, id);
+  return Py_BuildValue("(OI)", context, previous_id);
+}
+
+PyObject* Stats(PyObject* self, PyObject* args) {
+  return PythonStats(Profiler::LastStats());
 }
 
 PyMethodDef ProfilerMethods[] = {
-    {"profile_cpu", ProfileCPU, METH_VARARGS, "A function for CPU profiling."},
+    {"profile_cpu", reinterpret_cast<PyCFunction>(ProfileCPU),
+     METH_VARARGS | METH_KEYWORDS, "A function for CPU profiling."},
+    {"profile_cpu_serialized",
+     reinterpret_cast<PyCFunction>(ProfileCPUSerialized),
+     METH_VARARGS | METH_KEYWORDS,
+     "A function for CPU profiling which returns a gzip-compressed profile "
+     "proto."},
+    {"profile_wall", reinterpret_cast<PyCFunction>(ProfileWall),
+     METH_VARARGS | METH_KEYWORDS,
+     "A function for wall time profiling of all threads which returns a "
+     "gzip-compressed profile proto."},
+    {"profile_contention", reinterpret_cast<PyCFunction>(ProfileContention),
+     METH_VARARGS | METH_KEYWORDS,
+     "A function for GIL contention profiling of all threads which returns a "
+     "gzip-compressed profile proto."},
+    {"profile_heap", reinterpret_cast<PyCFunction>(ProfileHeap),
+     METH_VARARGS | METH_KEYWORDS,
+     "A function for heap profiling of the Python allocators which returns a "
+     "gzip-compressed profile proto."},
+    {"start_continuous", reinterpret_cast<PyCFunction>(StartContinuous),
+     METH_VARARGS | METH_KEYWORDS,
+     "Starts sampling the CPU time continuously into a ring of windows."},
+    {"stop_continuous", StopContinuous, METH_NOARGS,
+     "Stops the continuous CPU profiler, keeping its windows."},
+    {"continuous_windows", ContinuousWindows, METH_NOARGS,
+     "Returns the (start, end) times in nanoseconds since the epoch of the "
+     "windows of the continuous CPU profiler."},
+    {"continuous_profile", reinterpret_cast<PyCFunction>(ContinuousProfile),
+     METH_VARARGS | METH_KEYWORDS,
+     "Returns the windows of the continuous CPU profiler which overlap a "
+     "time range as a gzip-compressed profile proto."},
+    {"start_burst", reinterpret_cast<PyCFunction>(StartBurst),
+     METH_VARARGS | METH_KEYWORDS,
+     "Starts a high-frequency CPU profile collected in the background, and "
+     "returns its ID."},
+    {"burst_done", BurstDone, METH_VARARGS,
+     "Returns whether the burst with the given ID ended."},
+    {"collect_burst", CollectBurst, METH_VARARGS,
+     "Waits for the burst with the given ID to end, and returns its "
+     "gzip-compressed profile proto."},
+    {"timeline", reinterpret_cast<PyCFunction>(Timeline),
+     METH_VARARGS | METH_KEYWORDS,
+     "Returns the sample timeline of the last collection which recorded one, "
+     "as a gzip-compressed profile proto or in a compact binary format."},
+    {"intern_labels", InternLabels, METH_VARARGS,
+     "Interns a sequence of (key, value) string pairs as a label set, and "
+     "returns its ID, or 0 if there are too many label sets."},
+    {"set_context_labels", SetContextLabels, METH_VARARGS,
+     "Tags the samples of the given context, or of the current context, with "
+     "the label set of the given ID, or untags them if the ID is 0. Returns "
+     "the context and its previous ID."},
+    {"stats", Stats, METH_NOARGS,
+     "Returns the statistics of the profiler during the last collection as a "
+     "dictionary."},
     {nullptr, nullptr, 0, nullptr} /* Sentinel */
 };
 
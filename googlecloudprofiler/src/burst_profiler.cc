@@ -0,0 +1,169 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "burst_profiler.h"
+
+#include "clock.h"
+#include "log.h"
+#include "native_stacks.h"
+
+int64_t BurstProfiler::last_id_ = 0;
+bool BurstProfiler::fork_handler_registered_ = false;
+
+std::unique_ptr<BurstProfiler> &BurstProfiler::Instance() {
+  static std::unique_ptr<BurstProfiler> *instance =
+      new std::unique_ptr<BurstProfiler>;
+  return *instance;
+}
+
+int64_t BurstProfiler::Start(int64_t period_nanos, int64_t duration_nanos,
+                             int64_t max_traces, int64_t max_arena_frames,
+                             bool native_frames, int64_t timeline_records,
+                             bool thread_labels) {
+  std::unique_ptr<BurstProfiler> &instance = Instance();
+  if (instance != nullptr) {
+    if (!instance->done_.load() || instance->collect_started_) {
+      PyErr_SetString(PyExc_RuntimeError, "another burst is in progress");
+      return 0;
+    }
+    // The last burst ended but wasn't collected.
+    instance->End();
+    instance.reset();
+  }
+  if (!StartCollecting()) {
+    return 0;
+  }
+  if (!fork_handler_registered_) {
+    pthread_atfork(nullptr, nullptr, &AfterForkInChild);
+    fork_handler_registered_ = true;
+  }
+  std::unique_ptr<BurstProfiler> profiler(new BurstProfiler(
+      period_nanos, duration_nanos, max_traces, max_arena_frames,
+      native_frames));
+  profiler->EnableTimeline(timeline_records);
+  profiler->EnableThreadLabels(thread_labels);
+  // The constructor doesn't reset the tables once collecting.
+  profiler->Reset();
+  if (native_frames && !SetUpNativeUnwinding()) {
+    LogWarning(
+        "_PyEval_EvalFrameDefault not found, native frames will be shown "
+        "before all Python frames");
+  }
+  native_frames_.store(native_frames, std::memory_order_relaxed);
+  profiler->dealloc_hook_.reset(new CodeDeallocHook);
+  if (!profiler->CPUProfiler::Start()) {
+    native_frames_.store(false, std::memory_order_relaxed);
+    profiler->dealloc_hook_.reset();
+    StopCollecting();
+    PyErr_SetString(PyExc_RuntimeError, "failed to start the CPU timers");
+    return 0;
+  }
+  profiler->id_ = ++last_id_;
+  profiler->thread_ = std::thread(&BurstProfiler::Run, profiler.get());
+  instance = std::move(profiler);
+  return instance->id_;
+}
+
+void BurstProfiler::Run() {
+  // The timers' signals go to the threads being profiled.
+  BlockSigprof();
+  Clock *clock = DefaultClock();
+  // Flush the async table every 100 ms
+  struct timespec flush_interval = {0, 100 * 1000 * 1000};  // 100 millisec
+  struct timespec finish_line =
+      TimeAdd(clock->Now(), NanosToTimeSpec(duration_nanos_));
+  while (TimeLessThan(TimeAdd(clock->Now(), flush_interval), finish_line)) {
+    clock->SleepFor(flush_interval);
+    Flush();
+    UpdateThreadTimers();
+  }
+  clock->SleepUntil(finish_line);
+  Stop();
+  // Delay to allow last signals to be processed.
+  clock->SleepUntil(TimeAdd(finish_line, flush_interval));
+  native_frames_.store(false, std::memory_order_relaxed);
+  FinalFlush();
+
+  PyGILState_STATE gil_state = PyGILState_Ensure();
+  profile_ = SerializedProfile(ProfileType());
+  if (profile_ == nullptr) {
+    LogWarning("Failed to build the profile of the burst");
+    PyErr_Clear();
+  }
+  // Only the profile is kept, the collection is released.
+  ClearTraces();
+  dealloc_hook_.reset();
+  StopCollecting();
+  done_.store(true);
+  PyGILState_Release(gil_state);
+}
+
+void BurstProfiler::End() {
+  if (thread_.joinable()) {
+    Py_BEGIN_ALLOW_THREADS;
+    thread_.join();
+    Py_END_ALLOW_THREADS;
+  }
+}
+
+void BurstProfiler::AfterForkInChild() {
+  std::unique_ptr<BurstProfiler> &instance = Instance();
+  if (instance == nullptr || instance->done_.load()) {
+    return;
+  }
+  // The child runs the forking thread only, so the hook can be removed. The
+  // burst is leaked, as its thread can't be joined.
+  instance->dealloc_hook_.reset();
+  instance.release();
+}
+
+BurstProfiler *BurstProfiler::Find(int64_t id) {
+  BurstProfiler *profiler = Instance().get();
+  if (profiler == nullptr || profiler->id_ != id) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "unknown burst, or the burst was already collected");
+    return nullptr;
+  }
+  return profiler;
+}
+
+PyObject *BurstProfiler::Done(int64_t id) {
+  BurstProfiler *profiler = Find(id);
+  if (profiler == nullptr) {
+    return nullptr;
+  }
+  return PyBool_FromLong(profiler->done_.load());
+}
+
+PyObject *BurstProfiler::Collect(int64_t id) {
+  BurstProfiler *profiler = Find(id);
+  if (profiler == nullptr) {
+    return nullptr;
+  }
+  if (profiler->collect_started_) {
+    PyErr_SetString(PyExc_RuntimeError, "the burst is being collected");
+    return nullptr;
+  }
+  profiler->collect_started_ = true;
+  // Releases GIL while waiting, so that the user threads can execute.
+  profiler->End();
+  PyObject *profile = profiler->profile_;
+  profiler->profile_ = nullptr;
+  Instance().reset();
+  if (profile == nullptr) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "failed to build the profile of the burst");
+  }
+  return profile;
+}
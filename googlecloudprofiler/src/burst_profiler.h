@@ -0,0 +1,119 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLECLOUDPROFILER_SRC_BURST_PROFILER_H_
+#define GOOGLECLOUDPROFILER_SRC_BURST_PROFILER_H_
+
+#include <Python.h>
+
+#include <atomic>
+#include <memory>
+#include <thread>
+
+#include "profiler.h"
+
+// BurstProfiler collects a CPU profile at a high frequency for a short
+// duration, without blocking the thread which starts it: the collection runs
+// on a native thread, and the profile is built when it's collected. It is
+// meant to be started by in-process watchdogs, e.g. when a latency objective
+// is missed, to capture the next few seconds in detail.
+//
+// Samples are taken by high-resolution per-thread timers, see
+// ThreadCPUTimers, so the sampling period can be well below a millisecond.
+//
+// A single collection is in progress at a time, see
+// Profiler::StartCollecting(). A burst holds it while sampling only: when
+// the burst ends, its native thread builds the profile and releases it, so
+// that a burst collected late, or never, doesn't hold off other profiles.
+// The profile is kept until the burst is collected, or discarded when
+// another burst starts.
+class BurstProfiler : public CPUProfiler {
+ public:
+  // Shortest sampling period supported. Shorter periods would leave little
+  // CPU time to the threads being profiled.
+  static const int64_t kMinPeriodNanos = 10 * 1000;
+
+  // Starts a burst sampling every period_nanos for duration_nanos. When
+  // timeline_records is positive, the burst also records a timeline of that
+  // capacity, see Profiler::EnableTimeline(). When thread_labels is true,
+  // samples are labelled with their thread, see
+  // Profiler::EnableThreadLabels(). Returns the ID of the burst, or 0 with a
+  // Python exception set if another burst is in progress, or another
+  // collection. Must be called when GIL is held.
+  static int64_t Start(int64_t period_nanos, int64_t duration_nanos,
+                       int64_t max_traces, int64_t max_arena_frames,
+                       bool native_frames, int64_t timeline_records,
+                       bool thread_labels);
+
+  // Returns whether the given burst ended, as a Python bool, or nullptr with
+  // a Python exception set if it's unknown or was collected. Must be called
+  // when GIL is held.
+  static PyObject *Done(int64_t id);
+
+  // Waits for the given burst to end, then returns its profile as a
+  // gzip-compressed CPU profile proto in a Python bytes object. Returns
+  // nullptr with a Python exception set if the burst is unknown or is being
+  // or was collected. Must be called when GIL is held.
+  static PyObject *Collect(int64_t id);
+
+  // Must be called when GIL is held.
+  ~BurstProfiler() { Py_XDECREF(profile_); }
+
+ private:
+  BurstProfiler(int64_t period_nanos, int64_t duration_nanos,
+                int64_t max_traces, int64_t max_arena_frames,
+                bool native_frames)
+      : CPUProfiler(duration_nanos, period_nanos, true, max_traces,
+                    max_arena_frames, native_frames, 0, true) {}
+
+  // Runs the collection on the native thread, without GIL. Takes GIL at the
+  // end to build the profile and release the collection.
+  void Run();
+
+  // Waits for the native thread to exit. Must be called when GIL is held.
+  void End();
+
+  // Fork handler run in the child, which forgets the burst in progress, as
+  // ContinuousProfiler::AfterForkInChild() does.
+  static void AfterForkInChild();
+
+  // Returns the burst with the given ID, or nullptr with a Python exception
+  // set. Must be called when GIL is held.
+  static BurstProfiler *Find(int64_t id);
+
+  // Returns the last burst started, until it's collected or discarded.
+  // Guarded by GIL. The pointer itself is leaked, so that a burst isn't
+  // destroyed at exit while its thread runs.
+  static std::unique_ptr<BurstProfiler> &Instance();
+
+  // ID of the last burst started.
+  static int64_t last_id_;
+
+  // Guarded by GIL.
+  static bool fork_handler_registered_;
+
+  int64_t id_ = 0;
+  // Set by Collect(), so that a burst is collected once. Guarded by GIL.
+  bool collect_started_ = false;
+  // Set by Run() when the collection ended and the profile was built,
+  // with GIL held.
+  std::atomic<bool> done_{false};
+  // The profile built by Run(), or nullptr if it failed. Guarded by GIL.
+  PyObject *profile_ = nullptr;
+
+  std::unique_ptr<CodeDeallocHook> dealloc_hook_;
+  std::thread thread_;
+};
+
+#endif  // GOOGLECLOUDPROFILER_SRC_BURST_PROFILER_H_
@@ -22,7 +22,7 @@ Clock *DefaultClock() { return &DefaultClockInstance; }
 
 struct timespec TimeAdd(const struct timespec t1, const struct timespec t2) {
   struct timespec t = {t1.tv_sec + t2.tv_sec, t1.tv_nsec + t2.tv_nsec};
-  if (t.tv_nsec > kNanosPerSecond) {
+  if (t.tv_nsec >= kNanosPerSecond) {
     t.tv_sec += t.tv_nsec / kNanosPerSecond;
     t.tv_nsec = t.tv_nsec % kNanosPerSecond;
   }
@@ -39,3 +39,7 @@ struct timespec NanosToTimeSpec(int64_t nanos) {
   int32_t nano_seconds = nanos % kNanosPerSecond;
   return timespec{seconds, nano_seconds};
 }
+
+int64_t TimeSpecToNanos(const struct timespec &ts) {
+  return ts.tv_sec * kNanosPerSecond + ts.tv_nsec;
+}
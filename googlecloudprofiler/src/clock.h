@@ -21,6 +21,7 @@
 static const int64_t kNanosPerSecond = 1000 * 1000 * 1000;
 static const int64_t kMicrosPerSecond = 1000 * 1000;
 static const int64_t kNanosPerMilli = 1000 * 1000;
+static const int64_t kNanosPerMicro = 1000;
 
 // Clock interface that can be mocked for tests. The default implementation
 // delegates to the system and so is thread-safe.
@@ -50,6 +51,7 @@ class Clock {
 
 struct timespec TimeAdd(const struct timespec t1, const struct timespec t2);
 struct timespec NanosToTimeSpec(int64_t nanos);
+int64_t TimeSpecToNanos(const struct timespec &ts);
 bool TimeLessThan(const struct timespec &t1, const struct timespec &t2);
 
 // Returns a singleton Clock instance which uses the system implementation.
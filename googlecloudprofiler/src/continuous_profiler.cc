@@ -0,0 +1,272 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "continuous_profiler.h"
+
+#include <chrono>  // NOLINT
+#include <unordered_map>
+
+#include "clock.h"
+#include "profile_builder.h"
+
+namespace {
+
+// Returns the wall clock time in nanoseconds since the epoch.
+int64_t RealtimeNanos() {
+  struct timespec now;
+  clock_gettime(CLOCK_REALTIME, &now);
+  return TimeSpecToNanos(now);
+}
+
+}  // namespace
+
+bool ContinuousProfiler::fork_handler_registered_ = false;
+
+std::shared_ptr<ContinuousProfiler> &ContinuousProfiler::Instance() {
+  static std::shared_ptr<ContinuousProfiler> *instance =
+      new std::shared_ptr<ContinuousProfiler>;
+  return *instance;
+}
+
+bool ContinuousProfiler::Start(int64_t period_nanos, int64_t window_nanos,
+                               int64_t max_windows, bool per_thread_timers,
+                               int64_t max_traces, int64_t max_arena_frames,
+                               bool thread_labels) {
+  if (!StartCollecting()) {
+    return false;
+  }
+  if (!fork_handler_registered_) {
+    pthread_atfork(nullptr, nullptr, &AfterForkInChild);
+    fork_handler_registered_ = true;
+  }
+  std::shared_ptr<ContinuousProfiler> profiler(
+      new ContinuousProfiler(period_nanos, window_nanos, max_windows,
+                             per_thread_timers, max_traces, max_arena_frames));
+  profiler->EnableThreadLabels(thread_labels);
+  // The constructor doesn't reset the tables once collecting.
+  profiler->Reset();
+  profiler->dealloc_hook_.reset(new CodeDeallocHook);
+  if (!profiler->CPUProfiler::Start()) {
+    profiler->dealloc_hook_.reset();
+    StopCollecting();
+    PyErr_SetString(PyExc_RuntimeError, "failed to start the CPU timer");
+    return false;
+  }
+  profiler->thread_ = std::thread(&ContinuousProfiler::Run, profiler.get());
+  Instance() = profiler;
+  return true;
+}
+
+void ContinuousProfiler::Stop() {
+  std::shared_ptr<ContinuousProfiler> profiler = Instance();
+  if (profiler == nullptr || !profiler->thread_.joinable()) {
+    return;
+  }
+  // The thread needs GIL to end the last window.
+  Py_BEGIN_ALLOW_THREADS;
+  {
+    // The thread updates the timers with mutex_ held.
+    std::lock_guard<std::mutex> lock(profiler->mutex_);
+    profiler->CPUProfiler::Stop();
+    profiler->stopping_ = true;
+  }
+  profiler->stop_.notify_one();
+  profiler->thread_.join();
+  Py_END_ALLOW_THREADS;
+  profiler->dealloc_hook_.reset();
+  StopCollecting();
+}
+
+void ContinuousProfiler::AfterForkInChild() {
+  std::shared_ptr<ContinuousProfiler> &instance = Instance();
+  if (instance == nullptr) {
+    return;
+  }
+  // The child runs the forking thread only, so the hook can be removed.
+  instance->dealloc_hook_.reset();
+  new std::shared_ptr<ContinuousProfiler>(std::move(instance));
+}
+
+void ContinuousProfiler::Run() {
+  // The signals of the process-wide timer go to the threads being profiled.
+  BlockSigprof();
+  const std::chrono::milliseconds kFlushInterval(100);
+  Clock *clock = DefaultClock();
+  int64_t window_start = TimeSpecToNanos(clock->Now());
+  int64_t window_start_realtime = RealtimeNanos();
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (true) {
+    stop_.wait_for(lock, kFlushInterval, [this] { return stopping_; });
+    Flush();
+    if (!stopping_) {
+      UpdateThreadTimers();
+    }
+    int64_t now = TimeSpecToNanos(clock->Now());
+    if (stopping_ || now - window_start >= window_nanos_) {
+      int64_t now_realtime = RealtimeNanos();
+      PyGILState_STATE gil_state = PyGILState_Ensure();
+      EndWindow(window_start_realtime, now_realtime);
+      PyGILState_Release(gil_state);
+      window_start = now;
+      window_start_realtime = now_realtime;
+    } else {
+      SymbolizeNewNodes();
+    }
+    if (stopping_) {
+      return;
+    }
+  }
+}
+
+void ContinuousProfiler::EndWindow(int64_t start_nanos, int64_t end_nanos) {
+  // ClearTraces() makes the hook forget the code objects sampled so far, and
+  // the frames left in the fixed table are then resolved as unknown. Code
+  // objects can't be deallocated while GIL is held, so the frames sampled
+  // until now are harvested and resolved first.
+  Flush();
+  AddUnknownTraces();
+  SymbolizeNodes(aggregated_traces_.NumNodes());
+
+  windows_.emplace_back();
+  Window &window = windows_.back();
+  window.start_nanos = start_nanos;
+  window.end_nanos = end_nanos;
+  window.nodes.reserve(aggregated_traces_.NumNodes());
+  // Maps the string IDs of a function name and filename to the index of the
+  // function in the window.
+  std::unordered_map<uint64_t, uint32_t> functions;
+  for (size_t node = 0; node < aggregated_traces_.NumNodes(); node++) {
+    Node window_node = {static_cast<uint32_t>(aggregated_traces_.Parent(node)),
+                        0, 0, 0,
+                        static_cast<int64_t>(aggregated_traces_.Count(node)),
+                        aggregated_traces_.Value(node, 1)};
+    if (node != CallingContextTree::kRoot && IsLabelNode(node)) {
+      window.labels.emplace_back();
+      AddNodeLabels(node, &window.labels.back());
+      window_node.labels = window.labels.size();
+    } else if (node != CallingContextTree::kRoot) {
+      const SymbolTable::Symbol &symbol = NodeSymbol(node);
+      uint64_t key = static_cast<uint64_t>(symbol.name) << 32 | symbol.filename;
+      auto inserted = functions.emplace(key, window.functions.size());
+      if (inserted.second) {
+        window.functions.emplace_back(SymbolString(symbol.name),
+                                      SymbolString(symbol.filename));
+      }
+      window_node.function = inserted.first->second;
+      window_node.line = symbol.line;
+    }
+    window.nodes.push_back(window_node);
+  }
+  while (windows_.size() > max_windows_) {
+    windows_.pop_front();
+  }
+  ClearTraces();
+}
+
+void ContinuousProfiler::AddWindow(const Window &window,
+                                   ProfileBuilder *builder) {
+  std::vector<uint64_t> function_ids;
+  function_ids.reserve(window.functions.size());
+  for (const auto &function : window.functions) {
+    function_ids.push_back(builder->FunctionId(function.first, function.second));
+  }
+  std::vector<uint64_t> node_location_ids(window.nodes.size());
+  std::vector<uint64_t> location_ids;
+  std::vector<ProfileBuilder::Label> labels;
+  for (size_t node = 1; node < window.nodes.size(); node++) {
+    const Node &window_node = window.nodes[node];
+    if (window_node.labels == 0) {
+      node_location_ids[node] = builder->LocationId(
+          function_ids[window_node.function], window_node.line);
+    }
+    if (window_node.count == 0) {
+      continue;
+    }
+    location_ids.clear();
+    labels.clear();
+    for (size_t n = node; n != CallingContextTree::kRoot;
+         n = window.nodes[n].parent) {
+      if (window.nodes[n].labels != 0) {
+        const std::vector<ProfileBuilder::Label> &node_labels =
+            window.labels[window.nodes[n].labels - 1];
+        labels.insert(labels.end(), node_labels.begin(), node_labels.end());
+      } else {
+        location_ids.push_back(node_location_ids[n]);
+      }
+    }
+    builder->AddSample(location_ids, {window_node.count, window_node.nanos},
+                       labels);
+  }
+}
+
+PyObject *ContinuousProfiler::Windows() {
+  std::shared_ptr<ContinuousProfiler> profiler = Instance();
+  std::vector<std::pair<int64_t, int64_t>> times;
+  if (profiler != nullptr) {
+    Py_BEGIN_ALLOW_THREADS;
+    std::lock_guard<std::mutex> lock(profiler->mutex_);
+    for (const Window &window : profiler->windows_) {
+      times.emplace_back(window.start_nanos, window.end_nanos);
+    }
+    Py_END_ALLOW_THREADS;
+  }
+  PyObject *py_windows = PyList_New(times.size());
+  if (py_windows == nullptr) {
+    return nullptr;
+  }
+  for (size_t i = 0; i < times.size(); i++) {
+    PyObject *py_window =
+        Py_BuildValue("(LL)", static_cast<long long>(times[i].first),  // NOLINT
+                      static_cast<long long>(times[i].second));       // NOLINT
+    if (py_window == nullptr) {
+      Py_DECREF(py_windows);
+      return nullptr;
+    }
+    // PyList_SET_ITEM steals the reference to py_window.
+    PyList_SET_ITEM(py_windows, i, py_window);
+  }
+  return py_windows;
+}
+
+PyObject *ContinuousProfiler::Export(int64_t start_nanos, int64_t end_nanos) {
+  std::shared_ptr<ContinuousProfiler> profiler = Instance();
+  if (profiler == nullptr) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "the continuous profiler was never started");
+    return nullptr;
+  }
+  ProfileBuilder builder;
+  profiler->SetUpProfile(profiler->ProfileType(), &builder);
+  std::string serialized;
+  // Building the profile doesn't touch Python objects, so user threads can
+  // run meanwhile.
+  Py_BEGIN_ALLOW_THREADS;
+  {
+    std::lock_guard<std::mutex> lock(profiler->mutex_);
+    int64_t duration_nanos = 0;
+    for (const Window &window : profiler->windows_) {
+      if (window.end_nanos <= start_nanos ||
+          (end_nanos != 0 && window.start_nanos >= end_nanos)) {
+        continue;
+      }
+      AddWindow(window, &builder);
+      duration_nanos += window.end_nanos - window.start_nanos;
+    }
+    builder.SetDurationNanos(duration_nanos);
+  }
+  serialized = builder.Serialize();
+  Py_END_ALLOW_THREADS;
+  return GzipCompress(serialized);
+}
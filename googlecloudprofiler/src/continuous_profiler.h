@@ -0,0 +1,156 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLECLOUDPROFILER_SRC_CONTINUOUS_PROFILER_H_
+#define GOOGLECLOUDPROFILER_SRC_CONTINUOUS_PROFILER_H_
+
+#include <Python.h>
+
+#include <condition_variable>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "profile_builder.h"
+#include "profiler.h"
+
+// ContinuousProfiler samples the CPU time of the process all the time, rather
+// than for the duration of a profile. The timer and the signal handler are
+// set up once, when the profiler starts, and a native thread flushes the
+// fixed trace table every 100 ms, as CPUProfiler does.
+//
+// Samples are bucketed into windows of a fixed length. When a window ends,
+// its traces are resolved and moved into a bounded ring of windows, the
+// oldest window being dropped when the ring is full. Any range of windows can
+// be exported as a profile at any time, without stopping the sampling.
+//
+// As it holds the fixed trace table, the signal handler and the code
+// deallocation hook, no other profile can be collected while it runs. A
+// child process forked while it runs doesn't inherit it, see
+// AfterForkInChild().
+class ContinuousProfiler : public CPUProfiler {
+ public:
+  // Starts the continuous profiler, sampling every period_nanos of CPU time
+  // and keeping the last max_windows windows of window_nanos each. Returns
+  // false with a Python exception set if it's already running, or if another
+  // collection is in progress. When thread_labels is true, samples are
+  // labelled with their thread, see Profiler::EnableThreadLabels(), and each
+  // window labels up to Profiler::kMaxLabelledThreads threads. Must be called
+  // when GIL is held.
+  static bool Start(int64_t period_nanos, int64_t window_nanos,
+                    int64_t max_windows, bool per_thread_timers,
+                    int64_t max_traces, int64_t max_arena_frames,
+                    bool thread_labels);
+
+  // Stops the continuous profiler. The windows collected are kept, and can
+  // still be exported until it starts again. Does nothing if it isn't
+  // running. Must be called when GIL is held.
+  static void Stop();
+
+  // Returns the start and end times of the windows in the ring, oldest
+  // first, as a Python list of pairs of nanoseconds since the epoch. Must be
+  // called when GIL is held.
+  static PyObject *Windows();
+
+  // Returns the windows which overlap the time range [start_nanos,
+  // end_nanos), in nanoseconds since the epoch, merged into one
+  // gzip-compressed CPU profile proto in a Python bytes object. An end_nanos
+  // of 0 stands for no end. Must be called when GIL is held.
+  static PyObject *Export(int64_t start_nanos, int64_t end_nanos);
+
+ private:
+  // A node of the calling context tree of a window, with its frame resolved.
+  struct Node {
+    uint32_t parent;
+    // Index in Window::functions.
+    uint32_t function;
+    int line;
+    // Index in Window::labels plus one for a node which labels the samples of
+    // its traces rather than being a location, see Profiler::IsLabelNode(),
+    // or 0.
+    uint32_t labels;
+    int64_t count;
+    int64_t nanos;
+  };
+
+  // The traces sampled during a window, which owns its strings so that it
+  // outlives the symbol table's.
+  struct Window {
+    int64_t start_nanos;
+    int64_t end_nanos;
+    // Names and filenames.
+    std::vector<std::pair<std::string, std::string>> functions;
+    // Labels of the label nodes.
+    std::vector<std::vector<ProfileBuilder::Label>> labels;
+    // In the order of the calling context tree's nodes, so a node's parent
+    // comes before it. The root node is at index 0.
+    std::vector<Node> nodes;
+  };
+
+  ContinuousProfiler(int64_t period_nanos, int64_t window_nanos,
+                     int64_t max_windows, bool per_thread_timers,
+                     int64_t max_traces, int64_t max_arena_frames)
+      : CPUProfiler(0, period_nanos, per_thread_timers, max_traces,
+                    max_arena_frames),
+        window_nanos_(window_nanos),
+        max_windows_(max_windows) {}
+
+  // Runs on the native thread until stopping_ is set.
+  void Run();
+
+  // Fork handler run in the child, which forgets the profiler: its thread
+  // and its timers are not inherited, and its mutex may be held by a thread
+  // of the parent. The profiler is leaked rather than destroyed, as its
+  // thread can't be joined. Profiler::AfterForkInChild() ends the
+  // collection.
+  static void AfterForkInChild();
+
+  // Moves the traces sampled since the window started into a new window of
+  // the ring. Must be called when GIL is held, with mutex_ held.
+  void EndWindow(int64_t start_nanos, int64_t end_nanos);
+
+  // Appends the samples of a window to builder. Must be called with mutex_
+  // held.
+  static void AddWindow(const Window &window, ProfileBuilder *builder);
+
+  // Returns the running profiler, or the last one to run, if any. An
+  // export holds a reference while GIL is released, so that starting again
+  // doesn't destroy the profiler it reads. The pointer itself is leaked, so
+  // that the profiler isn't destroyed at exit while its thread may run.
+  static std::shared_ptr<ContinuousProfiler> &Instance();
+
+  // Guarded by GIL.
+  static bool fork_handler_registered_;
+
+  int64_t window_nanos_;
+  size_t max_windows_;
+
+  // Guards windows_ and the profiler's aggregated traces. To avoid deadlocks,
+  // GIL may be acquired while holding it, but it must not be acquired while
+  // holding GIL.
+  std::mutex mutex_;
+  std::deque<Window> windows_;
+
+  std::unique_ptr<CodeDeallocHook> dealloc_hook_;
+  std::thread thread_;
+  // Set by Stop() to end Run().
+  bool stopping_ = false;
+  std::condition_variable stop_;
+};
+
+#endif  // GOOGLECLOUDPROFILER_SRC_CONTINUOUS_PROFILER_H_
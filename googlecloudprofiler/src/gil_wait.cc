@@ -0,0 +1,69 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "gil_wait.h"
+
+#include <stdint.h>
+#include <sys/ucontext.h>
+
+#include <atomic>
+
+// 3.9 moved the GIL state into _PyRuntime.ceval, and 3.12 into each
+// interpreter.
+#if defined(__x86_64__) && PY_VERSION_HEX >= 0x03090000 && \
+    PY_VERSION_HEX < 0x030C0000
+#define GIL_WAIT_SUPPORTED
+// pycore_gc.h defines its own _PyGC_FINALIZED for builds of the interpreter.
+// <stdatomic.h> can't be included in C++, so pycore_atomic.h is made to use
+// the GCC builtins instead, whose types have the same layout.
+#undef _PyGC_FINALIZED
+#undef HAVE_STD_ATOMIC
+#define Py_BUILD_CORE
+#include "internal/pycore_runtime.h"
+#undef Py_BUILD_CORE
+#endif
+
+namespace {
+
+// Address range of the GIL state, set by SetUpGilWait.
+std::atomic<uintptr_t> gil_start(0);
+std::atomic<uintptr_t> gil_end(0);
+
+}  // namespace
+
+bool SetUpGilWait() {
+#ifdef GIL_WAIT_SUPPORTED
+  const struct _gil_runtime_state *gil = &_PyRuntime.ceval.gil;
+  gil_start.store(reinterpret_cast<uintptr_t>(gil), std::memory_order_relaxed);
+  gil_end.store(reinterpret_cast<uintptr_t>(gil + 1),
+                std::memory_order_relaxed);
+  return true;
+#else
+  return false;
+#endif
+}
+
+bool WaitsForGil(const void *ucontext) {
+#ifdef GIL_WAIT_SUPPORTED
+  const ucontext_t *uc = static_cast<const ucontext_t *>(ucontext);
+  // The futex address is the first argument of the futex system call, in
+  // rdi, which the kernel keeps whether the call is interrupted or restarted.
+  uintptr_t address = uc->uc_mcontext.gregs[REG_RDI];
+  return address >= gil_start.load(std::memory_order_relaxed) &&
+         address < gil_end.load(std::memory_order_relaxed);
+#else
+  (void)ucontext;
+  return false;
+#endif
+}
@@ -0,0 +1,39 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLECLOUDPROFILER_SRC_GIL_WAIT_H_
+#define GOOGLECLOUDPROFILER_SRC_GIL_WAIT_H_
+
+#include <Python.h>
+
+// A thread waiting to take the GIL is blocked on the mutex or the condition
+// variable of the GIL, whose futex lies in the state of the GIL. A signal
+// handler tells it from the first argument of the system call it interrupted,
+// which the kernel leaves in the signal context.
+//
+// This is supported on x86-64 with Python 3.9 to 3.11, whose GIL state is in
+// _PyRuntime. Elsewhere, no thread is found waiting.
+
+// Finds the state of the GIL, so that signal handlers can tell the threads
+// waiting for it. Returns false if it isn't supported. Must be called when
+// GIL is held.
+bool SetUpGilWait();
+
+// Returns whether the thread interrupted by a signal, which doesn't hold the
+// GIL, is waiting to take it, given the ucontext_t passed to the signal
+// handler. A thread which just released the GIL may be found waiting while it
+// wakes up a waiting one. It is async-safe.
+bool WaitsForGil(const void *ucontext);
+
+#endif  // GOOGLECLOUDPROFILER_SRC_GIL_WAIT_H_
@@ -0,0 +1,341 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "heap_profiler.h"
+
+#include <stdint.h>
+
+#include <cmath>
+
+#include "clock.h"
+#include "log.h"
+#include "profile_builder.h"
+
+std::atomic<int64_t> HeapProfiler::hook_sampling_bytes_(
+    HeapProfiler::kDefaultSamplingBytes);
+HeapProfiler::Domain HeapProfiler::domains_[3] = {
+    {PYMEM_DOMAIN_RAW, {}}, {PYMEM_DOMAIN_MEM, {}}, {PYMEM_DOMAIN_OBJ, {}}};
+AsyncSafeTraceMultiset *HeapProfiler::traces_ = nullptr;
+HeapProfiler::LiveAllocation *HeapProfiler::live_allocations_ = nullptr;
+std::atomic<int64_t> HeapProfiler::live_count_(0);
+std::atomic<int64_t> HeapProfiler::dropped_count_(0);
+
+namespace {
+
+// Number of bytes left to allocate by the thread before the next sample, and
+// the state of its random number generator. Raw allocations may be made
+// without GIL, so the state must be per thread.
+thread_local int64_t bytes_until_sample = 0;
+thread_local uint64_t random_state = 0;
+
+// Whether the thread is in an allocator wrapper. The object and mem
+// allocators get large blocks from the raw allocator, which must not be
+// counted a second time.
+thread_local bool in_wrapper = false;
+
+// Marks the thread as in an allocator wrapper for the scope of the object.
+class WrapperScope {
+ public:
+  WrapperScope() : outermost_(!in_wrapper) { in_wrapper = true; }
+  ~WrapperScope() {
+    if (outermost_) {
+      in_wrapper = false;
+    }
+  }
+  // Whether the allocation is made by Python rather than by another wrapper.
+  bool outermost() const { return outermost_; }
+
+ private:
+  bool outermost_;
+};
+
+// Returns a random number uniformly distributed in (0, 1].
+double NextUniform() {
+  if (random_state == 0) {
+    // Seeds from the address of the thread's state and the time, which
+    // differ between threads.
+    struct timespec now = DefaultClock()->Now();
+    random_state = reinterpret_cast<uintptr_t>(&random_state) ^
+                   (static_cast<uint64_t>(now.tv_nsec) << 20) ^ now.tv_sec;
+    random_state |= 1;
+  }
+  // xorshift64*
+  random_state ^= random_state >> 12;
+  random_state ^= random_state << 25;
+  random_state ^= random_state >> 27;
+  uint64_t bits = (random_state * 0x2545F4914F6CDD1DULL) >> 11;
+  return (bits + 1.0) / 9007199254740992.0;  // 2^53
+}
+
+// Returns the number of bytes to allocate before the next sample, drawn from
+// an exponential distribution, so that sampling is a Poisson process over the
+// allocated bytes.
+int64_t NextSampleDistance(int64_t mean) {
+  return static_cast<int64_t>(-std::log(NextUniform()) * mean) + 1;
+}
+
+// Returns the slot of an address in a table of size entries. size must be a
+// power of 2.
+int64_t AddressSlot(uintptr_t address, int64_t size) {
+  uint64_t bits = address >> 4;
+  return (bits * 0x9E3779B97F4A7C15ULL) >> 32 & (size - 1);
+}
+
+// Lookups stop after this many entries, to bound the cost of a free.
+const int kMaxProbes = 32;
+
+}  // namespace
+
+void *HeapProfiler::Malloc(void *ctx, size_t size) {
+  Domain *domain = static_cast<Domain *>(ctx);
+  WrapperScope scope;
+  void *ptr = domain->original.malloc(domain->original.ctx, size);
+  if (ptr != nullptr && scope.outermost()) {
+    RecordAllocation(ptr, size);
+  }
+  return ptr;
+}
+
+void *HeapProfiler::Calloc(void *ctx, size_t nelem, size_t elsize) {
+  Domain *domain = static_cast<Domain *>(ctx);
+  WrapperScope scope;
+  void *ptr = domain->original.calloc(domain->original.ctx, nelem, elsize);
+  if (ptr != nullptr && scope.outermost()) {
+    RecordAllocation(ptr, nelem * elsize);
+  }
+  return ptr;
+}
+
+void *HeapProfiler::Realloc(void *ctx, void *ptr, size_t new_size) {
+  Domain *domain = static_cast<Domain *>(ctx);
+  WrapperScope scope;
+  if (!scope.outermost()) {
+    return domain->original.realloc(domain->original.ctx, ptr, new_size);
+  }
+  // The old block stops being tracked before the original realloc frees it.
+  // Raw allocations run without GIL, and another thread may get the same
+  // address right after, whose sample a later lookup would then remove.
+  Sample old_sample;
+  bool tracked = ptr != nullptr && RecordFree(ptr, &old_sample);
+  void *new_ptr = domain->original.realloc(domain->original.ctx, ptr, new_size);
+  if (new_ptr == nullptr) {
+    // The old block is left as is, and still in use.
+    if (tracked && new_size > 0 && !TrackLive(ptr, old_sample)) {
+      dropped_count_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return new_ptr;
+  }
+  // A resized block is accounted as a new allocation.
+  RecordAllocation(new_ptr, new_size);
+  return new_ptr;
+}
+
+void HeapProfiler::Free(void *ctx, void *ptr) {
+  Domain *domain = static_cast<Domain *>(ctx);
+  WrapperScope scope;
+  if (ptr != nullptr && scope.outermost()) {
+    RecordFree(ptr);
+  }
+  domain->original.free(domain->original.ctx, ptr);
+}
+
+void HeapProfiler::RecordAllocation(void *ptr, size_t size) {
+  int64_t sampling_bytes = hook_sampling_bytes_.load(std::memory_order_relaxed);
+  if (bytes_until_sample == 0) {
+    bytes_until_sample = NextSampleDistance(sampling_bytes);
+  }
+  bytes_until_sample -= size;
+  if (bytes_until_sample > 0) {
+    return;
+  }
+  bytes_until_sample = NextSampleDistance(sampling_bytes);
+
+  // An allocation of size bytes is sampled with probability
+  // 1 - exp(-size / sampling_bytes).
+  double size_bytes = size > 0 ? size : 1;
+  double probability = -std::expm1(-size_bytes / sampling_bytes);
+  int64_t objects = std::llround(1 / probability);
+  int64_t bytes = std::llround(size_bytes / probability);
+
+  CallTrace trace;
+  CallFrame frames[kMaxFramesToCapture];
+  trace.frames = frames;
+  // Raw allocations may be made by threads without Python thread state, in
+  // which case the trace is a single frame telling so.
+  trace.num_frames = PopulateSampledFrames(frames, get_thread_state_func());
+  int64_t location;
+  if (!traces_->Add(&trace, objects, bytes, &location)) {
+    dropped_count_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+
+  if (!TrackLive(ptr, Sample{objects, bytes, location})) {
+    // The allocation is counted as allocated, but not as in use.
+    dropped_count_.fetch_add(1, std::memory_order_relaxed);
+  }
+}
+
+bool HeapProfiler::TrackLive(void *ptr, const Sample &sample) {
+  uintptr_t address = reinterpret_cast<uintptr_t>(ptr);
+  int64_t slot = AddressSlot(address, kMaxLiveAllocations);
+  for (int i = 0; i < kMaxProbes; i++) {
+    LiveAllocation &entry =
+        live_allocations_[(slot + i) & (kMaxLiveAllocations - 1)];
+    // Slots of freed allocations are reused, lookups go past them.
+    uintptr_t expected = entry.address.load(std::memory_order_relaxed);
+    if ((expected == kSlotEmpty || expected == kSlotFreed) &&
+        entry.address.compare_exchange_strong(expected, kSlotClaimed,
+                                              std::memory_order_acquire)) {
+      entry.sample = sample;
+      entry.address.store(address, std::memory_order_release);
+      live_count_.fetch_add(1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  return false;
+}
+
+bool HeapProfiler::RecordFree(void *ptr, Sample *sample) {
+  if (live_count_.load(std::memory_order_relaxed) == 0) {
+    return false;
+  }
+  uintptr_t address = reinterpret_cast<uintptr_t>(ptr);
+  int64_t slot = AddressSlot(address, kMaxLiveAllocations);
+  for (int i = 0; i < kMaxProbes; i++) {
+    LiveAllocation &entry =
+        live_allocations_[(slot + i) & (kMaxLiveAllocations - 1)];
+    uintptr_t entry_address = entry.address.load(std::memory_order_acquire);
+    if (entry_address == kSlotEmpty) {
+      // Entries are never emptied while collecting, so the address can't be
+      // further.
+      return false;
+    }
+    if (entry_address == address) {
+      // The sample is read before the entry is released, as it may be
+      // claimed again right after.
+      Sample entry_sample = entry.sample;
+      if (entry.address.compare_exchange_strong(entry_address, kSlotFreed,
+                                                std::memory_order_relaxed)) {
+        live_count_.fetch_sub(1, std::memory_order_relaxed);
+        if (sample != nullptr) {
+          *sample = entry_sample;
+        }
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void HeapProfiler::InstallHooks() {
+  for (Domain &domain : domains_) {
+    PyMem_GetAllocator(domain.domain, &domain.original);
+    PyMemAllocatorEx hooks = {&domain, &Malloc, &Calloc, &Realloc, &Free};
+    PyMem_SetAllocator(domain.domain, &hooks);
+  }
+}
+
+void HeapProfiler::RemoveHooks() {
+  for (Domain &domain : domains_) {
+    PyMem_SetAllocator(domain.domain, &domain.original);
+  }
+}
+
+bool HeapProfiler::CollectTraces() {
+  Reset();
+  if (traces_ == nullptr || traces_->MaxEntries() != max_traces() ||
+      traces_->MaxArenaFrames() != max_arena_frames()) {
+    // As for Profiler::fixed_traces_, a table of a different size is leaked,
+    // as a wrapper may still be running on another thread when GIL is not
+    // held by raw allocations.
+    traces_ = new AsyncSafeTraceMultiset(max_traces(), max_arena_frames());
+  } else {
+    traces_->Reset();
+  }
+  if (live_allocations_ == nullptr) {
+    live_allocations_ = new LiveAllocation[kMaxLiveAllocations];
+  }
+  for (int64_t i = 0; i < kMaxLiveAllocations; i++) {
+    live_allocations_[i].address.store(kSlotEmpty, std::memory_order_relaxed);
+  }
+  live_count_.store(0, std::memory_order_relaxed);
+  dropped_count_.store(0, std::memory_order_relaxed);
+  hook_sampling_bytes_.store(sampling_bytes_, std::memory_order_relaxed);
+
+  InstallHooks();
+  // Releases GIL so that the user threads can execute.
+  Py_BEGIN_ALLOW_THREADS;
+
+  Clock *clock = DefaultClock();
+  // Flush the table every 100 ms, so that most traces are symbolized while
+  // collecting.
+  struct timespec flush_interval = {0, 100 * 1000 * 1000};  // 100 millisec
+  struct timespec finish_line =
+      TimeAdd(clock->Now(), NanosToTimeSpec(duration_nanos_));
+  while (TimeLessThan(TimeAdd(clock->Now(), flush_interval), finish_line)) {
+    clock->SleepFor(flush_interval);
+    HarvestSamples(traces_, &aggregated_traces_);
+    SymbolizeNewNodes();
+  }
+  clock->SleepUntil(finish_line);
+
+  // Reacquire the GIL.
+  Py_END_ALLOW_THREADS;
+  RemoveHooks();
+
+  HarvestSamples(traces_, &aggregated_traces_);
+  AddLiveAllocations();
+  int64_t dropped_count = dropped_count_.load(std::memory_order_relaxed);
+  if (dropped_count > 0) {
+    LogWarning("%lld sampled allocations could not be recorded",
+               static_cast<long long>(dropped_count));  // NOLINT
+  }
+  return true;
+}
+
+void HeapProfiler::AddLiveAllocations() {
+  for (int64_t i = 0; i < kMaxLiveAllocations; i++) {
+    const LiveAllocation &entry = live_allocations_[i];
+    uintptr_t address = entry.address.load(std::memory_order_acquire);
+    if (address == kSlotEmpty || address == kSlotFreed ||
+        address == kSlotClaimed) {
+      continue;
+    }
+    const CallFrame *frames;
+    int num_frames = traces_->Frames(entry.sample.location, &frames);
+    if (num_frames == 0) {
+      continue;
+    }
+    size_t node = aggregated_traces_.Insert(num_frames, frames);
+    aggregated_traces_.AddValue(node, 2, entry.sample.objects);
+    aggregated_traces_.AddValue(node, 3, entry.sample.bytes);
+  }
+}
+
+void HeapProfiler::SetUpProfile(const char *profile_type,
+                                ProfileBuilder *builder) {
+  (void)profile_type;
+  builder->SetPeriod("space", "bytes", sampling_bytes_);
+  builder->AddSampleType("alloc_objects", "count");
+  builder->AddSampleType("alloc_space", "bytes");
+  builder->AddSampleType("inuse_objects", "count");
+  builder->AddSampleType("inuse_space", "bytes");
+}
+
+void HeapProfiler::SampleValues(size_t node, std::vector<int64_t> *values) {
+  values->resize(4);
+  for (int i = 0; i < 4; i++) {
+    (*values)[i] = aggregated_traces_.Value(node, i);
+  }
+}
@@ -0,0 +1,145 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLECLOUDPROFILER_SRC_HEAP_PROFILER_H_
+#define GOOGLECLOUDPROFILER_SRC_HEAP_PROFILER_H_
+
+#include <Python.h>
+
+#include <atomic>
+#include <vector>
+
+#include "profiler.h"
+#include "stacktraces.h"
+
+// HeapProfiler samples the allocations made through the Python memory
+// allocators while collecting. The allocators of the raw, mem and object
+// domains are wrapped with PyMem_SetAllocator for the duration of the
+// collection.
+//
+// Allocations are sampled by size: an allocation is sampled when the number
+// of bytes allocated by its thread since the previous sample exceeds a random
+// distance, drawn from an exponential distribution with a mean of
+// sampling_bytes. Each sample is scaled by the inverse of the probability of
+// sampling an allocation of its size, so that the estimated counts and sizes
+// are unbiased.
+//
+// The profile has four values: the number and size of the allocations made
+// during the collection, and the number and size of those which are still
+// live at its end. Sampled allocations are tracked in a lock-free table until
+// they are freed.
+class HeapProfiler : public Profiler {
+ public:
+  // Default mean number of bytes allocated between two samples.
+  static const int64_t kDefaultSamplingBytes = 512 * 1024;
+
+  HeapProfiler(int64_t duration_nanos,
+               int64_t sampling_bytes = kDefaultSamplingBytes,
+               int64_t max_traces = AsyncSafeTraceMultiset::kDefaultMaxEntries,
+               int64_t max_arena_frames =
+                   AsyncSafeTraceMultiset::kDefaultMaxArenaFrames)
+      : Profiler(duration_nanos, 0, max_traces, max_arena_frames),
+        sampling_bytes_(sampling_bytes) {}
+
+ protected:
+  bool CollectTraces() override;
+
+  const char *ProfileType() const override { return "HEAP"; }
+
+  void SetUpProfile(const char *profile_type,
+                    ProfileBuilder *builder) override;
+
+  void SampleValues(size_t node, std::vector<int64_t> *values) override;
+
+  TraceTableStats TableStats() const override { return traces_->Stats(); }
+
+ private:
+  // Maximum number of sampled allocations tracked at the same time. Must be
+  // a power of 2.
+  static const int64_t kMaxLiveAllocations = 1 << 15;
+
+  // Values of LiveAllocation::address other than allocation addresses.
+  static const uintptr_t kSlotEmpty = 0;
+  static const uintptr_t kSlotFreed = 1;
+  static const uintptr_t kSlotClaimed = 2;
+
+  // The estimates and the trace of a sampled allocation.
+  struct Sample {
+    int64_t objects;
+    int64_t bytes;
+    // Location of the trace of the allocation in traces_.
+    int64_t location;
+  };
+
+  // A sampled allocation. The sample is written after address moves to
+  // kSlotClaimed, and published when address is set.
+  struct LiveAllocation {
+    std::atomic<uintptr_t> address;
+    Sample sample;
+  };
+
+  // A wrapped allocator domain. The wrappers get the domain as context.
+  struct Domain {
+    PyMemAllocatorDomain domain;
+    PyMemAllocatorEx original;
+  };
+
+  // Allocator wrappers.
+  static void *Malloc(void *ctx, size_t size);
+  static void *Calloc(void *ctx, size_t nelem, size_t elsize);
+  static void *Realloc(void *ctx, void *ptr, size_t new_size);
+  static void Free(void *ctx, void *ptr);
+
+  // Wraps the allocators of all domains. Must be called when GIL is held.
+  static void InstallHooks();
+
+  // Restores the allocators of all domains. Must be called when GIL is held.
+  static void RemoveHooks();
+
+  // Counts an allocation towards the next sample, and records it if it is
+  // sampled.
+  static void RecordAllocation(void *ptr, size_t size);
+
+  // Tracks a sampled allocation as live. Returns false if there is no free
+  // entry for it.
+  static bool TrackLive(void *ptr, const Sample &sample);
+
+  // Stops tracking an allocation if it was sampled. Returns whether it was,
+  // and then assigns its sample to sample if not nullptr.
+  static bool RecordFree(void *ptr, Sample *sample = nullptr);
+
+  // Adds the sampled allocations still live to aggregated_traces_.
+  void AddLiveAllocations();
+
+  int64_t sampling_bytes_;
+
+  // Sampling interval used by the wrappers.
+  static std::atomic<int64_t> hook_sampling_bytes_;
+  static Domain domains_[3];
+  // Traces of the sampled allocations, with the estimated number of
+  // allocations as count and their size as weight. Entries aren't recycled
+  // during the collection, as live allocations refer to their trace.
+  static AsyncSafeTraceMultiset *traces_;
+  // Open addressing hash table of kMaxLiveAllocations entries, keyed by
+  // address.
+  static LiveAllocation *live_allocations_;
+  // Number of live entries in live_allocations_, so that frees can skip the
+  // lookup when there are none.
+  static std::atomic<int64_t> live_count_;
+  // Number of sampled allocations which couldn't be recorded, either in
+  // traces_ or in live_allocations_.
+  static std::atomic<int64_t> dropped_count_;
+};
+
+#endif  // GOOGLECLOUDPROFILER_SRC_HEAP_PROFILER_H_
@@ -16,7 +16,11 @@
 
 #include <Python.h>
 
-void Log(const char *level, const char *fmt, ...) {
+#include <cstdarg>
+
+namespace {
+
+void Log(const char *level, const char *fmt, va_list ap) {
   // Ensures the current thread is ready to call the Python C API. GIL is
   // garanteed to be held.
   PyGILState_STATE gil_state = PyGILState_Ensure();
@@ -35,17 +39,17 @@ void Log(const char *level, const char *fmt, ...) {
     return;
   }
   char msg[200];
-  va_list ap;
-  va_start(ap, fmt);
   vsnprintf(msg, sizeof(msg), fmt, ap);
-  va_end(ap);
-  PyObject_CallMethod(logging, const_cast<char *>(level),
-                      const_cast<char *>("s"), msg);
+  PyObject *result = PyObject_CallMethod(logging, const_cast<char *>(level),
+                                         const_cast<char *>("s"), msg);
+  Py_XDECREF(result);
   // Resets the Python state to be the same as it was prior to the
   // corresponding PyGILState_Ensure() call.
   PyGILState_Release(gil_state);
 }
 
+}  // namespace
+
 void LogError(const char *fmt, ...) {
   va_list ap;
   va_start(ap, fmt);
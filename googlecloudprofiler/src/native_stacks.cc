@@ -0,0 +1,394 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "native_stacks.h"
+
+#include <cxxabi.h>
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/ucontext.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "populate_frames.h"
+
+namespace {
+
+// Code range of _PyEval_EvalFrameDefault, set by SetUpNativeUnwinding.
+std::atomic<uintptr_t> eval_frame_start(0);
+std::atomic<uintptr_t> eval_frame_end(0);
+
+// Frame pointers further than this from the stack pointer are assumed to be
+// garbage rather than frames.
+const uintptr_t kMaxStackSize = 64 << 20;
+
+// Reads size bytes at address into buffer without faulting on unmapped
+// memory, which a frame pointer may point to when the code it was read from
+// doesn't maintain frame pointers. process_vm_readv is a plain system call,
+// so it is async-safe.
+bool SafeRead(uintptr_t address, void *buffer, size_t size) {
+  struct iovec local = {buffer, size};
+  struct iovec remote = {reinterpret_cast<void *>(address), size};
+  return syscall(SYS_process_vm_readv, getpid(), &local, 1, &remote, 1, 0) ==
+         static_cast<ssize_t>(size);
+}
+
+// Populates pcs with the program counters of the native frames of the
+// interrupted thread, leaf first. Return addresses are decremented, so that
+// they point into the call instruction. Returns the number of program
+// counters populated.
+int UnwindNativeStack(const void *ucontext, uintptr_t *pcs, int max_pcs) {
+  const ucontext_t *uc = static_cast<const ucontext_t *>(ucontext);
+#if defined(__x86_64__)
+  uintptr_t pc = uc->uc_mcontext.gregs[REG_RIP];
+  uintptr_t fp = uc->uc_mcontext.gregs[REG_RBP];
+  uintptr_t sp = uc->uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+  uintptr_t pc = uc->uc_mcontext.pc;
+  uintptr_t fp = uc->uc_mcontext.regs[29];
+  uintptr_t sp = uc->uc_mcontext.sp;
+#else
+  (void)uc;
+  (void)pcs;
+  (void)max_pcs;
+  return 0;
+#endif
+#if defined(__x86_64__) || defined(__aarch64__)
+  if (max_pcs == 0 || pc == 0) {
+    return 0;
+  }
+  int num_pcs = 0;
+  pcs[num_pcs++] = pc;
+  uintptr_t stack_limit = sp + kMaxStackSize;
+  // On both architectures, a frame pointer points to the caller's frame
+  // pointer, followed by the return address.
+  while (num_pcs < max_pcs && fp >= sp && fp < stack_limit &&
+         fp % sizeof(uintptr_t) == 0) {
+    uintptr_t frame[2];
+    if (!SafeRead(fp, frame, sizeof(frame)) || frame[1] == 0) {
+      break;
+    }
+    pcs[num_pcs++] = frame[1] - 1;
+    // The stack grows down, so callers' frames are at higher addresses.
+    if (frame[0] <= fp) {
+      break;
+    }
+    sp = fp;
+    fp = frame[0];
+  }
+  return num_pcs;
+#endif
+}
+
+// Returns the demangled name of a C++ symbol, or the name itself.
+std::string Demangle(const std::string &name) {
+  int status = 0;
+  char *demangled = abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+  if (demangled == nullptr) {
+    return name;
+  }
+  std::string result(demangled);
+  free(demangled);
+  return result;
+}
+
+}  // namespace
+
+bool SetUpNativeUnwinding() {
+  if (eval_frame_end.load(std::memory_order_relaxed) != 0) {
+    return true;
+  }
+  NativeSymbolizer symbolizer;
+  uintptr_t start, end;
+  if (!symbolizer.FunctionRange(
+          reinterpret_cast<uintptr_t>(&_PyEval_EvalFrameDefault), &start,
+          &end)) {
+    return false;
+  }
+  eval_frame_start.store(start, std::memory_order_relaxed);
+  eval_frame_end.store(end, std::memory_order_relaxed);
+  return true;
+}
+
+int PopulateMixedFrames(CallFrame *frames, PyThreadState *ts,
+                        const void *ucontext) {
+  bool entry_frames[kMaxFramesToCapture];
+  int num_py_frames = PopulateFrames(frames, ts, entry_frames);
+  // Moves the Python frames to the end of frames. The merged trace is written
+  // from the start, and never catches up with the next Python frame to read,
+  // as at most kMaxFramesToCapture - num_py_frames native frames are added.
+  int py_start = kMaxFramesToCapture - num_py_frames;
+  for (int i = num_py_frames - 1; i >= 0; i--) {
+    frames[py_start + i] = frames[i];
+    entry_frames[py_start + i] = entry_frames[i];
+  }
+
+  uintptr_t pcs[kMaxFramesToCapture];
+  int num_pcs = UnwindNativeStack(ucontext, pcs, kMaxFramesToCapture);
+  uintptr_t eval_start = eval_frame_start.load(std::memory_order_relaxed);
+  uintptr_t eval_end = eval_frame_end.load(std::memory_order_relaxed);
+  int native_budget = py_start;
+  int num_frames = 0;
+  int py_frame = py_start;
+  for (int i = 0; i < num_pcs; i++) {
+    if (pcs[i] >= eval_start && pcs[i] < eval_end) {
+      // Adds the Python frames run by this call of the interpreter loop, up
+      // to and including its entry frame.
+      while (py_frame < kMaxFramesToCapture) {
+        bool entry_frame = entry_frames[py_frame];
+        frames[num_frames++] = frames[py_frame++];
+        if (entry_frame) {
+          break;
+        }
+      }
+      continue;
+    }
+    if (native_budget == 0) {
+      continue;
+    }
+    native_budget--;
+    frames[num_frames].lineno = kNativeFrame;
+    frames[num_frames].generation = 0;
+    frames[num_frames].py_code = reinterpret_cast<PyCodeObject *>(pcs[i]);
+    num_frames++;
+  }
+  // The Python frames whose interpreter loop wasn't unwound to go last.
+  while (py_frame < kMaxFramesToCapture) {
+    frames[num_frames++] = frames[py_frame++];
+  }
+  return num_frames;
+}
+
+bool NativeSymbolizer::Resolve(uintptr_t pc, std::string *name,
+                               std::string *filename) {
+  const Mapping *mapping;
+  const Function *function;
+  uint64_t address;
+  if (!Find(pc, &mapping, &function, &address)) {
+    return false;
+  }
+  *filename = mapping->path;
+  if (function != nullptr) {
+    *name = Demangle(function->name);
+  } else {
+    char offset[32];
+    snprintf(offset, sizeof(offset), "0x%llx",
+             static_cast<unsigned long long>(address));  // NOLINT
+    *name = offset;
+  }
+  return true;
+}
+
+bool NativeSymbolizer::FunctionRange(uintptr_t addr, uintptr_t *start,
+                                     uintptr_t *end) {
+  const Mapping *mapping;
+  const Function *function;
+  uint64_t address;
+  if (!Find(addr, &mapping, &function, &address) || function == nullptr ||
+      function->size == 0) {
+    return false;
+  }
+  *start = addr - (address - function->address);
+  *end = *start + function->size;
+  return true;
+}
+
+bool NativeSymbolizer::Find(uintptr_t pc, const Mapping **mapping,
+                            const Function **function, uint64_t *address) {
+  *mapping = FindMapping(pc);
+  if (*mapping == nullptr) {
+    // The file may have been loaded since the mappings were read.
+    ReadMappings();
+    *mapping = FindMapping(pc);
+    if (*mapping == nullptr) {
+      return false;
+    }
+  }
+  const ObjectFile &object = Object((*mapping)->path);
+  uint64_t offset = pc - (*mapping)->start + (*mapping)->offset;
+  // Without a segment, the offset in the file is the best address there is.
+  *address = offset;
+  for (const Segment &segment : object.segments) {
+    if (offset >= segment.offset && offset < segment.offset + segment.size) {
+      *address = offset - segment.offset + segment.address;
+      break;
+    }
+  }
+  *function = nullptr;
+  auto it = std::upper_bound(
+      object.functions.begin(), object.functions.end(), *address,
+      [](uint64_t a, const Function &f) { return a < f.address; });
+  if (it != object.functions.begin()) {
+    --it;
+    // Symbols without a size are assumed to extend to the next symbol.
+    if (it->size == 0 || *address < it->address + it->size) {
+      *function = &*it;
+    }
+  }
+  return true;
+}
+
+const NativeSymbolizer::Mapping *NativeSymbolizer::FindMapping(
+    uintptr_t pc) const {
+  auto it = std::upper_bound(
+      mappings_.begin(), mappings_.end(), pc,
+      [](uintptr_t a, const Mapping &m) { return a < m.start; });
+  if (it == mappings_.begin()) {
+    return nullptr;
+  }
+  --it;
+  return pc < it->end ? &*it : nullptr;
+}
+
+void NativeSymbolizer::ReadMappings() {
+  mappings_.clear();
+  FILE *maps = fopen("/proc/self/maps", "r");
+  if (maps == nullptr) {
+    return;
+  }
+  char line[4096];
+  while (fgets(line, sizeof(line), maps) != nullptr) {
+    unsigned long long start, end, offset;  // NOLINT
+    char perms[8];
+    int path_start = 0;
+    if (sscanf(line, "%llx-%llx %7s %llx %*s %*s %n", &start, &end, perms,
+               &offset, &path_start) < 4 ||
+        path_start == 0) {
+      continue;
+    }
+    // Only executable file mappings hold code which can be symbolized.
+    if (strchr(perms, 'x') == nullptr || line[path_start] != '/') {
+      continue;
+    }
+    Mapping mapping;
+    mapping.start = start;
+    mapping.end = end;
+    mapping.offset = offset;
+    mapping.path = line + path_start;
+    if (!mapping.path.empty() && mapping.path.back() == '\n') {
+      mapping.path.pop_back();
+    }
+    mappings_.push_back(mapping);
+  }
+  fclose(maps);
+  std::sort(mappings_.begin(), mappings_.end(),
+            [](const Mapping &m1, const Mapping &m2) {
+              return m1.start < m2.start;
+            });
+}
+
+const NativeSymbolizer::ObjectFile &NativeSymbolizer::Object(
+    const std::string &path) {
+  auto inserted = objects_.emplace(path, ObjectFile());
+  ObjectFile &object = inserted.first->second;
+  if (!inserted.second) {
+    return object;
+  }
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return object;
+  }
+  struct stat st;
+  void *data = MAP_FAILED;
+  if (fstat(fd, &st) == 0 &&
+      static_cast<size_t>(st.st_size) >= sizeof(Elf64_Ehdr)) {
+    data = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  }
+  close(fd);
+  if (data == MAP_FAILED) {
+    return object;
+  }
+  const char *base = static_cast<const char *>(data);
+  size_t size = st.st_size;
+  // Returns whether [offset, offset + count * entry_size) is in the file.
+  auto in_file = [size](uint64_t offset, uint64_t count, uint64_t entry_size) {
+    return offset <= size && count <= (size - offset) / entry_size;
+  };
+
+  const Elf64_Ehdr *ehdr = reinterpret_cast<const Elf64_Ehdr *>(base);
+  if (memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 ||
+      !in_file(ehdr->e_phoff, ehdr->e_phnum, sizeof(Elf64_Phdr)) ||
+      !in_file(ehdr->e_shoff, ehdr->e_shnum, sizeof(Elf64_Shdr))) {
+    munmap(data, size);
+    return object;
+  }
+
+  const Elf64_Phdr *phdrs =
+      reinterpret_cast<const Elf64_Phdr *>(base + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    if (phdrs[i].p_type == PT_LOAD) {
+      object.segments.push_back(
+          {phdrs[i].p_offset, phdrs[i].p_filesz, phdrs[i].p_vaddr});
+    }
+  }
+
+  const Elf64_Shdr *shdrs =
+      reinterpret_cast<const Elf64_Shdr *>(base + ehdr->e_shoff);
+  for (int i = 0; i < ehdr->e_shnum; i++) {
+    const Elf64_Shdr &symtab = shdrs[i];
+    // Stripped files only have the dynamic symbols.
+    if ((symtab.sh_type != SHT_SYMTAB && symtab.sh_type != SHT_DYNSYM) ||
+        symtab.sh_link >= ehdr->e_shnum ||
+        !in_file(symtab.sh_offset, symtab.sh_size / sizeof(Elf64_Sym),
+                 sizeof(Elf64_Sym))) {
+      continue;
+    }
+    const Elf64_Shdr &strtab = shdrs[symtab.sh_link];
+    if (!in_file(strtab.sh_offset, strtab.sh_size, 1)) {
+      continue;
+    }
+    const Elf64_Sym *syms =
+        reinterpret_cast<const Elf64_Sym *>(base + symtab.sh_offset);
+    const char *strings = base + strtab.sh_offset;
+    for (size_t j = 0; j < symtab.sh_size / sizeof(Elf64_Sym); j++) {
+      const Elf64_Sym &sym = syms[j];
+      int type = ELF64_ST_TYPE(sym.st_info);
+      if ((type != STT_FUNC && type != STT_GNU_IFUNC) ||
+          sym.st_shndx == SHN_UNDEF || sym.st_value == 0 ||
+          sym.st_name >= strtab.sh_size) {
+        continue;
+      }
+      const char *name = strings + sym.st_name;
+      object.functions.push_back(
+          {sym.st_value, sym.st_size,
+           std::string(name, strnlen(name, strtab.sh_size - sym.st_name))});
+    }
+  }
+  munmap(data, size);
+
+  // Symbols found in both tables are kept once.
+  std::sort(object.functions.begin(), object.functions.end(),
+            [](const Function &f1, const Function &f2) {
+              return f1.address < f2.address ||
+                     (f1.address == f2.address && f1.size > f2.size);
+            });
+  object.functions.erase(
+      std::unique(object.functions.begin(), object.functions.end(),
+                  [](const Function &f1, const Function &f2) {
+                    return f1.address == f2.address;
+                  }),
+      object.functions.end());
+  return object;
+}
@@ -0,0 +1,123 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLECLOUDPROFILER_SRC_NATIVE_STACKS_H_
+#define GOOGLECLOUDPROFILER_SRC_NATIVE_STACKS_H_
+
+#include <Python.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "stacktraces.h"
+
+// Mixed-mode stacks interleave the native frames of a thread with its Python
+// frames. Native frames are unwound from the signal context by following frame
+// pointers, so only the native code built with frame pointers is unwound past.
+// A native frame is a CallFrame whose lineno is kNativeFrame and whose py_code
+// holds the program counter, see NativeFramePC().
+//
+// Each native frame in _PyEval_EvalFrameDefault is replaced by the Python
+// frames run by that call of the interpreter loop, so that a C extension
+// called from Python shows up under its Python caller.
+
+// Finds the code range of _PyEval_EvalFrameDefault, so that signal handlers
+// can tell interpreter frames apart. Returns false if it can't be found, in
+// which case native frames are placed before all Python frames. Must be
+// called when GIL is held, before PopulateMixedFrames.
+bool SetUpNativeUnwinding();
+
+// Populates frames with at most kMaxFramesToCapture native and Python frames
+// of the thread interrupted by a signal, given the thread's state and the
+// ucontext_t passed to the signal handler. Python frames are never dropped to
+// make room for native ones. Returns the number of frames populated. It is
+// async-safe.
+int PopulateMixedFrames(CallFrame *frames, PyThreadState *ts,
+                        const void *ucontext);
+
+// Returns the program counter of a native frame.
+inline uintptr_t NativeFramePC(const CallFrame &frame) {
+  return reinterpret_cast<uintptr_t>(frame.py_code);
+}
+
+// NativeSymbolizer resolves program counters to the functions of the ELF
+// files mapped in the process, using their symbol tables. Mappings are read
+// from /proc/self/maps, and read again when a program counter is not in any
+// known mapping. It is not thread safe.
+class NativeSymbolizer {
+ public:
+  NativeSymbolizer() {}
+  // Not copyable or assignable.
+  NativeSymbolizer(const NativeSymbolizer &) = delete;
+  NativeSymbolizer &operator=(const NativeSymbolizer &) = delete;
+
+  // Resolves pc to the demangled name of its function and the path of its
+  // file. The name is the offset of pc in the file when no symbol covers it.
+  // Returns false if pc is not in a mapped file.
+  bool Resolve(uintptr_t pc, std::string *name, std::string *filename);
+
+  // Returns the address range [start, end) of the function containing addr.
+  bool FunctionRange(uintptr_t addr, uintptr_t *start, uintptr_t *end);
+
+ private:
+  // An executable mapping of a file.
+  struct Mapping {
+    uintptr_t start;
+    uintptr_t end;
+    uint64_t offset;
+    std::string path;
+  };
+
+  // A function symbol, at an address of the file's virtual address space.
+  struct Function {
+    uint64_t address;
+    uint64_t size;
+    std::string name;
+  };
+
+  // A loadable segment of an ELF file.
+  struct Segment {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t address;
+  };
+
+  struct ObjectFile {
+    std::vector<Segment> segments;
+    // Sorted by address.
+    std::vector<Function> functions;
+  };
+
+  // Finds the function containing pc. Sets function to nullptr if no symbol
+  // covers pc, and address to the address of pc in the file.
+  bool Find(uintptr_t pc, const Mapping **mapping, const Function **function,
+            uint64_t *address);
+
+  const Mapping *FindMapping(uintptr_t pc) const;
+
+  // Replaces mappings_ with the executable file mappings of the process.
+  void ReadMappings();
+
+  // Returns the parsed file, parsing it on first use. Files which can't be
+  // parsed have no segments and no functions.
+  const ObjectFile &Object(const std::string &path);
+
+  // Sorted by start address.
+  std::vector<Mapping> mappings_;
+  std::unordered_map<std::string, ObjectFile> objects_;
+};
+
+#endif  // GOOGLECLOUDPROFILER_SRC_NATIVE_STACKS_H_
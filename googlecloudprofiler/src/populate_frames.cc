@@ -65,18 +65,26 @@ static inline _PyInterpreterFrame *unsafe_PyInterpreterFrame_GetBack(
   return prev;
 }
 
-// Copied from
-// https://github.com/python/cpython/blob/v3.11.4/Python/frame.c#L165-L170 as
-// this function is not available in libpython
-int _PyInterpreterFrame_GetLine(_PyInterpreterFrame *frame) {
-  int addr = _PyInterpreterFrame_LASTI(frame) * sizeof(_Py_CODEUNIT);
-  return PyCode_Addr2Line(frame->f_code, addr);
+// Modified from
+// https://github.com/python/cpython/blob/v3.11.4/Python/frame.c#L165-L170
+// to only return the bytecode offset, see FrameLineNumber.
+static inline int unsafe_PyInterpreterFrame_GetAddr(
+    _PyInterpreterFrame *frame) {
+  return _PyInterpreterFrame_LASTI(frame) * sizeof(_Py_CODEUNIT);
 }
 
 int PopulateFrames(CallFrame *frames, PyThreadState *ts) {
+  return PopulateFrames(frames, ts, nullptr);
+}
+
+int PopulateFrames(CallFrame *frames, PyThreadState *ts, bool *entry_frames) {
   if (ts == nullptr) {
     frames[0].lineno = kNoPyState;
+    frames[0].generation = 0;
     frames[0].py_code = nullptr;
+    if (entry_frames != nullptr) {
+      entry_frames[0] = true;
+    }
     return 1;
   }
 
@@ -87,21 +95,117 @@ int PopulateFrames(CallFrame *frames, PyThreadState *ts) {
   _PyInterpreterFrame *frame = unsafe_PyThreadState_GetInterpreterFrame(ts);
   int num_frames = 0;
   while (frame != nullptr && num_frames < kMaxFramesToCapture) {
-    frames[num_frames].lineno = _PyInterpreterFrame_GetLine(frame);
+    frames[num_frames].lineno = unsafe_PyInterpreterFrame_GetAddr(frame);
+    frames[num_frames].generation = 0;
     frames[num_frames].py_code = unsafe_PyInterpreterFrame_GetCode(frame);
+    if (entry_frames != nullptr) {
+      entry_frames[num_frames] = frame->is_entry;
+    }
     num_frames++;
     frame = unsafe_PyInterpreterFrame_GetBack(frame);
   }
   return num_frames;
 }
 
+int FrameLineNumber(PyCodeObject *code, int lineno) {
+  return PyCode_Addr2Line(code, lineno);
+}
+
+void GetLineTable(PyCodeObject *code, const char **linetable, size_t *size,
+                  int *firstlineno) {
+  *linetable = PyBytes_AS_STRING(code->co_linetable);
+  *size = PyBytes_GET_SIZE(code->co_linetable);
+  *firstlineno = code->co_firstlineno;
+}
+
+namespace {
+
+// Reads an unsigned varint of the location table: 6 bits per byte, with the
+// 7th bit set on all bytes but the last one.
+unsigned int ReadVarint(const std::string &table, size_t *pos) {
+  unsigned int value = 0;
+  int shift = 0;
+  while (*pos < table.size()) {
+    unsigned char byte = table[(*pos)++];
+    value |= static_cast<unsigned int>(byte & 63) << shift;
+    shift += 6;
+    if ((byte & 64) == 0) {
+      break;
+    }
+  }
+  return value;
+}
+
+int ReadSignedVarint(const std::string &table, size_t *pos) {
+  unsigned int value = ReadVarint(table, pos);
+  return (value & 1) ? -static_cast<int>(value >> 1)
+                     : static_cast<int>(value >> 1);
+}
+
+}  // namespace
+
+// Decodes the location table format described in
+// https://github.com/python/cpython/blob/v3.11.4/Objects/locations.md, as
+// PyCode_Addr2Line does, without the code object.
+int FrameLineNumberFromTable(const std::string &linetable, int firstlineno,
+                             int lineno) {
+  int addr = lineno;
+  if (addr < 0) {
+    return firstlineno;
+  }
+  const int target = addr / sizeof(_Py_CODEUNIT);
+  int line = firstlineno;
+  int unit = 0;
+  size_t pos = 0;
+  while (pos < linetable.size()) {
+    unsigned char first_byte = linetable[pos++];
+    int code = (first_byte >> 3) & 15;
+    int length = (first_byte & 7) + 1;
+    bool has_line = true;
+    if (code == 15) {
+      // No location.
+      has_line = false;
+    } else if (code == 14) {
+      // Long form: line delta, end line delta, column, end column.
+      line += ReadSignedVarint(linetable, &pos);
+      ReadVarint(linetable, &pos);
+      ReadVarint(linetable, &pos);
+      ReadVarint(linetable, &pos);
+    } else if (code == 13) {
+      // No column: line delta.
+      line += ReadSignedVarint(linetable, &pos);
+    } else if (code >= 10) {
+      // One line form: the line delta is the code, followed by the start and
+      // end columns.
+      line += code - 10;
+      pos += 2;
+    } else {
+      // Short form: same line, followed by a column byte.
+      pos += 1;
+    }
+    if (target < unit + length) {
+      return has_line ? line : -1;
+    }
+    unit += length;
+  }
+  return -1;
+}
+
 #else
 // python versions before 3.11
 
 int PopulateFrames(CallFrame *frames, PyThreadState *ts) {
+  return PopulateFrames(frames, ts, nullptr);
+}
+
+int PopulateFrames(CallFrame *frames, PyThreadState *ts, bool *entry_frames) {
   if (ts == nullptr) {
     frames[0].lineno = kNoPyState;
+    frames[0].generation = 0;
     frames[0].py_code = nullptr;
+    if (entry_frames != nullptr) {
+      entry_frames[0] = true;
+    }
     return 1;
   }
   // We are running in the context of the thread interrupted by the signal
@@ -110,11 +214,35 @@ int PopulateFrames(CallFrame *frames, PyThreadState *ts) {
   int num_frames = 0;
   while (frame != nullptr && num_frames < kMaxFramesToCapture) {
     frames[num_frames].lineno = frame->f_lineno;
+    frames[num_frames].generation = 0;
     frames[num_frames].py_code = frame->f_code;
+    if (entry_frames != nullptr) {
+      entry_frames[num_frames] = true;
+    }
     num_frames++;
     frame = frame->f_back;
   }
   return num_frames;
 }
 
+int FrameLineNumber(PyCodeObject *code, int lineno) {
+  (void)code;
+  return lineno;
+}
+
+void GetLineTable(PyCodeObject *code, const char **linetable, size_t *size,
+                  int *firstlineno) {
+  (void)code;
+  *linetable = "";
+  *size = 0;
+  *firstlineno = 0;
+}
+
+int FrameLineNumberFromTable(const std::string &linetable, int firstlineno,
+                             int lineno) {
+  (void)linetable;
+  (void)firstlineno;
+  return lineno;
+}
+
 #endif  // PY_VERSION_HEX >= PY_311
@@ -3,12 +3,49 @@
 
 #include <Python.h>
 
+#include <string>
+
 #include "stacktraces.h"
 
 /**
  * Populates the CallFrame array with at-most kMaxFramesToCapture python frames
  * from the provided PyThreadState. Returns the number of frames populated.
+ *
+ * On Python 3.11 and later, the lineno of a frame is the bytecode offset of
+ * its last instruction rather than its line number: computing the line number
+ * requires decoding the line table of the code object, whose cost grows with
+ * the size of the code object, which is too expensive for a signal handler.
+ * FrameLineNumber converts it to a line number later.
  */
 int PopulateFrames(CallFrame* frames, PyThreadState* ts);
 
+/**
+ * Same as PopulateFrames, and sets entry_frames[i] to whether frames[i] is the
+ * entry frame of a call of _PyEval_EvalFrameDefault, i.e. the outermost frame
+ * run by that call. Before 3.11, every frame runs in its own call.
+ */
+int PopulateFrames(CallFrame* frames, PyThreadState* ts, bool* entry_frames);
+
+/**
+ * Returns the line number of a frame populated by PopulateFrames, given its
+ * live code object. Must be called when GIL is held.
+ */
+int FrameLineNumber(PyCodeObject* code, int lineno);
+
+/**
+ * Returns what FrameLineNumberFromTable needs from a code object in linetable,
+ * size and firstlineno, so that it can be copied and the frames of the code
+ * object can still be resolved after it is deallocated. linetable points into
+ * the code object.
+ */
+void GetLineTable(PyCodeObject* code, const char** linetable, size_t* size,
+                  int* firstlineno);
+
+/**
+ * Same as FrameLineNumber, for a code object whose line table was copied by
+ * GetLineTable. It doesn't use the Python C API.
+ */
+int FrameLineNumberFromTable(const std::string& linetable, int firstlineno,
+                             int lineno);
+
 #endif  // THIRD_PARTY_PY_GOOGLECLOUDPROFILER_SRC_POPULATE_FRAMES_H_
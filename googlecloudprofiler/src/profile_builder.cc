@@ -0,0 +1,256 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "profile_builder.h"
+
+namespace {
+
+// Field numbers from profile.proto.
+enum ProfileField {
+  kProfileSampleType = 1,
+  kProfileSample = 2,
+  kProfileLocation = 4,
+  kProfileFunction = 5,
+  kProfileStringTable = 6,
+  kProfileDurationNanos = 10,
+  kProfilePeriodType = 11,
+  kProfilePeriod = 12,
+  kProfileComment = 13,
+};
+
+enum ValueTypeField {
+  kValueTypeType = 1,
+  kValueTypeUnit = 2,
+};
+
+enum SampleField {
+  kSampleLocationId = 1,
+  kSampleValue = 2,
+  kSampleLabel = 3,
+};
+
+enum LabelField {
+  kLabelKey = 1,
+  kLabelStr = 2,
+  kLabelNum = 3,
+  kLabelNumUnit = 4,
+};
+
+enum LocationField {
+  kLocationId = 1,
+  kLocationLine = 4,
+};
+
+enum LineField {
+  kLineFunctionId = 1,
+  kLineLine = 2,
+};
+
+enum FunctionField {
+  kFunctionId = 1,
+  kFunctionName = 2,
+  kFunctionFilename = 4,
+};
+
+enum WireType {
+  kVarint = 0,
+  kLengthDelimited = 2,
+};
+
+void PutTag(int field, WireType wire_type, std::string *out) {
+  PutVarint((static_cast<uint64_t>(field) << 3) | wire_type, out);
+}
+
+// Zero values are omitted, as in proto3.
+void PutVarintField(int field, uint64_t value, std::string *out) {
+  if (value == 0) {
+    return;
+  }
+  PutTag(field, kVarint, out);
+  PutVarint(value, out);
+}
+
+void PutBytesField(int field, const std::string &value, std::string *out) {
+  PutTag(field, kLengthDelimited, out);
+  PutString(value, out);
+}
+
+std::string EncodeValueType(int64_t type, int64_t unit) {
+  std::string out;
+  PutVarintField(kValueTypeType, type, &out);
+  PutVarintField(kValueTypeUnit, unit, &out);
+  return out;
+}
+
+}  // namespace
+
+void PutVarint(uint64_t value, std::string *out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+void PutString(const std::string &value, std::string *out) {
+  PutVarint(value.size(), out);
+  out->append(value);
+}
+
+ProfileBuilder::ProfileBuilder() {
+  // string_table[0] in the profile proto must be an empty string.
+  StringId("");
+}
+
+void ProfileBuilder::SetPeriod(const std::string &type, const std::string &unit,
+                               int64_t period) {
+  period_type_ = StringId(type);
+  period_unit_ = StringId(unit);
+  period_ = period;
+}
+
+void ProfileBuilder::AddSampleType(const std::string &type,
+                                   const std::string &unit) {
+  PutBytesField(kProfileSampleType,
+                EncodeValueType(StringId(type), StringId(unit)),
+                &sample_types_);
+}
+
+int64_t ProfileBuilder::StringId(const std::string &value) {
+  auto inserted = string_map_.emplace(value, string_table_.size());
+  if (inserted.second) {
+    // Keys of an unordered_map are not moved on rehash, so it's safe to keep
+    // pointers to them.
+    string_table_.push_back(&inserted.first->first);
+  }
+  return inserted.first->second;
+}
+
+uint64_t ProfileBuilder::FunctionId(const std::string &name,
+                                    const std::string &filename) {
+  int64_t name_id = StringId(name);
+  int64_t filename_id = StringId(filename);
+  // Function ID in profile proto must not be zero.
+  auto inserted = function_map_.emplace(std::make_pair(name_id, filename_id),
+                                        function_map_.size() + 1);
+  if (inserted.second) {
+    std::string function;
+    PutVarintField(kFunctionId, inserted.first->second, &function);
+    PutVarintField(kFunctionName, name_id, &function);
+    PutVarintField(kFunctionFilename, filename_id, &function);
+    PutBytesField(kProfileFunction, function, &functions_);
+  }
+  return inserted.first->second;
+}
+
+uint64_t ProfileBuilder::LocationId(uint64_t function_id, int64_t line) {
+  // Location ID in profile proto must not be zero.
+  auto inserted = location_map_.emplace(
+      std::make_pair(static_cast<int64_t>(function_id), line),
+      location_map_.size() + 1);
+  if (inserted.second) {
+    std::string line_message;
+    PutVarintField(kLineFunctionId, function_id, &line_message);
+    PutVarintField(kLineLine, line, &line_message);
+    std::string location;
+    PutVarintField(kLocationId, inserted.first->second, &location);
+    PutBytesField(kLocationLine, line_message, &location);
+    PutBytesField(kProfileLocation, location, &locations_);
+  }
+  return inserted.first->second;
+}
+
+void ProfileBuilder::AddSample(const std::vector<uint64_t> &location_ids,
+                               const std::vector<int64_t> &values,
+                               const std::vector<Label> &labels) {
+  std::string packed_locations;
+  for (uint64_t id : location_ids) {
+    PutVarint(id, &packed_locations);
+  }
+  std::string packed_values;
+  for (int64_t value : values) {
+    PutVarint(static_cast<uint64_t>(value), &packed_values);
+  }
+  std::string sample;
+  PutBytesField(kSampleLocationId, packed_locations, &sample);
+  PutBytesField(kSampleValue, packed_values, &sample);
+  for (const Label &label : labels) {
+    std::string encoded;
+    PutVarintField(kLabelKey, StringId(label.key), &encoded);
+    if (label.str.empty()) {
+      PutVarintField(kLabelNum, static_cast<uint64_t>(label.num), &encoded);
+      if (!label.num_unit.empty()) {
+        PutVarintField(kLabelNumUnit, StringId(label.num_unit), &encoded);
+      }
+    } else {
+      PutVarintField(kLabelStr, StringId(label.str), &encoded);
+    }
+    PutBytesField(kSampleLabel, encoded, &sample);
+  }
+  PutBytesField(kProfileSample, sample, &samples_);
+}
+
+std::string ProfileBuilder::Serialize() const {
+  std::string out;
+  out.reserve(sample_types_.size() + samples_.size() + locations_.size() +
+              functions_.size());
+  out.append(sample_types_);
+  out.append(samples_);
+  out.append(locations_);
+  out.append(functions_);
+  for (const std::string *value : string_table_) {
+    PutBytesField(kProfileStringTable, *value, &out);
+  }
+  PutVarintField(kProfileDurationNanos, duration_nanos_, &out);
+  PutBytesField(kProfilePeriodType, EncodeValueType(period_type_, period_unit_),
+                &out);
+  PutVarintField(kProfilePeriod, period_, &out);
+  if (!comments_.empty()) {
+    std::string packed_comments;
+    for (int64_t id : comments_) {
+      PutVarint(id, &packed_comments);
+    }
+    PutBytesField(kProfileComment, packed_comments, &out);
+  }
+  return out;
+}
+
+PyObject *GzipCompress(const std::string &data) {
+  // wbits of 16 + MAX_WBITS makes zlib write the gzip header and trailer.
+  const int kGzipWbits = 16 + 15;
+  PyObject *zlib = PyImport_ImportModule("zlib");
+  if (zlib == nullptr) {
+    return nullptr;
+  }
+  PyObject *compressor = PyObject_CallMethod(zlib, "compressobj", "iii", -1,
+                                             8 /* DEFLATED */, kGzipWbits);
+  Py_DECREF(zlib);
+  if (compressor == nullptr) {
+    return nullptr;
+  }
+  PyObject *uncompressed = PyBytes_FromStringAndSize(data.data(), data.size());
+  PyObject *compressed = nullptr;
+  if (uncompressed != nullptr) {
+    compressed = PyObject_CallMethod(compressor, "compress", "O", uncompressed);
+    Py_DECREF(uncompressed);
+  }
+  if (compressed != nullptr) {
+    PyObject *tail = PyObject_CallMethod(compressor, "flush", nullptr);
+    // PyBytes_ConcatAndDel sets compressed to nullptr on failure and steals
+    // the reference to tail.
+    PyBytes_ConcatAndDel(&compressed, tail);
+  }
+  Py_DECREF(compressor);
+  return compressed;
+}
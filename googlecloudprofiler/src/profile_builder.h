@@ -0,0 +1,122 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLECLOUDPROFILER_SRC_PROFILE_BUILDER_H_
+#define GOOGLECLOUDPROFILER_SRC_PROFILE_BUILDER_H_
+
+#include <Python.h>
+#include <stdint.h>
+
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// ProfileBuilder is the native counterpart of builder.Builder. It interns
+// strings, functions and locations, and writes the profile.proto wire format
+// (https://github.com/google/pprof/blob/master/proto/profile.proto) directly,
+// without going through protobuf messages. It does not use the Python C API,
+// so it can be used without holding the GIL.
+class ProfileBuilder {
+ public:
+  // A label of a sample, which has either a string value or a numeric value
+  // with an optional unit.
+  struct Label {
+    std::string key;
+    std::string str;
+    int64_t num;
+    std::string num_unit;
+  };
+
+  ProfileBuilder();
+  // Not copyable or assignable.
+  ProfileBuilder(const ProfileBuilder &) = delete;
+  ProfileBuilder &operator=(const ProfileBuilder &) = delete;
+
+  // Sets the period type and the period, e.g. ("CPU", "nanoseconds", 1e7).
+  void SetPeriod(const std::string &type, const std::string &unit,
+                 int64_t period);
+
+  // Appends a sample type. Values passed to AddSample must follow the order in
+  // which the sample types are added.
+  void AddSampleType(const std::string &type, const std::string &unit);
+
+  void SetDurationNanos(int64_t duration_nanos) {
+    duration_nanos_ = duration_nanos;
+  }
+
+  // Finds the string ID, adds the string if not yet exists.
+  int64_t StringId(const std::string &value);
+
+  // Finds the function ID, adds the function if not yet exists.
+  uint64_t FunctionId(const std::string &name, const std::string &filename);
+
+  // Finds the location ID, adds the location if not yet exists.
+  uint64_t LocationId(uint64_t function_id, int64_t line);
+
+  // Adds a free-form comment, e.g. a statistic of the profiler.
+  void AddComment(const std::string &comment) {
+    comments_.push_back(StringId(comment));
+  }
+
+  // Adds a sample. The leaf location is at location_ids[0].
+  void AddSample(const std::vector<uint64_t> &location_ids,
+                 const std::vector<int64_t> &values,
+                 const std::vector<Label> &labels = {});
+
+  // Returns the profile in uncompressed profile proto format.
+  std::string Serialize() const;
+
+ private:
+  struct PairHash {
+    std::size_t operator()(const std::pair<int64_t, int64_t> &p) const {
+      return std::hash<int64_t>()(p.first) * 31 + std::hash<int64_t>()(p.second);
+    }
+  };
+  typedef std::unordered_map<std::pair<int64_t, int64_t>, uint64_t, PairHash>
+      PairIdMap;
+
+  int64_t period_type_ = 0;
+  int64_t period_unit_ = 0;
+  int64_t period_ = 0;
+  int64_t duration_nanos_ = 0;
+
+  std::unordered_map<std::string, int64_t> string_map_;
+  std::vector<const std::string *> string_table_;
+  PairIdMap function_map_;
+  PairIdMap location_map_;
+
+  // Encoded repeated fields of the Profile message, appended incrementally.
+  std::string sample_types_;
+  std::string samples_;
+  std::string functions_;
+  std::string locations_;
+  // String IDs of the comments.
+  std::vector<int64_t> comments_;
+};
+
+// Appends value to out as an unsigned LEB128 varint, as in the protobuf wire
+// format.
+void PutVarint(uint64_t value, std::string *out);
+
+// Appends value to out prefixed with its size as a varint, as a
+// length-delimited protobuf field without its tag.
+void PutString(const std::string &value, std::string *out);
+
+// Compresses data in gzip format using the Python zlib module, which releases
+// the GIL while compressing. Returns a new bytes object, or nullptr with a
+// Python exception set on failure. Must be called when GIL is held.
+PyObject *GzipCompress(const std::string &data);
+
+#endif  // GOOGLECLOUDPROFILER_SRC_PROFILE_BUILDER_H_
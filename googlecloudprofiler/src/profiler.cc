@@ -14,23 +14,51 @@
 
 #include "profiler.h"
 
+#include <dirent.h>
 #include <errno.h>
 #include <pythread.h>
+#include <sys/syscall.h>
 #include <sys/time.h>
 #include <sys/ucontext.h>
+#include <unistd.h>
 
+#include <algorithm>
 #include <cstdlib>
 #include <cstring>
 #include <iostream>
+#include <unordered_set>
+#include <vector>
 
 #include "clock.h"
+#include "gil_wait.h"
 #include "log.h"
+#include "native_stacks.h"
 #include "populate_frames.h"
+#include "profile_builder.h"
+#include "sample_labels.h"
 
-AsyncSafeTraceMultiset *Profiler::fixed_traces_ = nullptr;
+ShardedTraceMultiset *Profiler::fixed_traces_ = nullptr;
+SymbolTable *Profiler::symbols_ = nullptr;
 std::atomic<int> Profiler::unknown_stack_count_;
+std::atomic<int64_t> Profiler::unknown_stack_weight_;
+std::atomic<bool> Profiler::collecting_(false);
+ProfilerStats Profiler::stats_;
+ProfilerStats::Snapshot Profiler::last_stats_;
+std::atomic<SampleTimeline *> Profiler::timeline_(nullptr);
+SampleTimeline *Profiler::timeline_storage_ = nullptr;
+int64_t Profiler::timeline_realtime_offset_nanos_ = 0;
+std::unique_ptr<ResolvedTimeline> Profiler::last_timeline_;
+std::atomic<bool> Profiler::thread_labels_(false);
+std::atomic<pid_t> *Profiler::labelled_threads_ = nullptr;
+std::atomic<bool> Profiler::native_frames_(false);
+std::atomic<int64_t> Profiler::sampling_period_nanos_(0);
+std::atomic<int64_t> Profiler::last_sample_cpu_nanos_(0);
 GetThreadStateFunc get_thread_state_func = PyGILState_GetThisThreadState;
-bool CPUProfiler::fork_handlers_registered_;
+bool Profiler::fork_handlers_registered_;
+// The bounds are passed by reference to std::min and std::max, which needs
+// their definitions.
+const int64_t CPUProfiler::kMinAdaptivePeriodNanos;
+const int64_t CPUProfiler::kMaxAdaptivePeriodNanos;
 
 namespace {
 
@@ -59,35 +87,188 @@ class ErrnoRaii {
   int stored_errno_;
 };
 
+// Returns whether the thread state holds the GIL. It reads the current thread
+// state without checking it, so it's async-safe. Before 3.12, the current
+// thread state is the one holding the GIL in the process; from 3.12, it's
+// the one attached to the calling thread, which holds the GIL while attached.
+bool HoldsGil(PyThreadState *ts) {
+#if PY_VERSION_HEX >= 0x030D0000
+  return ts == PyThreadState_GetUnchecked();
+#else
+  return ts == _PyThreadState_UncheckedGet();
+#endif
+}
+
 }  // namespace
 
 destructor CodeDeallocHook::old_code_dealloc_ = nullptr;
-std::unordered_map<PyCodeObject *, FuncLoc>
+CodeDeallocHook::SampledCode *CodeDeallocHook::sampled_code_ = nullptr;
+std::atomic<bool> CodeDeallocHook::sampled_code_full_(false);
+std::atomic<int> CodeDeallocHook::first_generation_(1);
+std::vector<CodeDeallocHook::DeallocatedCode>
     *CodeDeallocHook::deallocated_code_ = nullptr;
+StringArena *CodeDeallocHook::strings_ = nullptr;
+std::unordered_map<std::pair<PyCodeObject *, int>, size_t,
+                   CodeDeallocHook::DeallocatedCodeKeyHash>
+    *CodeDeallocHook::deallocated_code_index_ = nullptr;
+size_t CodeDeallocHook::deallocated_code_indexed_ = 0;
+
+namespace {
+
+// Returns the index of the first entry to probe for a code object in a table
+// of size entries. size must be a power of 2.
+int64_t CodeSlot(PyCodeObject *code, int64_t size) {
+  // Code objects are at least 16-byte aligned, the low bits carry no
+  // information.
+  uint64_t bits = reinterpret_cast<uintptr_t>(code) >> 4;
+  return (bits * 0x9E3779B97F4A7C15ULL) >> 32 & (size - 1);
+}
+
+// Copies a str attribute of a code object into arena, as GetFuncLoc does
+// without the intermediate std::string.
+ArenaString AddCodeString(PyObject *str, StringArena *arena) {
+  Py_ssize_t size;
+  const char *utf8 = PyUnicode_AsUTF8AndSize(str, &size);
+  if (utf8 == nullptr) {
+    PyErr_Clear();
+    return arena->Add("unknown", 7);
+  }
+  return arena->Add(utf8, size);
+}
+
+}  // namespace
 
 void CodeDeallocHook::CodeDealloc(PyObject *py_object) {
-  FuncLoc func_loc;
   PyCodeObject *code_object = reinterpret_cast<PyCodeObject *>(py_object);
-  GetFuncLoc(code_object, &func_loc);
-  deallocated_code_->insert(std::make_pair(code_object, func_loc));
+  int generation;
+  if (TakeGeneration(code_object, &generation)) {
+    DeallocatedCode code;
+    code.code = code_object;
+    code.generation = generation;
+    code.name = AddCodeString(code_object->co_name, strings_);
+    code.filename = AddCodeString(code_object->co_filename, strings_);
+    // Bytecode offsets of sampled frames are converted to line numbers after
+    // the collection, when the code object is gone.
+    const char *linetable;
+    size_t linetable_size;
+    GetLineTable(code_object, &linetable, &linetable_size, &code.firstlineno);
+    code.linetable = strings_->Add(linetable, linetable_size);
+    deallocated_code_->push_back(code);
+  }
 
   old_code_dealloc_(py_object);
 }
 
+int CodeDeallocHook::MarkSampled(PyCodeObject *code) {
+  // Probing stops early, as a table with long probe sequences is full enough
+  // to fall back to recording all code objects anyway.
+  const int kMaxProbes = 64;
+  SampledCode *table = sampled_code_;
+  if (table == nullptr) {
+    return 0;
+  }
+  int64_t slot = CodeSlot(code, kMaxSampledCode);
+  for (int i = 0; i < kMaxProbes; i++) {
+    SampledCode &entry = table[(slot + i) & (kMaxSampledCode - 1)];
+    PyCodeObject *entry_code = entry.code.load(std::memory_order_acquire);
+    if (entry_code == nullptr &&
+        entry.code.compare_exchange_strong(entry_code, code)) {
+      entry_code = code;
+    }
+    // Either the entry was already taken, or another thread took it in the
+    // meantime, and compare_exchange_strong loaded its code object.
+    if (entry_code == code) {
+      // Reset() clears the entry before setting its generation, so the entry
+      // still holding the code object after the generation is read means
+      // that the generation is the one of the registration.
+      int generation = entry.generation.load();
+      return entry.code.load() == code ? generation : 0;
+    }
+  }
+  // Reset() clears the flag before moving to the next generation, so the
+  // flag is set for the generation returned if it didn't move meanwhile.
+  int generation = first_generation_.load();
+  sampled_code_full_.store(true);
+  return first_generation_.load() == generation ? generation : 0;
+}
+
+bool CodeDeallocHook::TakeGeneration(PyCodeObject *code, int *generation) {
+  const int kMaxProbes = 64;
+  int64_t slot = CodeSlot(code, kMaxSampledCode);
+  for (int i = 0; i < kMaxProbes; i++) {
+    SampledCode &entry = sampled_code_[(slot + i) & (kMaxSampledCode - 1)];
+    PyCodeObject *entry_code = entry.code.load(std::memory_order_acquire);
+    if (entry_code == nullptr) {
+      break;
+    }
+    if (entry_code == code) {
+      // No frame can refer to the code object being deallocated, so no signal
+      // handler reads the generation concurrently.
+      *generation = entry.generation.load(std::memory_order_relaxed);
+      entry.generation.store(*generation + 1, std::memory_order_relaxed);
+      return true;
+    }
+  }
+  if (sampled_code_full_.load()) {
+    // The code object may have been sampled without being registered.
+    *generation = first_generation_.load();
+    return true;
+  }
+  return false;
+}
+
 void CodeDeallocHook::Reset() {
-  if (deallocated_code_ == nullptr) {
-    deallocated_code_ = new std::unordered_map<PyCodeObject *, FuncLoc>;
+  // The next generations are above all those given so far, which the entries
+  // hold at most.
+  int first_generation = first_generation_.load() + 1;
+  if (sampled_code_ == nullptr) {
+    sampled_code_ = new SampledCode[kMaxSampledCode];
+    deallocated_code_ = new std::vector<DeallocatedCode>;
+    strings_ = new StringArena;
+    deallocated_code_index_ =
+        new std::unordered_map<std::pair<PyCodeObject *, int>, size_t,
+                               DeallocatedCodeKeyHash>;
   } else {
     deallocated_code_->clear();
+    strings_->Clear();
+    deallocated_code_index_->clear();
+    for (int64_t i = 0; i < kMaxSampledCode; i++) {
+      first_generation =
+          std::max(first_generation, sampled_code_[i].generation.load() + 1);
+    }
+  }
+  deallocated_code_indexed_ = 0;
+  // Signal handlers may register code objects meanwhile, see MarkSampled()
+  // for how they detect it. The frames they sample then get a generation
+  // below the first one, and are resolved as unknown.
+  sampled_code_full_.store(false);
+  first_generation_.store(first_generation);
+  for (int64_t i = 0; i < kMaxSampledCode; i++) {
+    sampled_code_[i].code.store(nullptr);
+    sampled_code_[i].generation.store(first_generation + 1);
   }
 }
 
-bool CodeDeallocHook::Find(PyCodeObject *pointer, FuncLoc *func_loc) {
-  auto recorded_code = deallocated_code_->find(pointer);
-  if (recorded_code == deallocated_code_->end()) {
+bool CodeDeallocHook::Find(PyCodeObject *pointer, int generation,
+                           FuncLoc *func_loc) {
+  for (; deallocated_code_indexed_ < deallocated_code_->size();
+       deallocated_code_indexed_++) {
+    const DeallocatedCode &code =
+        (*deallocated_code_)[deallocated_code_indexed_];
+    deallocated_code_index_->emplace(
+        std::make_pair(code.code, code.generation), deallocated_code_indexed_);
+  }
+  auto recorded_code =
+      deallocated_code_index_->find(std::make_pair(pointer, generation));
+  if (recorded_code == deallocated_code_index_->end()) {
     return false;
   }
-  *func_loc = recorded_code->second;
+  const DeallocatedCode &code = (*deallocated_code_)[recorded_code->second];
+  func_loc->name = code.name.ToString();
+  func_loc->filename = code.filename.ToString();
+  func_loc->has_linetable = true;
+  func_loc->linetable = code.linetable.ToString();
+  func_loc->firstlineno = code.firstlineno;
   return true;
 }
 
@@ -104,6 +285,105 @@ bool SignalHandler::SetSigprofInterval(int64_t period_usec) {
   return true;
 }
 
+namespace {
+
+// Returns the clock measuring the CPU time of the given thread, which can be
+// any thread of the process. This is MAKE_THREAD_CPUCLOCK(tid, CPUCLOCK_SCHED)
+// from the kernel's include/linux/posix-timers.h.
+clockid_t ThreadCPUClock(pid_t tid) {
+  const unsigned int kCPUClockPerThread = 4;
+  const unsigned int kCPUClockSched = 2;
+  return static_cast<clockid_t>((~static_cast<unsigned int>(tid) << 3) |
+                                kCPUClockPerThread | kCPUClockSched);
+}
+
+}  // namespace
+
+// Not all libc versions define the name of the sigevent field holding the
+// thread ID used with SIGEV_THREAD_ID.
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+bool ThreadCPUTimers::Update(int64_t period_usec) {
+  std::vector<pid_t> threads;
+  ListThreads(&threads);
+  std::unordered_set<pid_t> live_threads(threads.begin(), threads.end());
+
+  // Forgets the threads which exited. The kernel disarms the CPU timers of a
+  // thread when it exits, so a timer with no remaining time belongs to an
+  // exited thread. This also handles a thread ID being reused by a new
+  // thread, which then gets a timer of its own below. High-resolution timers
+  // stay armed, so their threads are looked up instead.
+  for (auto it = timers_.begin(); it != timers_.end();) {
+    struct itimerspec remaining;
+    if (timer_gettime(it->second, &remaining) != 0 ||
+        (remaining.it_value.tv_sec == 0 && remaining.it_value.tv_nsec == 0) ||
+        live_threads.count(it->first) == 0) {
+      timer_delete(it->second);
+      it = timers_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+
+  struct itimerspec interval;
+  interval.it_interval.tv_sec = period_usec / kMicrosPerSecond;
+  interval.it_interval.tv_nsec = (period_usec % kMicrosPerSecond) * 1000;
+  interval.it_value = interval.it_interval;
+
+  if (period_usec != period_usec_) {
+    for (const auto &timer : timers_) {
+      timer_settime(timer.second, 0, &interval, nullptr);
+    }
+    period_usec_ = period_usec;
+  }
+
+  for (pid_t tid : threads) {
+    if (timers_.count(tid) != 0) {
+      continue;
+    }
+    struct sigevent event;
+    memset(&event, 0, sizeof(event));
+    event.sigev_notify = SIGEV_THREAD_ID;
+    event.sigev_signo = SIGPROF;
+    event.sigev_notify_thread_id = tid;
+    clockid_t clock = ThreadCPUClock(tid);
+    if (high_resolution_) {
+      struct timespec cpu_time;
+      if (clock_gettime(clock, &cpu_time) != 0) {
+        // The thread exited since it was listed.
+        continue;
+      }
+      last_cpu_nanos_.emplace_back(
+          new std::atomic<int64_t>(TimeSpecToNanos(cpu_time)));
+      event.sigev_value.sival_ptr = last_cpu_nanos_.back().get();
+      clock = CLOCK_MONOTONIC;
+    }
+    timer_t timer;
+    if (timer_create(clock, &event, &timer) != 0) {
+      // The thread may have exited since it was listed.
+      continue;
+    }
+    if (timer_settime(timer, 0, &interval, nullptr) != 0) {
+      LogError("Failed to start the CPU timer of thread %d: %s", tid,
+               strerror(errno));
+      timer_delete(timer);
+      continue;
+    }
+    timers_[tid] = timer;
+  }
+  return !timers_.empty();
+}
+
+void ThreadCPUTimers::Stop() {
+  for (const auto &timer : timers_) {
+    timer_delete(timer.second);
+  }
+  timers_.clear();
+  period_usec_ = 0;
+}
+
 struct sigaction SignalHandler::SetAction(void (*action)(int, siginfo_t *,
                                                          void *)) {
   struct sigaction sa;
@@ -122,38 +402,161 @@ struct sigaction SignalHandler::SetAction(void (*action)(int, siginfo_t *,
   return old_handler;
 }
 
-const char *CallTraceErrorToName(CallTraceErrors err) {
-  switch (err) {
-    case kNoPyState:
-      return "[Unknown - No Python thread state]";
-    default:
-      return "[Unknown]";
-  }
-}
-
 void Profiler::Handle(int signum, siginfo_t *info, void *context) {
   // Gets around -Wunused-parameter.
   (void)signum;
-  (void)info;
-  (void)context;
 
   ErrnoRaii err_storage;  // stores and resets errno
+  struct timespec start = DefaultClock()->Now();
 
-  CallTrace trace;
-  CallFrame frames[kMaxFramesToCapture];
-  trace.frames = frames;
-  trace.num_frames = 0;
+  int64_t weight = SampleWeight(info);
+  if (weight > 0) {
+    // PyGILState_GetThisThreadState uses pthread_getspecific which is not
+    // guaranteed to be async-signal-safe per POSIX. Some issues can be
+    // found at https://sourceware.org/glibc/wiki/TLSandSignals.
+    // TODO: check if the limitations are practical here and if
+    // there are ways to avoid the problems.
+    PyThreadState *ts = get_thread_state_func();
+    RecordTrace(ts, weight,
+                native_frames_.load(std::memory_order_relaxed) ? context
+                                                               : nullptr);
+  }
+  RecordHandler(start);
+}
 
-  // PyGILState_GetThisThreadState uses pthread_getspecific which is not
-  // guaranteed to be async-signal-safe per POSIX. Some issues can be
-  // found at https://sourceware.org/glibc/wiki/TLSandSignals.
-  // TODO: check if the limitations are practical here and if
-  // there are ways to avoid the problems.
-  PyThreadState *ts = get_thread_state_func();
+int64_t Profiler::SampleWeight(const siginfo_t *info) {
+  int64_t period_nanos = sampling_period_nanos_.load(std::memory_order_relaxed);
+  if (info != nullptr && info->si_code == SI_TIMER) {
+    if (info->si_value.sival_ptr == nullptr) {
+      return period_nanos * (1 + info->si_overrun);
+    }
+    // A high-resolution timer, which only signals its own thread.
+    std::atomic<int64_t> *last_cpu_nanos =
+        static_cast<std::atomic<int64_t> *>(info->si_value.sival_ptr);
+    struct timespec cpu_time;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &cpu_time) != 0) {
+      return 0;
+    }
+    int64_t cpu_nanos = TimeSpecToNanos(cpu_time);
+    int64_t thread_nanos =
+        cpu_nanos - last_cpu_nanos->load(std::memory_order_relaxed);
+    // The CPU time of a thread which barely ran, e.g. the time it spent
+    // handling these signals, is carried over to its next sample.
+    if (thread_nanos < period_nanos / 2) {
+      return 0;
+    }
+    last_cpu_nanos->store(cpu_nanos, std::memory_order_relaxed);
+    return thread_nanos;
+  }
+  // clock_gettime is async-signal-safe.
+  struct timespec cpu_time;
+  if (clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_time) != 0) {
+    return period_nanos;
+  }
+  int64_t cpu_nanos = TimeSpecToNanos(cpu_time);
+  // Samples handled concurrently by several threads each take the CPU time
+  // since the one before, so that the time is counted once.
+  int64_t last_cpu_nanos = last_sample_cpu_nanos_.exchange(cpu_nanos);
+  if (last_cpu_nanos <= 0 || cpu_nanos <= last_cpu_nanos) {
+    return period_nanos;
+  }
+  return cpu_nanos - last_cpu_nanos;
+}
+
+void Profiler::RecordHandler(const struct timespec &start) {
+  // clock_gettime is async-signal-safe.
+  stats_.RecordHandler(TimeSpecToNanos(DefaultClock()->Now()) -
+                       TimeSpecToNanos(start));
+}
+
+int Profiler::PopulateSampledFrames(CallFrame *frames, PyThreadState *ts,
+                                    const void *ucontext) {
+  int num_frames = ucontext != nullptr
+                       ? PopulateMixedFrames(frames, ts, ucontext)
+                       : PopulateFrames(frames, ts);
+  for (int i = 0; i < num_frames; i++) {
+    if (frames[i].py_code != nullptr && frames[i].lineno != kNativeFrame) {
+      frames[i].generation = CodeDeallocHook::MarkSampled(frames[i].py_code);
+    }
+  }
+  return num_frames;
+}
+
+bool Profiler::LabelThread(pid_t tid) {
+  std::atomic<pid_t> *table = labelled_threads_;
+  if (table == nullptr) {
+    return false;
+  }
+  uint64_t slot = static_cast<uint64_t>(tid) * 0x9E3779B97F4A7C15ULL >> 32;
+  for (int i = 0; i < kMaxLabelledThreads; i++) {
+    std::atomic<pid_t> &entry = table[(slot + i) & (kMaxLabelledThreads - 1)];
+    pid_t entry_tid = entry.load(std::memory_order_relaxed);
+    if (entry_tid == 0 &&
+        entry.compare_exchange_strong(entry_tid, tid,
+                                      std::memory_order_relaxed)) {
+      return true;
+    }
+    // Either the entry was already taken, or another thread took it in the
+    // meantime, and compare_exchange_strong loaded its thread ID.
+    if (entry_tid == tid) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void Profiler::ClearLabelledThreads() {
+  if (labelled_threads_ == nullptr) {
+    labelled_threads_ = new std::atomic<pid_t>[kMaxLabelledThreads];
+  }
+  // When clearing while collecting, a thread being registered concurrently
+  // may be left out until its next sample, which is harmless.
+  for (int i = 0; i < kMaxLabelledThreads; i++) {
+    labelled_threads_[i].store(0, std::memory_order_relaxed);
+  }
+}
 
-  trace.num_frames = PopulateFrames(frames, ts);
-  if (!fixed_traces_->Add(&trace)) {
+void Profiler::RecordTrace(PyThreadState *ts, int64_t weight,
+                           const void *ucontext) {
+  CallTrace trace;
+  // Room is left for the label set and thread frames after the frames
+  // captured, so that they never replace the outermost frame of a trace.
+  CallFrame frames[kMaxFramesToCapture + 2];
+  trace.frames = frames;
+  trace.num_frames = PopulateSampledFrames(frames, ts, ucontext);
+  uint32_t label_set = SampleLabels::Current(ts);
+  if (label_set != 0) {
+    frames[trace.num_frames].lineno = kLabelSetFrame;
+    frames[trace.num_frames].generation = label_set;
+    frames[trace.num_frames].py_code = nullptr;
+    trace.num_frames++;
+  }
+  // syscall is async-signal-safe.
+  pid_t tid = syscall(SYS_gettid);
+  if (thread_labels_.load(std::memory_order_relaxed)) {
+    bool labelled = LabelThread(tid);
+    frames[trace.num_frames].lineno = kThreadFrame;
+    frames[trace.num_frames].generation = labelled ? tid : 0;
+    frames[trace.num_frames].py_code =
+        labelled && ts != nullptr
+            ? reinterpret_cast<PyCodeObject *>(
+                  static_cast<uintptr_t>(ts->thread_id))
+            : nullptr;
+    trace.num_frames++;
+  }
+  uint64_t hash;
+  bool added = fixed_traces_->Add(&trace, 1, weight, &hash);
+  SampleTimeline *timeline = timeline_.load(std::memory_order_acquire);
+  if (timeline != nullptr) {
+    // clock_gettime is async-signal-safe.
+    timeline->Append(TimeSpecToNanos(DefaultClock()->Now()), tid,
+                     added ? hash : 0);
+  }
+  if (!added) {
     unknown_stack_count_++;
+    if (weight != 0) {
+      unknown_stack_weight_.fetch_add(weight, std::memory_order_relaxed);
+    }
     return;
   }
 }
@@ -165,65 +568,104 @@ void GetFuncLoc(PyCodeObject *code_object, FuncLoc *func_loc) {
   const char *filename = PyUnicode_AsUTF8(code_object->co_filename);
   func_loc->name = name != nullptr ? name : "unknown";
   func_loc->filename = filename != nullptr ? filename : "unknown";
+  func_loc->has_linetable = false;
 }
 
 // Should be called when GIL is held if PyCode_Type.tp_dealloc is modified,
 // otherwise PyCode_Type.tp_dealloc may be updating
 // CodeDeallocHook.deallocated_code_ in another thread.
 void Profiler::Reset() {
-  if (fixed_traces_ == nullptr) {
-    fixed_traces_ = new AsyncSafeTraceMultiset();
+  if (fixed_traces_ == nullptr || fixed_traces_->MaxEntries() != max_traces_ ||
+      fixed_traces_->MaxArenaFrames() != max_arena_frames_) {
+    // A table of a different size is intentionally leaked, as a late signal
+    // may still be using it. The size only changes when the configuration
+    // does, so this happens at most a few times.
+    fixed_traces_ = new ShardedTraceMultiset(max_traces_, max_arena_frames_);
   } else {
     fixed_traces_->Reset();
   }
   CodeDeallocHook::Reset();
   unknown_stack_count_ = 0;
+  unknown_stack_weight_ = 0;
+  stats_.Reset();
+  ClearLabelledThreads();
+  thread_labels_.store(thread_labels_requested_, std::memory_order_relaxed);
+  timeline_.store(nullptr, std::memory_order_release);
+  if (timeline_capacity_ > 0) {
+    if (timeline_storage_ == nullptr ||
+        timeline_storage_->MaxCapacity() < timeline_capacity_) {
+      // A smaller timeline is leaked, as for fixed_traces_. The largest one
+      // is kept and reused for smaller capacities, and capacities are capped
+      // at SampleTimeline::kMaxCapacity, so this happens a few times at
+      // most.
+      timeline_storage_ = new SampleTimeline(timeline_capacity_);
+    }
+    timeline_storage_->Reset(timeline_capacity_);
+    struct timespec realtime;
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    timeline_realtime_offset_nanos_ =
+        TimeSpecToNanos(realtime) - TimeSpecToNanos(DefaultClock()->Now());
+    timeline_.store(timeline_storage_, std::memory_order_release);
+  }
   handler_.SetAction(&Profiler::Handle);
 }
 
+void Profiler::AddUnknownTraces() {
+  int unknown_stack_count = unknown_stack_count_.exchange(0);
+  int64_t unknown_stack_weight = unknown_stack_weight_.exchange(0);
+  if (unknown_stack_count > 0) {
+    TraceTableStats stats = fixed_traces_->Stats();
+    LogWarning(
+        "%d samples were dropped: %lld found the trace table full, %lld found "
+        "the frame arena full",
+        unknown_stack_count,
+        static_cast<long long>(stats.table_full_count),  // NOLINT
+        static_cast<long long>(stats.arena_full_count));  // NOLINT
+    CallFrame fakeFrame = {kUnknown, 0, nullptr};
+    // The weight goes to the second value, as for harvested traces, so that
+    // the dropped samples keep the CPU time they represent.
+    size_t node = aggregated_traces_.Insert(1, &fakeFrame);
+    aggregated_traces_.AddValue(node, 0, unknown_stack_count);
+    aggregated_traces_.AddValue(node, 1, unknown_stack_weight);
+  }
+}
+
 // Must be called when GIL is held.
 PyObject *Profiler::PythonTraces() {
   // Asserts that GIL is held in debug mode.
   assert(PyGILState_Check());
-  if (unknown_stack_count_ > 0) {
-    CallFrame fakeFrame = {kUnknown, nullptr};
-    aggregated_traces_.Add(1, &fakeFrame, unknown_stack_count_);
-  }
+  struct timespec start = DefaultClock()->Now();
+  AddUnknownTraces();
 
   PyObjectRef py_traces(PyDict_New());
   if (py_traces == nullptr) {
     return nullptr;
   }
-  for (const auto &trace : aggregated_traces_) {
-    PyObjectRef py_frames(PyTuple_New(trace.first.size()));
+  SymbolizeNodes(aggregated_traces_.NumNodes());
+  std::vector<uint32_t> trace;
+  for (size_t node = 0; node < aggregated_traces_.NumNodes(); node++) {
+    if (aggregated_traces_.Count(node) == 0) {
+      continue;
+    }
+    trace.clear();
+    for (size_t n = node; n != CallingContextTree::kRoot;
+         n = aggregated_traces_.Parent(n)) {
+      // Traces are not labelled, so the traces of all threads and label sets
+      // are merged.
+      if (!IsLabelNode(n)) {
+        trace.push_back(n);
+      }
+    }
+    PyObjectRef py_frames(PyTuple_New(trace.size()));
     if (py_frames == nullptr) {
       return nullptr;
     }
 
-    for (size_t i = 0; i < trace.first.size(); i++) {
-      const auto &frame = trace.first[i];
-      FuncLoc func_loc;
-      PyCodeObject *pointer = frame.py_code;
-      if (pointer == nullptr) {
-        func_loc = {
-            CallTraceErrorToName(static_cast<CallTraceErrors>(frame.lineno)),
-            ""};
-      } else {
-        // All PyCodeObjects deallocated during profiling should be recorded
-        // by CodeDeallocHook. As we are holding GIL, no deallocation can happen
-        // elsewhere now. It's safe to assume that a PyCodeObject pointer not
-        // recorded by CodeDeallocHook points to a live object.
-        // TODO: If multiple code objects are allocated at the same
-        // address, the func_loc stored by CodeDeallocHook may not belong to the
-        // sampled frame. At least we should mark the func_loc as invalid if we
-        // see an address is reused, probably by hooking PyCode_Type.tp_alloc.
-        if (!CodeDeallocHook::Find(pointer, &func_loc)) {
-          GetFuncLoc(pointer, &func_loc);
-        }
-      }
+    for (size_t i = 0; i < trace.size(); i++) {
+      const SymbolTable::Symbol &symbol = node_symbols_[trace[i]];
       PyObject *py_frame =
-          Py_BuildValue("(ssi)", func_loc.name.c_str(),
-                        func_loc.filename.c_str(), frame.lineno);
+          Py_BuildValue("(ssi)", symbols_->String(symbol.name).c_str(),
+                        symbols_->String(symbol.filename).c_str(), symbol.line);
       if (py_frame == nullptr) {
         return nullptr;
       }
@@ -235,7 +677,7 @@ PyObject *Profiler::PythonTraces() {
       // py_frames is deallocated.
       PyTuple_SET_ITEM(py_frames.get(), i, py_frame);
     }
-    uint64_t count = trace.second;
+    uint64_t count = aggregated_traces_.Count(node);
     PyObject *py_count = PyDict_GetItem(py_traces.get(), py_frames.get());
     if (py_count != nullptr) {
       uint64_t previous_count = PyLong_AsUnsignedLong(py_count);
@@ -254,9 +696,122 @@ PyObject *Profiler::PythonTraces() {
     }
   }
 
+  SaveTimeline();
+  SaveStats(start);
   return py_traces.release();
 }
 
+// Must be called when GIL is held.
+PyObject *Profiler::SerializedProfile(const char *profile_type) {
+  // Asserts that GIL is held in debug mode.
+  assert(PyGILState_Check());
+  struct timespec start = DefaultClock()->Now();
+  AddUnknownTraces();
+
+  ProfileBuilder builder;
+  builder.SetDurationNanos(duration_nanos_);
+  SetUpProfile(profile_type, &builder);
+
+  // Frames are resolved by the symbol table, mostly while collecting. The
+  // location of each node of the tree is looked up once, no matter how many
+  // traces go through it. As a node's parent always has a lower index,
+  // visiting nodes in index order resolves parents first.
+  SymbolizeNodes(aggregated_traces_.NumNodes());
+  // Maps the string IDs of a function name and filename to the function ID.
+  std::unordered_map<uint64_t, uint64_t> function_ids;
+  std::vector<uint64_t> node_location_ids(aggregated_traces_.NumNodes());
+  std::vector<uint64_t> location_ids;
+  std::vector<int64_t> values;
+  std::vector<ProfileBuilder::Label> labels;
+  for (size_t node = 1; node < aggregated_traces_.NumNodes(); node++) {
+    if (!IsLabelNode(node)) {
+      const SymbolTable::Symbol &symbol = node_symbols_[node];
+      uint64_t function_key =
+          static_cast<uint64_t>(symbol.name) << 32 | symbol.filename;
+      auto known_function = function_ids.find(function_key);
+      if (known_function == function_ids.end()) {
+        uint64_t function_id =
+            builder.FunctionId(symbols_->String(symbol.name),
+                               symbols_->String(symbol.filename));
+        known_function = function_ids.emplace(function_key, function_id).first;
+      }
+      node_location_ids[node] =
+          builder.LocationId(known_function->second, symbol.line);
+    }
+
+    if (!aggregated_traces_.HasValues(node)) {
+      continue;
+    }
+    location_ids.clear();
+    labels.clear();
+    for (size_t n = node; n != CallingContextTree::kRoot;
+         n = aggregated_traces_.Parent(n)) {
+      if (IsLabelNode(n)) {
+        AddNodeLabels(n, &labels);
+      } else {
+        location_ids.push_back(node_location_ids[n]);
+      }
+    }
+    SampleValues(node, &values);
+    builder.AddSample(location_ids, values, labels);
+  }
+
+  SaveTimeline();
+  // The statistics are added as comments, e.g. "profiler.signals=1000".
+  SaveStats(start);
+  for (const auto &value : last_stats_.Values()) {
+    builder.AddComment("profiler." + value.first + "=" +
+                       std::to_string(value.second));
+  }
+  builder.AddComment("profiler.handler_latency_buckets=" +
+                     last_stats_.LatencyBuckets());
+
+  std::string serialized;
+  // Encoding doesn't touch Python objects, so user threads can run meanwhile.
+  Py_BEGIN_ALLOW_THREADS;
+  serialized = builder.Serialize();
+  Py_END_ALLOW_THREADS;
+  return GzipCompress(serialized);
+}
+
+void Profiler::AddNodeLabels(size_t node,
+                             std::vector<ProfileBuilder::Label> *labels) const {
+  const SymbolTable::Symbol &symbol = node_symbols_[node];
+  if (aggregated_traces_.Frame(node).lineno == kLabelSetFrame) {
+    for (const auto &label : SampleLabels::Labels(symbol.line)) {
+      labels->emplace_back();
+      labels->back().key = label.first;
+      labels->back().str = label.second;
+    }
+    return;
+  }
+  // The samples of the threads which weren't labelled have a thread frame
+  // with no thread ID.
+  if (symbol.line == 0) {
+    return;
+  }
+  labels->emplace_back();
+  labels->back().key = "thread_id";
+  labels->back().num = symbol.line;
+  const std::string &name = symbols_->String(symbol.name);
+  if (!name.empty()) {
+    labels->emplace_back();
+    labels->back().key = "thread_name";
+    labels->back().str = name;
+  }
+}
+
+void Profiler::SetUpProfile(const char *profile_type, ProfileBuilder *builder) {
+  builder->SetPeriod(profile_type, "nanoseconds", period_nanos_);
+  builder->AddSampleType("sample", "count");
+  builder->AddSampleType(profile_type, "nanoseconds");
+}
+
+void Profiler::SampleValues(size_t node, std::vector<int64_t> *values) {
+  int64_t count = aggregated_traces_.Count(node);
+  values->assign({count, count * period_nanos_});
+}
+
 bool AlmostThere(const struct timespec &finish, const struct timespec &lap) {
   // Determine if there is time for another lap before reaching the
   // finish line. Have a margin of multiple laps to ensure we do not
@@ -269,16 +824,199 @@ bool AlmostThere(const struct timespec &finish, const struct timespec &lap) {
   return TimeLessThan(finish, TimeAdd(now, laps));
 }
 
-PyObject *CPUProfiler::Collect() {
-  Reset();
-  // Hooks to PyCode_Type.tp_dealloc so that a PyCodeObject is recorded before
-  // being deallocated. The hook is cancelled when dealloc_hook goes out of
-  // scope.
-  CodeDeallocHook dealloc_hook;
+bool Profiler::StartCollecting() {
+  if (collecting_.exchange(true)) {
+    PyErr_SetString(PyExc_RuntimeError,
+                    "another profile is being collected");
+    return false;
+  }
+  return true;
+}
 
-  if (!Start()) {
+void Profiler::ClearTraces() {
+  // The threads labelled are counted again, as the traces are cleared.
+  ClearLabelledThreads();
+  aggregated_traces_.Clear();
+  node_symbols_.clear();
+  if (symbols_ != nullptr) {
+    symbols_->EndCollection();
+  }
+  CodeDeallocHook::Reset();
+}
+
+PyObject *Profiler::Collect() {
+  if (!StartCollecting()) {
+    return nullptr;
+  }
+  PyObject *traces = nullptr;
+  {
+    // Hooks to PyCode_Type.tp_dealloc so that a PyCodeObject is recorded
+    // before being deallocated. The hook is cancelled when dealloc_hook goes
+    // out of scope.
+    CodeDeallocHook dealloc_hook;
+
+    if (CollectTraces()) {
+      traces = PythonTraces();
+    }
+  }
+  // The symbol table is only created once traces are symbolized.
+  if (symbols_ != nullptr) {
+    symbols_->EndCollection();
+  }
+  StopCollecting();
+  return traces;
+}
+
+PyObject *Profiler::CollectProfile() {
+  if (!StartCollecting()) {
     return nullptr;
   }
+  PyObject *profile = nullptr;
+  {
+    // See Collect() for why the hook must be in scope until the traces are
+    // symbolized.
+    CodeDeallocHook dealloc_hook;
+
+    if (CollectTraces()) {
+      profile = SerializedProfile(ProfileType());
+    }
+  }
+  // The symbol table is only created once traces are symbolized.
+  if (symbols_ != nullptr) {
+    symbols_->EndCollection();
+  }
+  StopCollecting();
+  return profile;
+}
+
+void Profiler::SymbolizeNewNodes() {
+  // Small batches keep user threads from waiting on GIL for long.
+  const size_t kBatchSize = 256;
+  Clock *clock = DefaultClock();
+  size_t num_nodes = aggregated_traces_.NumNodes();
+  while (node_symbols_.size() < num_nodes) {
+    PyGILState_STATE gil_state = PyGILState_Ensure();
+    struct timespec start = clock->Now();
+    SymbolizeNodes(std::min(node_symbols_.size() + kBatchSize, num_nodes));
+    stats_.RecordSymbolizeGil(TimeSpecToNanos(clock->Now()) -
+                              TimeSpecToNanos(start));
+    PyGILState_Release(gil_state);
+  }
+}
+
+int Profiler::Flush() {
+  Clock *clock = DefaultClock();
+  struct timespec start = clock->Now();
+  int count = HarvestSamples(fixed_traces_, &aggregated_traces_);
+  stats_.RecordFlush(TimeSpecToNanos(clock->Now()) - TimeSpecToNanos(start));
+  return count;
+}
+
+void Profiler::SaveStats(const struct timespec &start) {
+  stats_.RecordFinalGil(TimeSpecToNanos(DefaultClock()->Now()) -
+                        TimeSpecToNanos(start));
+  last_stats_ = stats_.Take(TableStats());
+}
+
+void Profiler::SaveTimeline() {
+  SampleTimeline *timeline =
+      timeline_.exchange(nullptr, std::memory_order_acq_rel);
+  if (timeline == nullptr) {
+    return;
+  }
+  std::vector<SampleTimeline::Record> records;
+  std::unique_ptr<ResolvedTimeline> resolved(new ResolvedTimeline);
+  resolved->dropped_records = timeline->Read(&records);
+
+  // Maps the hash of each trace to the node of its leaf frame.
+  std::unordered_map<uint64_t, size_t> trace_nodes;
+  std::vector<CallFrame> frames;
+  for (size_t node = 0; node < aggregated_traces_.NumNodes(); node++) {
+    if (aggregated_traces_.Count(node) > 0) {
+      aggregated_traces_.Trace(node, &frames);
+      trace_nodes.emplace(CalculateHash(frames.size(), frames.data()), node);
+    }
+  }
+
+  // Frames are added as records refer to them, callers first. node_frames
+  // maps a node to its frame index plus one, or 0 if not added yet.
+  std::vector<uint32_t> node_frames(aggregated_traces_.NumNodes(), 0);
+  // Maps the string IDs of a function name and filename to the function
+  // index.
+  std::unordered_map<uint64_t, uint32_t> function_indexes;
+  std::vector<size_t> nodes;
+  uint32_t unknown_frame = 0;
+  for (const SampleTimeline::Record &record : records) {
+    uint32_t frame = 0;
+    auto trace_node = trace_nodes.find(record.trace_hash);
+    if (record.trace_hash == 0 || trace_node == trace_nodes.end()) {
+      // The trace was dropped.
+      if (unknown_frame == 0) {
+        resolved->functions.emplace_back(CallTraceErrorToName(kUnknown), "");
+        resolved->frames.push_back(
+            {0, static_cast<uint32_t>(resolved->functions.size() - 1), 0});
+        unknown_frame = resolved->frames.size();
+      }
+      frame = unknown_frame;
+    } else if (trace_node->second != CallingContextTree::kRoot) {
+      nodes.clear();
+      // The thread of a record is known, its thread frame is left out.
+      for (size_t n = trace_node->second; n != CallingContextTree::kRoot &&
+                                          node_frames[n] == 0 &&
+                                          !IsLabelNode(n);
+           n = aggregated_traces_.Parent(n)) {
+        nodes.push_back(n);
+      }
+      for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+        const SymbolTable::Symbol &symbol = node_symbols_[*it];
+        uint64_t key =
+            static_cast<uint64_t>(symbol.name) << 32 | symbol.filename;
+        auto inserted =
+            function_indexes.emplace(key, resolved->functions.size());
+        if (inserted.second) {
+          resolved->functions.emplace_back(symbols_->String(symbol.name),
+                                           symbols_->String(symbol.filename));
+        }
+        resolved->frames.push_back(
+            {node_frames[aggregated_traces_.Parent(*it)],
+             inserted.first->second, symbol.line});
+        node_frames[*it] = resolved->frames.size();
+      }
+      frame = node_frames[trace_node->second];
+    }
+    resolved->records.push_back(
+        {record.timestamp_nanos + timeline_realtime_offset_nanos_, record.tid,
+         frame});
+  }
+  last_timeline_ = std::move(resolved);
+}
+
+void Profiler::SymbolizeNodes(size_t end) {
+  if (symbols_ == nullptr) {
+    symbols_ = new SymbolTable;
+  }
+  while (node_symbols_.size() < end) {
+    size_t node = node_symbols_.size();
+    node_symbols_.push_back(
+        node == CallingContextTree::kRoot
+            ? SymbolTable::Symbol()
+            : symbols_->Resolve(aggregated_traces_.Frame(node)));
+  }
+}
+
+bool CPUProfiler::CollectTraces() {
+  Reset();
+  if (native_frames_requested_ && !SetUpNativeUnwinding()) {
+    LogWarning(
+        "_PyEval_EvalFrameDefault not found, native frames will be shown "
+        "before all Python frames");
+  }
+  native_frames_.store(native_frames_requested_, std::memory_order_relaxed);
+  if (!Start()) {
+    native_frames_.store(false, std::memory_order_relaxed);
+    PyErr_SetString(PyExc_RuntimeError, "failed to start the CPU timer");
+    return false;
+  }
   // Releases GIL so that the user threads can execute.
   Py_BEGIN_ALLOW_THREADS;
 
@@ -288,35 +1026,225 @@ PyObject *CPUProfiler::Collect() {
   struct timespec finish_line =
       TimeAdd(clock->Now(), NanosToTimeSpec(duration_nanos_));
 
+  int64_t period_nanos = period_nanos_;
+  struct timespec interval_start = clock->Now();
+  int64_t overhead_nanos = 0;
+
   // Sleep until finish_line, but wakeup periodically to flush the
   // internal tables.
   while (!AlmostThere(finish_line, flush_interval)) {
     clock->SleepFor(flush_interval);
     Flush();
+    SymbolizeNewNodes();
+    int64_t next_period_nanos = period_nanos;
+    if (overhead_budget_ > 0) {
+      struct timespec now = clock->Now();
+      int64_t total_overhead_nanos = CurrentStats().OverheadNanos();
+      next_period_nanos = AdaptPeriod(
+          period_nanos, total_overhead_nanos - overhead_nanos,
+          TimeSpecToNanos(now) - TimeSpecToNanos(interval_start));
+      interval_start = now;
+      overhead_nanos = total_overhead_nanos;
+    }
+    // Per-thread timers are updated anyway, to sample the new threads.
+    if ((next_period_nanos != period_nanos || per_thread_timers_) &&
+        SetInterval(next_period_nanos)) {
+      period_nanos = next_period_nanos;
+    }
   }
   clock->SleepUntil(finish_line);
   Stop();
   // Delay to allow last signals to be processed.
   clock->SleepUntil(TimeAdd(finish_line, flush_interval));
-  Flush();
+  native_frames_.store(false, std::memory_order_relaxed);
+  FinalFlush();
   // Reacquire the GIL.
   Py_END_ALLOW_THREADS;
-
-  PyObject *traces = PythonTraces();
-  return traces;
+  return true;
 }
 
 bool CPUProfiler::Start() {
-  int period_usec = period_nanos_ / 1000;
-  return handler_.SetSigprofInterval(period_usec);
+  struct timespec cpu_time;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_time);
+  last_sample_cpu_nanos_.store(TimeSpecToNanos(cpu_time));
+  if (!SetInterval(period_nanos_)) {
+    if (per_thread_timers_) {
+      LogError("Failed to create per-thread CPU timers");
+    }
+    return false;
+  }
+  return true;
+}
+
+bool CPUProfiler::SetInterval(int64_t period_nanos) {
+  int64_t period_usec = period_nanos / 1000;
+  bool set = per_thread_timers_ ? thread_timers_.Update(period_usec)
+                                : handler_.SetSigprofInterval(period_usec);
+  if (set) {
+    // Samples taken from now on are taken at the new period, give or take
+    // the signals already pending.
+    sampling_period_nanos_.store(period_nanos, std::memory_order_relaxed);
+  }
+  return set;
+}
+
+void CPUProfiler::UpdateThreadTimers() {
+  if (per_thread_timers_) {
+    thread_timers_.Update(period_nanos_ / 1000);
+  }
+}
+
+int64_t CPUProfiler::AdaptPeriod(int64_t period_nanos, int64_t overhead_nanos,
+                                 int64_t elapsed_nanos) const {
+  if (elapsed_nanos <= 0) {
+    return period_nanos;
+  }
+  double overhead = static_cast<double>(overhead_nanos) / elapsed_nanos;
+  double scale = overhead / overhead_budget_;
+  scale = std::max(0.5, std::min(2.0, scale));
+  int64_t next_period_nanos = static_cast<int64_t>(period_nanos * scale);
+  return std::max(kMinAdaptivePeriodNanos,
+                  std::min(kMaxAdaptivePeriodNanos, next_period_nanos));
+}
+
+void CPUProfiler::SampleValues(size_t node, std::vector<int64_t> *values) {
+  // Profiler::Handle records samples with their CPU time as weight, which
+  // HarvestSamples() adds to the second value.
+  int64_t count = aggregated_traces_.Count(node);
+  values->assign({count, aggregated_traces_.Value(node, 1)});
 }
 
 void CPUProfiler::Stop() {
-  handler_.SetSigprofInterval(0);
+  if (per_thread_timers_) {
+    thread_timers_.Stop();
+  } else {
+    handler_.SetSigprofInterval(0);
+  }
   // Breaks encapsulation, but whatever.
   signal(SIGPROF, SIG_IGN);
 }
 
+void WallProfiler::Handle(int signum, siginfo_t *info, void *context) {
+  // Gets around -Wunused-parameter.
+  (void)signum;
+  (void)info;
+
+  ErrnoRaii err_storage;  // stores and resets errno
+  struct timespec start = DefaultClock()->Now();
+
+  // See Profiler::Handle for the caveats of get_thread_state_func.
+  PyThreadState *ts = get_thread_state_func();
+  // Every thread of the process is signaled, but only Python threads are of
+  // interest.
+  if (ts != nullptr) {
+    int64_t weight = 0;
+    if (HoldsGil(ts)) {
+      weight = kGilHeldWeight;
+    } else if (WaitsForGil(context)) {
+      weight = kGilWaitWeight;
+    }
+    RecordTrace(ts, weight);
+  }
+  RecordHandler(start);
+}
+
+bool WallProfiler::CollectTraces() {
+  Reset();
+  SetUpGilWait();
+  handler_.SetAction(&WallProfiler::Handle);
+  UpdateThreads();
+  // Releases GIL so that the user threads can execute.
+  Py_BEGIN_ALLOW_THREADS;
+
+  Clock *clock = DefaultClock();
+  struct timespec period = NanosToTimeSpec(period_nanos_);
+  // Flush the async table and look for new threads every 100 ms.
+  struct timespec flush_interval = {0, 100 * 1000 * 1000};  // 100 millisec
+  struct timespec now = clock->Now();
+  struct timespec finish_line = TimeAdd(now, NanosToTimeSpec(duration_nanos_));
+  struct timespec next_flush = TimeAdd(now, flush_interval);
+  struct timespec next_sample = TimeAdd(now, period);
+
+  while (TimeLessThan(next_sample, finish_line)) {
+    clock->SleepUntil(next_sample);
+    SignalThreads();
+    now = clock->Now();
+    if (!TimeLessThan(now, next_flush)) {
+      Flush();
+      SymbolizeNewNodes();
+      UpdateThreads();
+      next_flush = TimeAdd(now, flush_interval);
+    }
+    next_sample = TimeAdd(next_sample, period);
+    // Skips the ticks missed when this thread wasn't scheduled in time,
+    // rather than sending a burst of signals to catch up.
+    if (TimeLessThan(next_sample, now)) {
+      next_sample = TimeAdd(now, period);
+    }
+  }
+  clock->SleepUntil(finish_line);
+  Stop();
+  // Delay to allow last signals to be processed.
+  clock->SleepUntil(TimeAdd(finish_line, flush_interval));
+  native_frames_.store(false, std::memory_order_relaxed);
+  FinalFlush();
+  // Reacquire the GIL.
+  Py_END_ALLOW_THREADS;
+  return true;
+}
+
+void ContentionProfiler::SetUpProfile(const char *profile_type,
+                                      ProfileBuilder *builder) {
+  (void)profile_type;
+  builder->SetPeriod("wall", "nanoseconds", period_nanos_);
+  builder->AddSampleType("sample", "count");
+  builder->AddSampleType("gil_held", "nanoseconds");
+  builder->AddSampleType("gil_wait", "nanoseconds");
+  builder->AddSampleType("gil_released", "nanoseconds");
+}
+
+void ContentionProfiler::SampleValues(size_t node,
+                                      std::vector<int64_t> *values) {
+  // HarvestSamples() adds the weights of the samples, see
+  // WallProfiler::Handle, to the second value.
+  int64_t count = aggregated_traces_.Count(node);
+  int64_t weights = aggregated_traces_.Value(node, 1);
+  int64_t held = weights % kGilWaitWeight;
+  int64_t waiting = weights / kGilWaitWeight;
+  values->assign({count, held * period_nanos_, waiting * period_nanos_,
+                  (count - held - waiting) * period_nanos_});
+}
+
+void WallProfiler::UpdateThreads() {
+  ListThreads(&threads_);
+  pid_t self = syscall(SYS_gettid);
+  for (auto it = threads_.begin(); it != threads_.end(); ++it) {
+    if (*it == self) {
+      threads_.erase(it);
+      break;
+    }
+  }
+}
+
+void WallProfiler::SignalThreads() {
+  pid_t pid = getpid();
+  for (pid_t tid : threads_) {
+    // tgkill, unlike pthread_kill, is safe to call with the ID of a thread
+    // which has exited. It fails with ESRCH in that case, which is ignored.
+    syscall(SYS_tgkill, pid, tid, SIGPROF);
+  }
+}
+
+void WallProfiler::Stop() {
+  // Ignores the signals which are still pending.
+  signal(SIGPROF, SIG_IGN);
+}
+
+void Profiler::AfterForkInChild() {
+  UnblockSigprof();
+  collecting_.store(false);
+}
+
 // Blocks the SIGPROF signal for the calling thread.
 void BlockSigprof() {
   sigset_t signals;
@@ -332,3 +1260,19 @@ void UnblockSigprof() {
   sigaddset(&signals, SIGPROF);
   pthread_sigmask(SIG_UNBLOCK, &signals, nullptr);
 }
+
+void ListThreads(std::vector<pid_t> *threads) {
+  threads->clear();
+  DIR *tasks = opendir("/proc/self/task");
+  if (tasks == nullptr) {
+    return;
+  }
+  struct dirent *task;
+  while ((task = readdir(tasks)) != nullptr) {
+    pid_t tid = atoi(task->d_name);
+    if (tid > 0) {
+      threads->push_back(tid);
+    }
+  }
+  closedir(tasks);
+}
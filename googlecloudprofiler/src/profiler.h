@@ -16,18 +16,34 @@
 #define GOOGLECLOUDPROFILER_SRC_PROFILER_H_
 
 #include <Python.h>
+#include <pthread.h>
 #include <signal.h>
+#include <sys/types.h>
+#include <time.h>
 
 #include <atomic>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
+#include "profiler_stats.h"
 #include "stacktraces.h"
+#include "string_arena.h"
+#include "symbol_table.h"
+#include "timeline.h"
+
+class ProfileBuilder;
 
 struct FuncLoc {
   std::string name;
   std::string filename;
+  // Whether linetable and firstlineno hold copies of the code object's, which
+  // is only the case when the code object was deallocated. See GetLineTable.
+  bool has_linetable;
+  std::string linetable;
+  int firstlineno;
 };
 
 void GetFuncLoc(PyCodeObject *code_object, FuncLoc *func_loc);
@@ -38,6 +54,10 @@ void BlockSigprof();
 // Unblocks the SIGPROF signal for the calling thread.
 void UnblockSigprof();
 
+// Replaces the content of threads with the kernel thread IDs of all threads of
+// this process, as listed in /proc/self/task.
+void ListThreads(std::vector<pid_t> *threads);
+
 class SignalHandler {
  public:
   SignalHandler() {}
@@ -51,6 +71,70 @@ class SignalHandler {
   bool SetSigprofInterval(int64_t period_usec);
 };
 
+// ThreadCPUTimers maintains one POSIX timer per thread of the process. Each
+// timer measures the CPU time of its own thread, like CLOCK_THREAD_CPUTIME_ID
+// does for the calling thread, and delivers SIGPROF to that thread only.
+// ITIMER_PROF is a single process-wide timer, and the kernel picks the thread
+// which receives the signal; with many busy threads, signals get coalesced and
+// dropped. With a timer per thread, the number of samples scales with the
+// number of busy threads.
+//
+// The kernel only checks CPU timers at each scheduler tick, so they can't fire
+// more often than CONFIG_HZ, 250 times per second on most kernels. In
+// high-resolution mode, the timers measure wall time on CLOCK_MONOTONIC
+// instead, which is backed by high-resolution timers and supports periods
+// well below a millisecond. Each sample then carries the CPU time its thread
+// used since the previous sample, see Profiler::SampleWeight(), and threads
+// which didn't run are not sampled. The signals still interrupt idle threads,
+// so this mode costs more with many threads and is meant for short captures.
+class ThreadCPUTimers {
+ public:
+  explicit ThreadCPUTimers(bool high_resolution = false)
+      : high_resolution_(high_resolution) {}
+  // Not copyable or assignable.
+  ThreadCPUTimers(const ThreadCPUTimers &) = delete;
+  ThreadCPUTimers &operator=(const ThreadCPUTimers &) = delete;
+
+  ~ThreadCPUTimers() { Stop(); }
+
+  // Creates timers firing every period_usec of thread CPU time for threads
+  // which started since the last call, and deletes the timers of threads
+  // which exited. The timers of the other threads are reset if period_usec
+  // changed. Threads which start between two calls are not sampled until the
+  // next call. Returns false if no thread has a timer.
+  bool Update(int64_t period_usec);
+
+  // Deletes all timers.
+  void Stop();
+
+ private:
+  bool high_resolution_;
+  // Maps a kernel thread ID to the timer created for that thread.
+  std::unordered_map<pid_t, timer_t> timers_;
+  // In high-resolution mode, the CPU time of each thread at its last sample,
+  // in nanoseconds, which the signal handler gets as si_value. They are only
+  // freed with this object, so that a late signal never sees a freed one.
+  std::vector<std::unique_ptr<std::atomic<int64_t>>> last_cpu_nanos_;
+  // Period the timers are set to.
+  int64_t period_usec_ = 0;
+};
+
+// CodeDeallocHook keeps what is needed to resolve the frames of code objects
+// which are sampled, then deallocated before the end of the collection.
+//
+// Code objects are registered as sampled by the signal handler, see
+// MarkSampled(). Deallocating a code object which wasn't sampled records
+// nothing, and the name, filename and line table of one which was are copied
+// into a string arena, so the deallocation path doesn't allocate memory
+// except when a new arena chunk is needed.
+//
+// A sampled code object is also given a generation, stored in the frames
+// which refer to it. The generation of an address is incremented when the
+// code object at that address is deallocated, so that the frames of a code
+// object later allocated at the same address are not attributed to the
+// deallocated one. Generations keep increasing across calls to Reset(), which
+// forgets the code objects sampled and deallocated so far, so that the frames
+// sampled before the last call are told apart, see IsCurrent().
 class CodeDeallocHook {
  public:
   // The constructor must be called when GIL is held.
@@ -67,27 +151,88 @@ class CodeDeallocHook {
   ~CodeDeallocHook() { PyCode_Type.tp_dealloc = old_code_dealloc_; }
 
   // A wrapper function on PyCode_Type.tp_dealloc that records the code object
-  // to deallocated_code_ before the actual deallocation.
+  // if it was sampled, before the actual deallocation.
   static void CodeDealloc(PyObject *py_object);
 
-  // The first call to Reset() allocates deallocated_code_. Subsequent calls
-  // clear deallocated_code_. When PyCode_Type.tp_dealloc points to CodeDealloc,
-  // this function must be called when GIL is held, otherwise another thread
-  // may be updating allocated_code_ during PyCodeObject deallocation.
+  // Registers a code object as sampled, and returns its current generation.
+  // If there is no room left to register it, every deallocated code object is
+  // recorded from then on, address reuse is not detected, and the first
+  // generation of the table is returned. Returns 0 if the table is being reset
+  // concurrently. It is async-safe.
+  static int MarkSampled(PyCodeObject *code);
+
+  // The first call to Reset() allocates the tables. Subsequent calls clear
+  // them. When PyCode_Type.tp_dealloc points to CodeDealloc, this function
+  // must be called when GIL is held, otherwise another thread may be updating
+  // the tables during PyCodeObject deallocation.
   static void Reset();
 
-  // If the given pointer exists in deallocated_code_ as key, assign the value
-  // to func_loc and return true, otherwise return false. When
-  // PyCode_Type.tp_dealloc points to CodeDealloc, this function must be called
-  // when GIL is held, otherwise another thread may be updating
-  // allocated_code_ during PyCodeObject deallocation.
-  static bool Find(PyCodeObject *pointer, FuncLoc *func_loc);
+  // If the code object of the given pointer and generation was deallocated,
+  // assign its information to func_loc and return true, otherwise return
+  // false. When PyCode_Type.tp_dealloc points to CodeDealloc, this function
+  // must be called when GIL is held, otherwise another thread may be updating
+  // the tables during PyCodeObject deallocation.
+  static bool Find(PyCodeObject *pointer, int generation, FuncLoc *func_loc);
+
+  // Returns whether a frame of the given generation was sampled since the
+  // last call to Reset(), in which case its code object is either live or
+  // found by Find(). The code object of another frame may have been
+  // deallocated without being recorded, so it must not be dereferenced. Must
+  // be called when GIL is held.
+  static bool IsCurrent(int generation) {
+    return generation >= first_generation_.load();
+  }
 
  private:
-  // When PyCode_Type.tp_dealloc points to CodeDealloc, a code object is
-  // recorded in this map before being deallocated. The map maps a code object
-  // pointer to function information of interest.
-  static std::unordered_map<PyCodeObject *, FuncLoc> *deallocated_code_;
+  // Maximum number of distinct code objects registered by MarkSampled()
+  // between two calls to Reset(). Must be a power of 2.
+  static const int64_t kMaxSampledCode = 1 << 14;
+
+  // Entry of the table of sampled code objects, which is an open addressing
+  // hash table keyed by the code object pointer.
+  struct SampledCode {
+    std::atomic<PyCodeObject *> code;
+    std::atomic<int> generation;
+  };
+
+  struct DeallocatedCode {
+    PyCodeObject *code;
+    int generation;
+    ArenaString name;
+    ArenaString filename;
+    ArenaString linetable;
+    int firstlineno;
+  };
+
+  struct DeallocatedCodeKeyHash {
+    std::size_t operator()(const std::pair<PyCodeObject *, int> &key) const {
+      return std::hash<PyCodeObject *>()(key.first) * 31 + key.second;
+    }
+  };
+
+  // If code was sampled, returns true and assigns its generation, and moves
+  // the address to the next generation. Must be called when GIL is held.
+  static bool TakeGeneration(PyCodeObject *code, int *generation);
+
+  // Table of kMaxSampledCode entries, allocated on the first Reset().
+  static SampledCode *sampled_code_;
+  // Set when MarkSampled() couldn't register a code object.
+  static std::atomic<bool> sampled_code_full_;
+  // Generation of the code objects which couldn't be registered since the
+  // last call to Reset(). Registered ones start at the next generation, and
+  // all of them are above the generations given before the call.
+  static std::atomic<int> first_generation_;
+
+  // Code objects recorded by CodeDealloc, in deallocation order. Their
+  // strings are kept in strings_.
+  static std::vector<DeallocatedCode> *deallocated_code_;
+  static StringArena *strings_;
+  // Maps a pointer and generation to an index in deallocated_code_. Built
+  // by Find(), rather than by CodeDealloc, to keep deallocation cheap.
+  static std::unordered_map<std::pair<PyCodeObject *, int>, size_t,
+                            DeallocatedCodeKeyHash> *deallocated_code_index_;
+  // Number of entries of deallocated_code_ added to deallocated_code_index_.
+  static size_t deallocated_code_indexed_;
 
   static destructor old_code_dealloc_;
 };
@@ -100,9 +245,35 @@ extern GetThreadStateFunc get_thread_state_func;
 
 class Profiler {
  public:
-  Profiler(int64_t duration_nanos, int64_t period_nanos)
-      : duration_nanos_(duration_nanos), period_nanos_(period_nanos) {
-    Reset();
+  // max_traces and max_arena_frames size the fixed table which samples are
+  // recorded into, see AsyncSafeTraceMultiset.
+  Profiler(int64_t duration_nanos, int64_t period_nanos,
+           int64_t max_traces = AsyncSafeTraceMultiset::kDefaultMaxEntries,
+           int64_t max_arena_frames =
+               AsyncSafeTraceMultiset::kDefaultMaxArenaFrames)
+      : duration_nanos_(duration_nanos),
+        period_nanos_(period_nanos),
+        max_traces_(max_traces),
+        max_arena_frames_(max_arena_frames) {
+    // When a fork runs longer than the signal interval, it gets interrupted by
+    // the signal and then retry. This will never end until the profiler
+    // thread stops sending the signal. In unlucky cases, the profiler
+    // thread gets blocked on acquiring the memory lock, which is held by
+    // fork. The process may thus hang unpredictably long.
+    // The fix is to block the signal for the calling thread before fork and
+    // reenable it after fork. The caveat is that forks will not be sampled.
+    if (!fork_handlers_registered_) {
+      pthread_atfork(&BlockSigprof, &UnblockSigprof, &AfterForkInChild);
+      // Updating fork_handlers_registered_ here is not thread safe. It's
+      // fine because profilers are only created by the profiler polling
+      // thread, one at a time.
+      fork_handlers_registered_ = true;
+    }
+    // Resetting would disrupt the collection in progress, if any, which then
+    // makes this profiler's collection fail.
+    if (!collecting_.load()) {
+      Reset();
+    }
   }
   // Not copyable or assignable.
   Profiler(const Profiler &) = delete;
@@ -110,14 +281,27 @@ class Profiler {
 
   virtual ~Profiler() {}
 
-  // Collects performance data.
-  // Implicitly does a Reset() before starting collection.
-  virtual PyObject *Collect() = 0;
+  // Collects performance data and returns it as a Python dictionary object,
+  // see PythonTraces().
+  // Implicitly does a Reset() before starting collection. Returns nullptr
+  // with a Python exception set if another collection is in progress.
+  PyObject *Collect();
+
+  // Collects performance data and returns it as a gzip-compressed profile
+  // proto in a Python bytes object.
+  // Implicitly does a Reset() before starting collection. Returns nullptr
+  // with a Python exception set if another collection is in progress.
+  PyObject *CollectProfile();
 
   // Returns the traces as a Python dictionary object, which maps a trace to its
   // count.
   PyObject *PythonTraces();
 
+  // Returns the traces as a gzip-compressed profile proto of the given profile
+  // type in a Python bytes object. The proto is encoded natively, and
+  // function, location and string tables are interned while encoding.
+  PyObject *SerializedProfile(const char *profile_type);
+
   // Signal handler, which records the current stack trace.
   static void Handle(int signum, siginfo_t *info, void *context);
 
@@ -126,63 +310,394 @@ class Profiler {
 
   // Migrates data from fixed internal table into growable data structure.
   // Returns number of entries extracted.
-  int Flush() { return HarvestSamples(fixed_traces_, &aggregated_traces_); }
+  int Flush();
+
+  // Migrates the data left in the fixed internal tables at the end of a
+  // collection. Returns number of entries extracted.
+  int FinalFlush() { return Flush() + Flush(); }
+
+  // Resolves the frames of the nodes added to the aggregated tree since the
+  // last call. Must be called when GIL is not held, as it acquires GIL for
+  // small batches of nodes, so that most of the symbolization happens while
+  // collecting rather than in one GIL-held burst at the end.
+  void SymbolizeNewNodes();
+
+  // Returns the statistics of the last collection, as of the end of
+  // PythonTraces() or SerializedProfile().
+  static const ProfilerStats::Snapshot &LastStats() { return last_stats_; }
+
+  // Makes the next collections record the time, thread and trace of each
+  // sample in a SampleTimeline of the given capacity, on top of aggregating
+  // the traces. The timeline is resolved at the end of PythonTraces() or
+  // SerializedProfile(), see LastTimeline(). Must be called before the
+  // collection starts.
+  void EnableTimeline(int64_t capacity) { timeline_capacity_ = capacity; }
+
+  // Returns the timeline of the last collection which recorded one, or
+  // nullptr if none did. Must be called when GIL is held.
+  static const ResolvedTimeline *LastTimeline() { return last_timeline_.get(); }
+
+  // Maximum number of distinct threads labelled by a collection, see
+  // EnableThreadLabels().
+  static const int kMaxLabelledThreads = 256;
+
+  // Makes the next collections record which thread each sample was taken
+  // on, as a thread frame at the root of its trace, see kThreadFrame. The
+  // traces of different threads are then kept apart, and their samples are
+  // labelled with the "thread_id" and "thread_name" of the thread. When
+  // disabled, which is the default, the samples of all threads are merged.
+  //
+  // Only the first kMaxLabelledThreads threads sampled are labelled, the
+  // samples of the others are merged, unlabelled. This bounds the number of
+  // traces added by thread labels when threads come and go. Must be called
+  // before the collection starts.
+  void EnableThreadLabels(bool enabled) { thread_labels_requested_ = enabled; }
 
  protected:
+  // Runs a collection for duration_nanos_, leaving the collected traces in
+  // the aggregated table. It's called when GIL is held, with a
+  // CodeDeallocHook in scope. Returns false, with a Python exception set, if
+  // the collection couldn't start.
+  virtual bool CollectTraces() = 0;
+
+  // Returns the profile type used in the serialized profile, e.g. "CPU".
+  virtual const char *ProfileType() const = 0;
+
+  // Records the stack trace of the given thread state with the given weight.
+  // When ucontext is not nullptr, native frames are unwound from it too, see
+  // PopulateMixedFrames. The trace is tagged with the label set of the
+  // thread's current context, if any, see SampleLabels. Called from signal
+  // handlers only.
+  static void RecordTrace(PyThreadState *ts, int64_t weight = 0,
+                          const void *ucontext = nullptr);
+
+  // Populates frames with the stack trace of the given thread state, see
+  // PopulateFrames and PopulateMixedFrames, and registers its code objects as
+  // sampled with CodeDeallocHook. It is async-safe.
+  static int PopulateSampledFrames(CallFrame *frames, PyThreadState *ts,
+                                   const void *ucontext = nullptr);
+
+  // Sets the period and the sample types of the serialized profile. By
+  // default, samples have a count and a time in nanoseconds.
+  virtual void SetUpProfile(const char *profile_type, ProfileBuilder *builder);
+
+  // Replaces the content of values with the sample values of a node of
+  // aggregated_traces_, following the sample types set by SetUpProfile().
+  virtual void SampleValues(size_t node, std::vector<int64_t> *values);
+
+  // Marks the start of a collection. Collections share the fixed trace table,
+  // the signal handler and the code deallocation hook, so only one can be in
+  // progress at a time. Returns false with a Python exception set if another
+  // one is in progress. Must be called when GIL is held.
+  static bool StartCollecting();
+
+  // Marks the end of a collection.
+  static void StopCollecting() { collecting_.store(false); }
+
+  // Adds the traces which could not be recorded in fixed_traces_ to
+  // aggregated_traces_ as a single [Unknown] trace.
+  void AddUnknownTraces();
+
+  // Resolves the frames of the nodes of aggregated_traces_ up to, but
+  // excluding, end. Must be called when GIL is held.
+  void SymbolizeNodes(size_t end);
+
+  // Returns the symbol of a node resolved by SymbolizeNodes().
+  const SymbolTable::Symbol &NodeSymbol(size_t node) const {
+    return node_symbols_[node];
+  }
+
+  // Returns the string of a symbol.
+  static const std::string &SymbolString(uint32_t id) {
+    return symbols_->String(id);
+  }
+
+  // Returns whether a node of aggregated_traces_ holds a thread frame or a
+  // label set frame, which labels the samples of the traces going through it
+  // rather than being a location of these traces.
+  bool IsLabelNode(size_t node) const {
+    int lineno = aggregated_traces_.Frame(node).lineno;
+    return lineno == kThreadFrame || lineno == kLabelSetFrame;
+  }
+
+  // Appends the sample labels of a node for which IsLabelNode() is true.
+  // Must be called after the node is symbolized, when GIL is held.
+  void AddNodeLabels(size_t node,
+                     std::vector<ProfileBuilder::Label> *labels) const;
+
+  // Clears aggregated_traces_ and its symbols, and forgets the code objects
+  // deallocated since the collection started or since the last call. The
+  // frames of these code objects which are still in fixed_traces_ are then
+  // resolved as unknown. Must be called when GIL is held, with a
+  // CodeDeallocHook in scope.
+  void ClearTraces();
+
+  // Returns the current statistics of the collection.
+  ProfilerStats::Snapshot CurrentStats() const {
+    return stats_.Take(TableStats());
+  }
+
+  // Returns the statistics of the table the samples are recorded into.
+  virtual TraceTableStats TableStats() const { return fixed_traces_->Stats(); }
+
+  // Counts the signals handled, given when the handler started. It is
+  // async-safe.
+  static void RecordHandler(const struct timespec &start);
+
+  int64_t max_traces() const { return max_traces_; }
+  int64_t max_arena_frames() const { return max_arena_frames_; }
+
+  // Aggregated profile data, populated using data extracted from
+  // fixed_traces.
+  CallingContextTree aggregated_traces_;
+
   SignalHandler handler_;
   int64_t duration_nanos_;
   int64_t period_nanos_;
 
  private:
+  // Records the time spent holding the GIL since start at the end of the
+  // collection, and saves the statistics of the collection in last_stats_.
+  void SaveStats(const struct timespec &start);
+
+  // Stops recording the timeline, if the collection records one, and saves
+  // it in last_timeline_ with its traces resolved. Must be called when GIL is
+  // held, after the nodes of aggregated_traces_ are symbolized.
+  void SaveTimeline();
+
+  int64_t max_traces_;
+  int64_t max_arena_frames_;
+
   // Points to a fixed multiset of traces used during collection. This
   // is allocated on the first call to Reset(). Will be reused by
-  // subsequent allocations. Cannot be deallocated as it could be in
-  // use by other threads, triggered from a signal handler.
-  static AsyncSafeTraceMultiset *fixed_traces_;
+  // subsequent allocations of the same size. Cannot be deallocated as it
+  // could be in use by other threads, triggered from a signal handler.
+  static ShardedTraceMultiset *fixed_traces_;
 
-  // Aggregated profile data, populated using data extracted from
-  // fixed_traces.
-  TraceMultiset aggregated_traces_;
+  // Symbols of the frames of the nodes of aggregated_traces_, in node order.
+  std::vector<SymbolTable::Symbol> node_symbols_;
+
+  // Interned symbols, kept across collections. Allocated on first use.
+  static SymbolTable *symbols_;
 
   static std::atomic<int> unknown_stack_count_;
+  // Sum of the weights of the samples counted by unknown_stack_count_.
+  static std::atomic<int64_t> unknown_stack_weight_;
+
+  // Whether a collection is in progress, see StartCollecting().
+  static std::atomic<bool> collecting_;
+
+  // Statistics of the current collection, and of the last one.
+  static ProfilerStats stats_;
+  static ProfilerStats::Snapshot last_stats_;
+
+  // Capacity of the timeline of this profiler's collections, or 0.
+  int64_t timeline_capacity_ = 0;
+  // Timeline the signal handler records into, if the current collection
+  // records one. Points to timeline_storage_, which is reused by later
+  // collections and, like fixed_traces_, never deallocated.
+  static std::atomic<SampleTimeline *> timeline_;
+  static SampleTimeline *timeline_storage_;
+  // Difference between CLOCK_REALTIME and CLOCK_MONOTONIC when the timeline
+  // was reset, to convert the timestamps of the records.
+  static int64_t timeline_realtime_offset_nanos_;
+  // Guarded by GIL.
+  static std::unique_ptr<ResolvedTimeline> last_timeline_;
+
+  // Whether thread labels are requested for this profiler's collections.
+  bool thread_labels_requested_ = false;
+  // Whether RecordTrace adds thread frames to the traces.
+  static std::atomic<bool> thread_labels_;
+  // Kernel IDs of the threads labelled by the current collection, in an open
+  // addressing table of kMaxLabelledThreads entries, 0 standing for a free
+  // entry. Allocated on the first Reset().
+  static std::atomic<pid_t> *labelled_threads_;
+
+  // Returns whether samples of the given thread are labelled, registering it
+  // in labelled_threads_ if there's room. It is async-safe.
+  static bool LabelThread(pid_t tid);
+
+  // Empties labelled_threads_.
+  static void ClearLabelledThreads();
+
+ protected:
+  // Whether Profiler::Handle unwinds native frames.
+  static std::atomic<bool> native_frames_;
+
+  // Sampling period in effect, in nanoseconds.
+  static std::atomic<int64_t> sampling_period_nanos_;
+
+  // CPU time of the process at the last sample of a process-wide timer, in
+  // nanoseconds. See SampleWeight().
+  static std::atomic<int64_t> last_sample_cpu_nanos_;
+
+  // Returns the CPU time in nanoseconds represented by a sample of a CPU
+  // timer, given the siginfo_t passed to the signal handler. The kernel
+  // coalesces the signals of a timer which expires again before its signal
+  // is handled, so a sample may stand for more than one period. For a POSIX
+  // timer, the number of expirations missed is si_overrun. For ITIMER_PROF,
+  // which doesn't report overruns, it's the CPU time of the process since the
+  // previous sample. For a high-resolution timer, which passes the CPU time
+  // of its thread at the previous sample as si_value, it's the CPU time of
+  // the thread since then, or 0 when the thread used less than half a
+  // period, in which case no sample should be recorded. It is async-safe.
+  static int64_t SampleWeight(const siginfo_t *info);
+
+ private:
+  // Fork handler run in the child. Reenables the signal, and ends the
+  // collection in progress, if any: the threads and the CPU timers driving
+  // it are not inherited by the child, which would otherwise never be able to
+  // collect a profile.
+  static void AfterForkInChild();
+
+  static bool fork_handlers_registered_;
 };
 
 // CPUProfiler collects cpu profiles by setting up a CPU timer and
 // collecting a sample each time it is triggered (via SIGPROF).
 class CPUProfiler : public Profiler {
  public:
-  CPUProfiler(int64_t duration_nanos, int64_t period_nanos)
-      : Profiler(duration_nanos, period_nanos) {
-    // When a fork runs longer than the signal interval, it gets interrupted by
-    // the signal and then retry. This will never end until the profiler
-    // thread stops sending the signal. In unlucky cases, the profiler
-    // thread gets blocked on acquiring the memory lock, which is held by
-    // fork. The process may thus hang unpredictably long.
-    // The fix is to block the signal for the calling thread before fork and
-    // reenable it after fork. The caveat is that forks will not be sampled.
-    if (!fork_handlers_registered_) {
-      pthread_atfork(&BlockSigprof, &UnblockSigprof, &UnblockSigprof);
-      // Updating fork_handlers_registered_ here is not thread safe. It's
-      // fine because the profiler is only allowed to start once, which means
-      // that CPUProfiler is only created by a single thread.
-      fork_handlers_registered_ = true;
-    }
-  }
+  // When per_thread_timers is true, the CPU time of each thread is measured
+  // by its own timer, see ThreadCPUTimers. Otherwise, a single process-wide
+  // ITIMER_PROF timer is used.
+  // When native_frames is true, samples have mixed-mode stacks, with the
+  // native frames interleaved with the Python ones, see native_stacks.h.
+  // When overhead_budget is positive, the sampling period starts at
+  // period_nanos and is adapted after each flush, so that the time spent
+  // profiling stays near that fraction of one CPU, see AdaptPeriod().
+  // When high_resolution_timers is true, per-thread timers are used in
+  // high-resolution mode, whatever per_thread_timers is.
+  CPUProfiler(int64_t duration_nanos, int64_t period_nanos,
+              bool per_thread_timers = false,
+              int64_t max_traces = AsyncSafeTraceMultiset::kDefaultMaxEntries,
+              int64_t max_arena_frames =
+                  AsyncSafeTraceMultiset::kDefaultMaxArenaFrames,
+              bool native_frames = false, double overhead_budget = 0,
+              bool high_resolution_timers = false)
+      : Profiler(duration_nanos, period_nanos, max_traces, max_arena_frames),
+        per_thread_timers_(per_thread_timers || high_resolution_timers),
+        native_frames_requested_(native_frames),
+        overhead_budget_(overhead_budget),
+        thread_timers_(high_resolution_timers) {}
   // Not copyable or assignable.
   CPUProfiler(const CPUProfiler &) = delete;
   CPUProfiler &operator=(const CPUProfiler &) = delete;
 
-  // Collects profiling data.
-  PyObject *Collect() override;
+ protected:
+  bool CollectTraces() override;
+
+  const char *ProfileType() const override { return "CPU"; }
+
+  // Samples are weighted by the CPU time they represent, see SampleWeight(),
+  // so their time is right even if the period changed or signals were
+  // coalesced.
+  void SampleValues(size_t node, std::vector<int64_t> *values) override;
 
- private:
   // Initiates data collection at a fixed interval.
   bool Start();
 
   // Stops data collection.
   void Stop();
 
-  static bool fork_handlers_registered_;
+  // Creates timers for the threads which started since Start() or the last
+  // call, and forgets the threads which exited, when per-thread timers are
+  // used. Does nothing otherwise.
+  void UpdateThreadTimers();
+
+ private:
+  // Bounds of the adapted sampling period.
+  static const int64_t kMinAdaptivePeriodNanos = 1000 * 1000;
+  static const int64_t kMaxAdaptivePeriodNanos = 100 * 1000 * 1000;
+
+  // Returns the sampling period for the next flush interval, given the
+  // period in effect and the time spent profiling during the elapsed
+  // interval. The period is scaled by the ratio of the measured overhead to
+  // overhead_budget_, changing at most twofold at a time, so that fewer
+  // samples are taken when handling them costs too much, and more when the
+  // process is idle.
+  int64_t AdaptPeriod(int64_t period_nanos, int64_t overhead_nanos,
+                      int64_t elapsed_nanos) const;
+
+  // Sets the interval of the timers. Returns false if it couldn't be set.
+  bool SetInterval(int64_t period_nanos);
+
+  bool per_thread_timers_;
+  bool native_frames_requested_;
+  double overhead_budget_;
+  ThreadCPUTimers thread_timers_;
+};
+
+// WallProfiler collects wall time profiles of all Python threads. The thread
+// running the collection acts as the sampler: at every wall clock interval it
+// sends SIGPROF to each other thread of the process, and each signaled thread
+// records its own stack from the signal handler. Threads blocked in I/O or
+// waiting for the GIL are sampled as well. Threads without a Python thread
+// state are not recorded.
+class WallProfiler : public Profiler {
+ public:
+  WallProfiler(int64_t duration_nanos, int64_t period_nanos)
+      : Profiler(duration_nanos, period_nanos) {}
+  // Not copyable or assignable.
+  WallProfiler(const WallProfiler &) = delete;
+  WallProfiler &operator=(const WallProfiler &) = delete;
+
+  // Signal handler, which records the current stack trace if the thread has a
+  // Python thread state. Samples of threads holding the GIL have a weight of
+  // kGilHeldWeight, and those of threads waiting for it kGilWaitWeight, see
+  // ContentionProfiler.
+  static void Handle(int signum, siginfo_t *info, void *context);
+
+  // The weights of a node add up to the number of its samples holding the
+  // GIL, plus the number of those waiting for it shifted by 32 bits, as a
+  // node has fewer than 2^32 samples.
+  static const int64_t kGilHeldWeight = 1;
+  static const int64_t kGilWaitWeight = static_cast<int64_t>(1) << 32;
+
+ protected:
+  bool CollectTraces() override;
+
+  const char *ProfileType() const override { return "wall"; }
+
+ private:
+  // Replaces threads_ with the IDs of all threads of this process, except the
+  // calling thread.
+  void UpdateThreads();
+
+  // Sends SIGPROF to each thread in threads_.
+  void SignalThreads();
+
+  // Stops data collection.
+  void Stop();
+
+  // Kernel thread IDs of the threads to sample.
+  std::vector<pid_t> threads_;
+};
+
+// ContentionProfiler samples all Python threads like WallProfiler, and tells
+// the samples of threads holding the GIL from those of threads waiting for it,
+// and from those of threads which released it, e.g. to sleep or block in I/O.
+// Whether a thread holds the GIL is read from its thread state in the signal
+// handler, and whether it waits for the GIL from the system call it was
+// interrupted in, see WaitsForGil(). The profile has the number of samples,
+// and the time spent holding the GIL, waiting for it and after releasing it,
+// with the Python stack of the thread. A convoy shows up as wait time on the
+// calls after which threads take the GIL back, e.g. I/O calls made while a
+// CPU bound thread holds it.
+//
+// Where waiting for the GIL can't be told, see gil_wait.h, the wait is
+// counted as released time.
+class ContentionProfiler : public WallProfiler {
+ public:
+  ContentionProfiler(int64_t duration_nanos, int64_t period_nanos)
+      : WallProfiler(duration_nanos, period_nanos) {}
+
+ protected:
+  const char *ProfileType() const override { return "CONTENTION"; }
+
+  void SetUpProfile(const char *profile_type,
+                    ProfileBuilder *builder) override;
+
+  void SampleValues(size_t node, std::vector<int64_t> *values) override;
 };
 
 #endif  // GOOGLECLOUDPROFILER_SRC_PROFILER_H_
@@ -0,0 +1,148 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "profiler_stats.h"
+
+namespace {
+
+void UpdateMax(std::atomic<int64_t> *max, int64_t value) {
+  int64_t current = max->load(std::memory_order_relaxed);
+  while (value > current &&
+         !max->compare_exchange_weak(current, value,
+                                     std::memory_order_relaxed)) {
+  }
+}
+
+}  // namespace
+
+void ProfilerStats::Reset() {
+  signals_.store(0, std::memory_order_relaxed);
+  handler_nanos_.store(0, std::memory_order_relaxed);
+  max_handler_nanos_.store(0, std::memory_order_relaxed);
+  for (int i = 0; i < kNumLatencyBuckets; i++) {
+    handler_latency_buckets_[i].store(0, std::memory_order_relaxed);
+  }
+  flushes_.store(0, std::memory_order_relaxed);
+  flush_nanos_.store(0, std::memory_order_relaxed);
+  symbolize_gil_nanos_.store(0, std::memory_order_relaxed);
+  final_gil_nanos_.store(0, std::memory_order_relaxed);
+}
+
+void ProfilerStats::RecordHandler(int64_t nanos) {
+  signals_.fetch_add(1, std::memory_order_relaxed);
+  handler_nanos_.fetch_add(nanos, std::memory_order_relaxed);
+  UpdateMax(&max_handler_nanos_, nanos);
+  int bucket = 0;
+  for (int64_t micros = nanos / 1000; micros > 0; micros >>= 1) {
+    bucket++;
+  }
+  if (bucket >= kNumLatencyBuckets) {
+    bucket = kNumLatencyBuckets - 1;
+  }
+  handler_latency_buckets_[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+ProfilerStats::Snapshot ProfilerStats::Take(
+    const TraceTableStats &table_stats) const {
+  Snapshot snapshot;
+  snapshot.signals = signals_.load(std::memory_order_relaxed);
+  snapshot.samples = table_stats.add_count - table_stats.table_full_count -
+                     table_stats.arena_full_count;
+  snapshot.table_full_samples = table_stats.table_full_count;
+  snapshot.arena_full_samples = table_stats.arena_full_count;
+  snapshot.probes = table_stats.probe_count;
+  snapshot.max_probe_length = table_stats.max_probe_length;
+  snapshot.handler_nanos = handler_nanos_.load(std::memory_order_relaxed);
+  snapshot.max_handler_nanos =
+      max_handler_nanos_.load(std::memory_order_relaxed);
+  for (int i = 0; i < kNumLatencyBuckets; i++) {
+    snapshot.handler_latency_buckets[i] =
+        handler_latency_buckets_[i].load(std::memory_order_relaxed);
+  }
+  snapshot.flushes = flushes_.load(std::memory_order_relaxed);
+  snapshot.flush_nanos = flush_nanos_.load(std::memory_order_relaxed);
+  snapshot.symbolize_gil_nanos =
+      symbolize_gil_nanos_.load(std::memory_order_relaxed);
+  snapshot.final_gil_nanos = final_gil_nanos_.load(std::memory_order_relaxed);
+  return snapshot;
+}
+
+std::vector<std::pair<std::string, int64_t>>
+ProfilerStats::Snapshot::Values() const {
+  return {
+      {"signals", signals},
+      {"samples", samples},
+      {"table_full_samples", table_full_samples},
+      {"arena_full_samples", arena_full_samples},
+      {"probes", probes},
+      {"max_probe_length", max_probe_length},
+      {"handler_nanos", handler_nanos},
+      {"max_handler_nanos", max_handler_nanos},
+      {"flushes", flushes},
+      {"flush_nanos", flush_nanos},
+      {"symbolize_gil_nanos", symbolize_gil_nanos},
+      {"final_gil_nanos", final_gil_nanos},
+  };
+}
+
+std::string ProfilerStats::Snapshot::LatencyBuckets() const {
+  std::string buckets;
+  for (int i = 0; i < kNumLatencyBuckets; i++) {
+    if (i > 0) {
+      buckets.push_back(',');
+    }
+    buckets.append(std::to_string(handler_latency_buckets[i]));
+  }
+  return buckets;
+}
+
+PyObject *PythonStats(const ProfilerStats::Snapshot &stats) {
+  PyObject *py_stats = PyDict_New();
+  if (py_stats == nullptr) {
+    return nullptr;
+  }
+  for (const auto &value : stats.Values()) {
+    PyObject *py_value = PyLong_FromLongLong(value.second);
+    if (py_value == nullptr ||
+        PyDict_SetItemString(py_stats, value.first.c_str(), py_value) < 0) {
+      Py_XDECREF(py_value);
+      Py_DECREF(py_stats);
+      return nullptr;
+    }
+    Py_DECREF(py_value);
+  }
+  PyObject *py_buckets = PyTuple_New(ProfilerStats::kNumLatencyBuckets);
+  if (py_buckets == nullptr) {
+    Py_DECREF(py_stats);
+    return nullptr;
+  }
+  for (int i = 0; i < ProfilerStats::kNumLatencyBuckets; i++) {
+    PyObject *py_count = PyLong_FromLongLong(stats.handler_latency_buckets[i]);
+    if (py_count == nullptr) {
+      Py_DECREF(py_buckets);
+      Py_DECREF(py_stats);
+      return nullptr;
+    }
+    // PyTuple_SET_ITEM steals the reference to py_count.
+    PyTuple_SET_ITEM(py_buckets, i, py_count);
+  }
+  int result =
+      PyDict_SetItemString(py_stats, "handler_latency_buckets", py_buckets);
+  Py_DECREF(py_buckets);
+  if (result < 0) {
+    Py_DECREF(py_stats);
+    return nullptr;
+  }
+  return py_stats;
+}
@@ -0,0 +1,122 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLECLOUDPROFILER_SRC_PROFILER_STATS_H_
+#define GOOGLECLOUDPROFILER_SRC_PROFILER_STATS_H_
+
+#include <Python.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "stacktraces.h"
+
+// ProfilerStats counts what the profiler itself does during a collection, so
+// that its overhead and its data loss can be monitored: the signals handled
+// and the time spent handling them, the flushes of the trace table, and the
+// time spent holding the GIL. Counters updated by signal handlers are relaxed
+// atomics, so updating them is async-safe.
+class ProfilerStats {
+ public:
+  // Handler latencies are counted in buckets of powers of 2 microseconds.
+  // Bucket 0 counts latencies below 1 us, bucket i those in [2^(i-1), 2^i) us,
+  // and the last bucket all latencies above.
+  static const int kNumLatencyBuckets = 16;
+
+  // Values of the counters, with the statistics of the trace table.
+  struct Snapshot {
+    // Number of signals handled.
+    int64_t signals = 0;
+    // Number of samples recorded into the trace table.
+    int64_t samples = 0;
+    // Number of samples dropped because the trace table or its frame arena
+    // was full. They show up as an [Unknown] frame.
+    int64_t table_full_samples = 0;
+    int64_t arena_full_samples = 0;
+    // Total and largest number of trace table entries probed by a sample.
+    int64_t probes = 0;
+    int64_t max_probe_length = 0;
+    // Total and largest time spent in the signal handler.
+    int64_t handler_nanos = 0;
+    int64_t max_handler_nanos = 0;
+    int64_t handler_latency_buckets[kNumLatencyBuckets] = {};
+    // Number of flushes of the trace table, and the time they took.
+    int64_t flushes = 0;
+    int64_t flush_nanos = 0;
+    // Time spent holding the GIL to resolve frames while collecting, and at
+    // the end of the collection to build the profile.
+    int64_t symbolize_gil_nanos = 0;
+    int64_t final_gil_nanos = 0;
+
+    // Returns the scalar values by name, in a fixed order.
+    std::vector<std::pair<std::string, int64_t>> Values() const;
+
+    // Returns the time spent sampling and processing the samples while
+    // collecting, excluding the end of the collection.
+    int64_t OverheadNanos() const {
+      return handler_nanos + flush_nanos + symbolize_gil_nanos;
+    }
+
+    // Returns the handler latency histogram as comma-separated counts.
+    std::string LatencyBuckets() const;
+  };
+
+  ProfilerStats() { Reset(); }
+  // Not copyable or assignable.
+  ProfilerStats(const ProfilerStats &) = delete;
+  ProfilerStats &operator=(const ProfilerStats &) = delete;
+
+  // Resets all counters to zero.
+  void Reset();
+
+  // Counts a signal whose handler took the given time. It is async-safe.
+  void RecordHandler(int64_t nanos);
+
+  void RecordFlush(int64_t nanos) {
+    flushes_.fetch_add(1, std::memory_order_relaxed);
+    flush_nanos_.fetch_add(nanos, std::memory_order_relaxed);
+  }
+
+  void RecordSymbolizeGil(int64_t nanos) {
+    symbolize_gil_nanos_.fetch_add(nanos, std::memory_order_relaxed);
+  }
+
+  void RecordFinalGil(int64_t nanos) {
+    final_gil_nanos_.fetch_add(nanos, std::memory_order_relaxed);
+  }
+
+  // Returns the current values of the counters, with the given statistics of
+  // the trace table the samples were recorded into.
+  Snapshot Take(const TraceTableStats &table_stats) const;
+
+ private:
+  std::atomic<int64_t> signals_;
+  std::atomic<int64_t> handler_nanos_;
+  std::atomic<int64_t> max_handler_nanos_;
+  std::atomic<int64_t> handler_latency_buckets_[kNumLatencyBuckets];
+  std::atomic<int64_t> flushes_;
+  std::atomic<int64_t> flush_nanos_;
+  std::atomic<int64_t> symbolize_gil_nanos_;
+  std::atomic<int64_t> final_gil_nanos_;
+};
+
+// Returns the snapshot as a Python dictionary object, which maps the name of
+// each value to the value, and "handler_latency_buckets" to a tuple of the
+// bucket counts. Must be called when GIL is held.
+PyObject *PythonStats(const ProfilerStats::Snapshot &stats);
+
+#endif  // GOOGLECLOUDPROFILER_SRC_PROFILER_STATS_H_
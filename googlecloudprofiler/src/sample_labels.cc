@@ -0,0 +1,151 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "sample_labels.h"
+
+#include <string>
+
+#include "log.h"
+
+// Any address which can't be a context's.
+PyObject *const SampleLabels::kRemoved = reinterpret_cast<PyObject *>(1);
+SampleLabels::Context *SampleLabels::contexts_ = nullptr;
+std::atomic<int64_t> SampleLabels::num_contexts_(0);
+std::vector<SampleLabels::LabelSet> *SampleLabels::label_sets_ = nullptr;
+std::unordered_map<std::string, uint32_t> *SampleLabels::label_set_ids_ =
+    nullptr;
+
+uint32_t SampleLabels::Intern(const LabelSet &labels) {
+  if (label_sets_ == nullptr) {
+    label_sets_ = new std::vector<LabelSet>;
+    label_set_ids_ = new std::unordered_map<std::string, uint32_t>;
+  }
+  // Keys and values are prefixed with their size, as they may contain any
+  // character.
+  std::string key;
+  for (const auto &label : labels) {
+    key.append(std::to_string(label.first.size())).push_back(':');
+    key.append(label.first);
+    key.append(std::to_string(label.second.size())).push_back(':');
+    key.append(label.second);
+  }
+  auto known = label_set_ids_->find(key);
+  if (known != label_set_ids_->end()) {
+    return known->second;
+  }
+  if (label_sets_->size() >= kMaxLabelSets) {
+    static bool warned = false;
+    if (!warned) {
+      LogWarning("More than %u distinct label sets, samples of new label "
+                 "sets are not labelled",
+                 kMaxLabelSets);
+      warned = true;
+    }
+    return 0;
+  }
+  label_sets_->push_back(labels);
+  uint32_t id = label_sets_->size();
+  label_set_ids_->emplace(key, id);
+  return id;
+}
+
+const SampleLabels::LabelSet &SampleLabels::Labels(uint32_t id) {
+  return (*label_sets_)[id - 1];
+}
+
+int64_t SampleLabels::ContextSlot(const PyObject *context) {
+  // Objects are at least 16-byte aligned, the low bits carry no information.
+  uint64_t bits = reinterpret_cast<uintptr_t>(context) >> 4;
+  return (bits * 0x9E3779B97F4A7C15ULL) >> 32 & (kMaxContexts - 1);
+}
+
+uint32_t SampleLabels::Set(PyObject *context, uint32_t id) {
+  if (contexts_ == nullptr) {
+    contexts_ = new Context[kMaxContexts];
+    for (int64_t i = 0; i < kMaxContexts; i++) {
+      contexts_[i].context.store(nullptr, std::memory_order_relaxed);
+      contexts_[i].id.store(0, std::memory_order_relaxed);
+    }
+  }
+  int64_t slot = ContextSlot(context);
+  // First entry the context can be added to, if it's not in the table.
+  Context *free_entry = nullptr;
+  for (int i = 0; i < kMaxProbes; i++) {
+    Context &entry = contexts_[(slot + i) & (kMaxContexts - 1)];
+    PyObject *entry_context = entry.context.load(std::memory_order_relaxed);
+    if (entry_context == context) {
+      uint32_t previous_id = entry.id.load(std::memory_order_relaxed);
+      if (id != 0) {
+        entry.id.store(id, std::memory_order_relaxed);
+      } else {
+        // Removed entries are kept, so that the probe sequences going
+        // through them still reach the entries after them.
+        entry.context.store(kRemoved, std::memory_order_release);
+        num_contexts_.fetch_sub(1);
+        Py_DECREF(context);
+      }
+      return previous_id;
+    }
+    if (entry_context == kRemoved && free_entry == nullptr) {
+      free_entry = &entry;
+    }
+    if (entry_context == nullptr) {
+      if (free_entry == nullptr) {
+        free_entry = &entry;
+      }
+      break;
+    }
+  }
+  if (id == 0) {
+    return 0;
+  }
+  if (free_entry == nullptr) {
+    static bool warned = false;
+    if (!warned) {
+      LogWarning("Too many contexts with labels, some samples are not "
+                 "labelled");
+      warned = true;
+    }
+    return 0;
+  }
+  // The ID is stored before the context is published to the signal
+  // handlers.
+  free_entry->id.store(id, std::memory_order_relaxed);
+  Py_INCREF(context);
+  free_entry->context.store(context, std::memory_order_release);
+  num_contexts_.fetch_add(1);
+  return 0;
+}
+
+uint32_t SampleLabels::Current(PyThreadState *ts) {
+  if (ts == nullptr || num_contexts_.load(std::memory_order_relaxed) == 0) {
+    return 0;
+  }
+  PyObject *context = ts->context;
+  if (context == nullptr) {
+    return 0;
+  }
+  int64_t slot = ContextSlot(context);
+  for (int i = 0; i < kMaxProbes; i++) {
+    Context &entry = contexts_[(slot + i) & (kMaxContexts - 1)];
+    PyObject *entry_context = entry.context.load(std::memory_order_acquire);
+    if (entry_context == context) {
+      return entry.id.load(std::memory_order_relaxed);
+    }
+    if (entry_context == nullptr) {
+      break;
+    }
+  }
+  return 0;
+}
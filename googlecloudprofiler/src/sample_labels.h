@@ -0,0 +1,112 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLECLOUDPROFILER_SRC_SAMPLE_LABELS_H_
+#define GOOGLECLOUDPROFILER_SRC_SAMPLE_LABELS_H_
+
+#include <Python.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+// SampleLabels attaches application-defined labels to samples, as the labels
+// of Go's pprof do, e.g. to split the CPU time by endpoint or tenant.
+//
+// Sets of key-value pairs are interned into label set IDs, see Intern(), and
+// are kept for the lifetime of the process. While code runs under a label
+// set, the Python context it runs in, see the contextvars module, is mapped
+// to the label set ID in a fixed table, which the signal handlers read to tag
+// their samples, see Current(). The interpreter switches the current context
+// of a thread when it switches between asyncio tasks, each task running in a
+// context of its own, so the samples of tasks sharing a thread get the
+// labels of their own task. A new task gets a copy of the context it's
+// created in, which isn't mapped to the label set of that context: its
+// samples are only labelled under the label sets it sets itself.
+//
+// Intern() and Set() must be called when GIL is held. Current() is
+// async-safe.
+class SampleLabels {
+ public:
+  // Key-value pairs, sorted by key.
+  typedef std::vector<std::pair<std::string, std::string>> LabelSet;
+
+  // Maximum number of distinct label sets, which bounds the memory they use.
+  static const uint32_t kMaxLabelSets = 1 << 12;
+
+  // Maximum number of contexts mapped to a label set at the same time. Must
+  // be a power of 2.
+  static const int64_t kMaxContexts = 1 << 12;
+
+  // Returns the ID of a label set, interning it if it's new. IDs start at 1.
+  // Returns 0 if there are already kMaxLabelSets label sets.
+  static uint32_t Intern(const LabelSet &labels);
+
+  // Returns the label set of an ID returned by Intern().
+  static const LabelSet &Labels(uint32_t id);
+
+  // Maps a context, see contextvars.Context, to the given label set ID, or
+  // removes its mapping if id is 0. Returns the ID the context was mapped to,
+  // or 0. The table holds a reference to each context mapped, so that the
+  // address of a context isn't reused while it's mapped. If the table is
+  // full, the context is left unmapped, and its samples unlabelled.
+  //
+  // The context to restore when leaving a label set must be the one it was
+  // set on, rather than the current context then: e.g. the finally block of a
+  // coroutine finalized by the garbage collector runs in an unrelated
+  // context.
+  static uint32_t Set(PyObject *context, uint32_t id);
+
+  // Returns the current context of the calling thread, or nullptr if it has
+  // none yet. Must be called when GIL is held.
+  static PyObject *CurrentContext() { return PyThreadState_Get()->context; }
+
+  // Returns the label set ID the current context of the given thread state
+  // is mapped to, or 0. It is async-safe.
+  static uint32_t Current(PyThreadState *ts);
+
+ private:
+  // Entry of the table of contexts, an open addressing hash table keyed by
+  // the context pointer.
+  struct Context {
+    // nullptr for a free entry, kRemoved for an entry which was removed.
+    std::atomic<PyObject *> context;
+    std::atomic<uint32_t> id;
+  };
+
+  // Returns the index of the first entry to probe for a context.
+  static int64_t ContextSlot(const PyObject *context);
+
+  static PyObject *const kRemoved;
+
+  // Maximum number of entries probed to find a context.
+  static const int kMaxProbes = 64;
+
+  // Allocated on first use, and never deallocated as the signal handlers may
+  // read them at any time.
+  static Context *contexts_;
+  // Number of contexts mapped, so that the signal handlers skip the lookup
+  // when no label set is in use.
+  static std::atomic<int64_t> num_contexts_;
+
+  // Label sets, at their ID minus one.
+  static std::vector<LabelSet> *label_sets_;
+  // Maps an encoded label set to its ID.
+  static std::unordered_map<std::string, uint32_t> *label_set_ids_;
+};
+
+#endif  // GOOGLECLOUDPROFILER_SRC_SAMPLE_LABELS_H_
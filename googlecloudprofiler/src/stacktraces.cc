@@ -14,96 +14,259 @@
 
 #include "stacktraces.h"
 
-bool AsyncSafeTraceMultiset::Add(const CallTrace *trace) {
+#include <sched.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#include <new>
+
+#include "clock.h"
+
+const char *CallTraceErrorToName(CallTraceErrors err) {
+  switch (err) {
+    case kNoPyState:
+      return "[Unknown - No Python thread state]";
+    default:
+      return "[Unknown]";
+  }
+}
+
+AsyncSafeTraceMultiset::AsyncSafeTraceMultiset(int64_t max_entries,
+                                               int64_t max_arena_frames)
+    : max_entries_(max_entries),
+      max_arena_frames_(max_arena_frames),
+      traces_storage_(new char[(max_entries + 1) * sizeof(TraceData)]),
+      frame_arena_(new CallFrame[max_arena_frames]),
+      populated_(new std::atomic<int64_t>[max_entries]) {
+  static_assert(sizeof(TraceData) == kCacheLineSize,
+                "TraceData must fill a cache line");
+  uintptr_t aligned = (reinterpret_cast<uintptr_t>(traces_storage_) +
+                       kCacheLineSize - 1) &
+                      ~static_cast<uintptr_t>(kCacheLineSize - 1);
+  traces_ = reinterpret_cast<TraceData *>(aligned);
+  for (int64_t i = 0; i < max_entries_; i++) {
+    new (&traces_[i]) TraceData;
+    ClearEntry(i);
+    populated_[i].store(kNotPopulated, std::memory_order_relaxed);
+  }
+  num_populated_.store(0, std::memory_order_relaxed);
+  Reset();
+}
+
+AsyncSafeTraceMultiset::~AsyncSafeTraceMultiset() {
+  delete[] traces_storage_;
+  delete[] frame_arena_;
+  delete[] populated_;
+}
+
+void AsyncSafeTraceMultiset::ClearEntry(int64_t location) {
+  traces_[location].hash = 0;
+  traces_[location].offset = 0;
+  traces_[location].num_frames = 0;
+  traces_[location].state.store(kEntryEmpty, std::memory_order_relaxed);
+  traces_[location].count.store(0, std::memory_order_relaxed);
+  traces_[location].weight.store(0, std::memory_order_relaxed);
+}
+
+void AsyncSafeTraceMultiset::Reset() {
+  // Only published entries need to be cleared: an entry which is reserved
+  // but can't get arena space is moved back to the empty state by Add(). With
+  // no Add() in progress, every published entry is in the populated list.
+  int64_t num_populated = num_populated_.load(std::memory_order_relaxed);
+  if (num_populated > max_entries_) {
+    num_populated = max_entries_;
+  }
+  for (int64_t i = 0; i < num_populated; i++) {
+    int64_t location = populated_[i].load(std::memory_order_relaxed);
+    if (location != kNotPopulated) {
+      ClearEntry(location);
+    }
+    populated_[i].store(kNotPopulated, std::memory_order_relaxed);
+  }
+  num_populated_.store(0, std::memory_order_relaxed);
+  // The arena doesn't need to be cleared, it's only read within the bounds of
+  // ready entries.
+  arena_used_.store(0, std::memory_order_relaxed);
+  table_full_count_.store(0, std::memory_order_relaxed);
+  arena_full_count_.store(0, std::memory_order_relaxed);
+  add_count_.store(0, std::memory_order_relaxed);
+  probe_count_.store(0, std::memory_order_relaxed);
+  max_probe_length_.store(0, std::memory_order_relaxed);
+}
+
+int AsyncSafeTraceMultiset::ExtractPopulated(int64_t n,
+                                             const CallFrame **frames,
+                                             int64_t *count, int64_t *weight) {
+  if (n < 0 || n >= max_entries_) {
+    return 0;
+  }
+  int64_t location = populated_[n].load(std::memory_order_acquire);
+  if (location == kNotPopulated) {
+    // The Add() which reserved this slot hasn't stored the index yet, the
+    // entry will be found by a later call.
+    return 0;
+  }
+  auto &entry = traces_[location];
+  int64_t c = entry.count.exchange(0, std::memory_order_relaxed);
+  int64_t w = entry.weight.exchange(0, std::memory_order_relaxed);
+  if (c <= 0 && w <= 0) {
+    return 0;
+  }
+  *frames = frame_arena_ + entry.offset;
+  *count = c;
+  *weight = w;
+  return entry.num_frames;
+}
+
+int AsyncSafeTraceMultiset::Frames(int64_t location,
+                                   const CallFrame **frames) const {
+  if (location < 0 || location >= max_entries_) {
+    return 0;
+  }
+  const auto &entry = traces_[location];
+  if (entry.state.load(std::memory_order_acquire) != kEntryReady) {
+    return 0;
+  }
+  *frames = frame_arena_ + entry.offset;
+  return entry.num_frames;
+}
+
+TraceTableStats AsyncSafeTraceMultiset::Stats() const {
+  TraceTableStats stats;
+  stats.add_count = add_count_.load(std::memory_order_relaxed);
+  stats.probe_count = probe_count_.load(std::memory_order_relaxed);
+  stats.max_probe_length = max_probe_length_.load(std::memory_order_relaxed);
+  stats.table_full_count = table_full_count_.load(std::memory_order_relaxed);
+  stats.arena_full_count = arena_full_count_.load(std::memory_order_relaxed);
+  return stats;
+}
+
+void TraceTableStats::Merge(const TraceTableStats &other) {
+  add_count += other.add_count;
+  probe_count += other.probe_count;
+  if (other.max_probe_length > max_probe_length) {
+    max_probe_length = other.max_probe_length;
+  }
+  table_full_count += other.table_full_count;
+  arena_full_count += other.arena_full_count;
+}
+
+void AsyncSafeTraceMultiset::RecordProbeLength(int64_t probe_length) {
+  add_count_.fetch_add(1, std::memory_order_relaxed);
+  probe_count_.fetch_add(probe_length, std::memory_order_relaxed);
+  int64_t max = max_probe_length_.load(std::memory_order_relaxed);
+  while (probe_length > max &&
+         !max_probe_length_.compare_exchange_weak(max, probe_length,
+                                                  std::memory_order_relaxed)) {
+  }
+}
+
+bool AsyncSafeTraceMultiset::Add(const CallTrace *trace, int64_t count,
+                                 int64_t weight, int64_t *location,
+                                 uint64_t *hash) {
   uint64_t hash_val = CalculateHash(trace->num_frames, trace->frames);
-  for (int64_t i = 0; i < MaxEntries(); i++) {
-    int64_t idx = (i + hash_val) % MaxEntries();
+  if (hash != nullptr) {
+    *hash = hash_val;
+  }
+  for (int64_t i = 0; i < max_entries_; i++) {
+    int64_t idx = (i + hash_val) % max_entries_;
     auto &entry = traces_[idx];
-    int64_t count_zero = 0;
-    entry.active_updates.fetch_add(1, std::memory_order_acquire);
-    int64_t count = entry.count.load(std::memory_order_acquire);
-    switch (count) {
-      case 0:
-        if (entry.count.compare_exchange_weak(count_zero, kTraceCountLocked,
-                                              std::memory_order_relaxed)) {
-          // This entry is reserved, there is no danger of interacting
-          // with Extract, so decrement active_updates early.
-          entry.active_updates.fetch_sub(1, std::memory_order_release);
-
-          // memcpy is not async safe
-          CallFrame *fb = entry.frame_buffer;
-          for (int frame_num = 0; frame_num < trace->num_frames; ++frame_num) {
-            fb[frame_num].lineno = trace->frames[frame_num].lineno;
-            fb[frame_num].py_code = trace->frames[frame_num].py_code;
-          }
-          entry.trace.frames = fb;
-          entry.trace.num_frames = trace->num_frames;
-          entry.count.store(int64_t(1), std::memory_order_release);
-          return true;
+    int state = entry.state.load(std::memory_order_acquire);
+    if (state == kEntryEmpty) {
+      if (entry.state.compare_exchange_strong(state, kEntryLocked,
+                                              std::memory_order_acquire)) {
+        int64_t offset = arena_used_.fetch_add(trace->num_frames,
+                                               std::memory_order_relaxed);
+        if (offset + trace->num_frames > max_arena_frames_) {
+          entry.state.store(kEntryEmpty, std::memory_order_release);
+          arena_full_count_.fetch_add(1, std::memory_order_relaxed);
+          RecordProbeLength(i + 1);
+          return false;
+        }
+        // memcpy is not async safe
+        CallFrame *fb = frame_arena_ + offset;
+        for (int frame_num = 0; frame_num < trace->num_frames; ++frame_num) {
+          fb[frame_num].lineno = trace->frames[frame_num].lineno;
+          fb[frame_num].generation = trace->frames[frame_num].generation;
+          fb[frame_num].py_code = trace->frames[frame_num].py_code;
+        }
+        entry.hash = hash_val;
+        entry.offset = offset;
+        entry.num_frames = trace->num_frames;
+        entry.count.store(count, std::memory_order_relaxed);
+        entry.weight.store(weight, std::memory_order_relaxed);
+        entry.state.store(kEntryReady, std::memory_order_release);
+        // An entry is published at most once between resets, so the list
+        // can't overflow.
+        int64_t n = num_populated_.fetch_add(1, std::memory_order_relaxed);
+        populated_[n].store(idx, std::memory_order_release);
+        RecordProbeLength(i + 1);
+        if (location != nullptr) {
+          *location = idx;
+        }
+        return true;
+      }
+      // Another thread took the entry in the meantime, compare_exchange_strong
+      // loaded its current state.
+    }
+    if (state == kEntryReady) {
+      // Comparing the full hash first avoids touching the frames of entries
+      // holding another trace.
+      if (entry.hash == hash_val && trace->num_frames == entry.num_frames &&
+          Equal(trace->num_frames, trace->frames,
+                frame_arena_ + entry.offset)) {
+        entry.count.fetch_add(count, std::memory_order_relaxed);
+        if (weight != 0) {
+          entry.weight.fetch_add(weight, std::memory_order_relaxed);
         }
-        break;
-      case kTraceCountLocked:
-        // This entry is being updated by another thread. Move on.
-        // Worst case we may end with multiple entries with the same trace.
-        break;
-      default:
-        if (trace->num_frames == entry.trace.num_frames &&
-            Equal(trace->num_frames, trace->frames, entry.trace.frames)) {
-          // Bump using a compare-swap instead of fetch_add to ensure
-          // it hasn't been locked by a thread doing Extract().
-          // Reload count in case it was updated while we were
-          // examining the trace.
-          count = entry.count.load(std::memory_order_relaxed);
-          if (count != kTraceCountLocked &&
-              entry.count.compare_exchange_weak(count, count + 1,
-                                                std::memory_order_relaxed)) {
-            entry.active_updates.fetch_sub(1, std::memory_order_release);
-            return true;
-          }
+        RecordProbeLength(i + 1);
+        if (location != nullptr) {
+          *location = idx;
         }
+        return true;
+      }
     }
-    // Did nothing, but we still need storage ordering between this
-    // store and preceding loads.
-    entry.active_updates.fetch_sub(1, std::memory_order_release);
+    // Otherwise, the entry is being written by another thread. Move on.
+    // Worst case we may end with multiple entries with the same trace.
   }
+  table_full_count_.fetch_add(1, std::memory_order_relaxed);
+  RecordProbeLength(max_entries_);
   return false;
 }
 
 int AsyncSafeTraceMultiset::Extract(int location, int max_frames,
-                                    CallFrame *frames, int64_t *count) {
-  if (location < 0 || location >= MaxEntries()) {
+                                    CallFrame *frames, int64_t *count,
+                                    int64_t *weight) {
+  if (location < 0 || location >= max_entries_) {
     return 0;
   }
   auto &entry = traces_[location];
-  int64_t c = entry.count.load(std::memory_order_acquire);
-  if (c <= 0) {
+  if (entry.state.load(std::memory_order_acquire) != kEntryReady) {
     // Unused or in process of being updated, skip for now.
     return 0;
   }
-  int num_frames = entry.trace.num_frames;
+  int64_t c = entry.count.exchange(0, std::memory_order_relaxed);
+  int64_t w = entry.weight.exchange(0, std::memory_order_relaxed);
+  if (c <= 0 && w <= 0) {
+    return 0;
+  }
+  int num_frames = entry.num_frames;
   if (num_frames > max_frames) {
     num_frames = max_frames;
   }
-
-  c = entry.count.exchange(kTraceCountLocked, std::memory_order_acquire);
-
+  const CallFrame *fb = frame_arena_ + entry.offset;
   for (int i = 0; i < num_frames; ++i) {
-    frames[i].lineno = entry.trace.frames[i].lineno;
-    frames[i].py_code = entry.trace.frames[i].py_code;
+    frames[i].lineno = fb[i].lineno;
+    frames[i].generation = fb[i].generation;
+    frames[i].py_code = fb[i].py_code;
   }
-
-  while (entry.active_updates.load(std::memory_order_acquire) != 0) {
-    // spin
-    // TODO: Introduce a limit to detect and break
-    // deadlock
-  }
-
-  entry.count.store(0, std::memory_order_release);
   *count = c;
+  *weight = w;
   return num_frames;
 }
 
-void TraceMultiset::Add(int num_frames, CallFrame *frames, int64_t count) {
+void TraceMultiset::Add(int num_frames, const CallFrame *frames,
+                        int64_t count) {
   std::vector<CallFrame> trace(frames, frames + num_frames);
 
   auto entry = traces_.find(trace);
@@ -114,40 +277,326 @@ void TraceMultiset::Add(int num_frames, CallFrame *frames, int64_t count) {
   traces_.emplace(std::move(trace), count);
 }
 
-int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to) {
+DoubleBufferedTraceMultiset::DoubleBufferedTraceMultiset(
+    int64_t max_entries, int64_t max_arena_frames) {
+  for (Table &table : tables_) {
+    table.table = new AsyncSafeTraceMultiset(max_entries, max_arena_frames);
+  }
+  Reset();
+}
+
+void DoubleBufferedTraceMultiset::Reset() {
+  for (Table &table : tables_) {
+    table.table->Reset();
+    table.writers.store(0, std::memory_order_relaxed);
+  }
+  active_.store(0, std::memory_order_relaxed);
+  recycled_stats_ = TraceTableStats();
+}
+
+bool DoubleBufferedTraceMultiset::Add(const CallTrace *trace, int64_t count,
+                                      int64_t weight, uint64_t *hash) {
+  // Registers as a writer of the active table, then checks that the table is
+  // still active. If Flip() happened in between, it may not have seen this
+  // writer, so backs off and retries with the new active table. All
+  // operations on active_ and writers are sequentially consistent, which
+  // guarantees that Flip() sees any writer that passed the check.
+  int index;
+  while (true) {
+    index = active_.load();
+    tables_[index].writers.fetch_add(1);
+    if (active_.load() == index) {
+      break;
+    }
+    tables_[index].writers.fetch_sub(1);
+  }
+  bool added = tables_[index].table->Add(trace, count, weight, nullptr, hash);
+  tables_[index].writers.fetch_sub(1, std::memory_order_release);
+  return added;
+}
+
+AsyncSafeTraceMultiset *DoubleBufferedTraceMultiset::Flip() {
+  // An Add() operation only takes a few microseconds, unless the thread
+  // running it gets descheduled. Waits for up to 100 ms, polling every 10 us.
+  const struct timespec kPollInterval = {0, 10 * 1000};
+  const int kMaxPolls = 10 * 1000;
+
+  int previous = active_.load();
+  active_.store(1 - previous);
+  for (int i = 0; tables_[previous].writers.load() != 0; i++) {
+    if (i == kMaxPolls) {
+      return nullptr;
+    }
+    DefaultClock()->SleepFor(kPollInterval);
+  }
+  return tables_[previous].table;
+}
+
+void DoubleBufferedTraceMultiset::Recycle(AsyncSafeTraceMultiset *table) {
+  recycled_stats_.Merge(table->Stats());
+  table->Reset();
+}
+
+TraceTableStats DoubleBufferedTraceMultiset::Stats() const {
+  TraceTableStats stats = recycled_stats_;
+  for (const Table &table : tables_) {
+    stats.Merge(table.table->Stats());
+  }
+  return stats;
+}
+
+ShardedTraceMultiset::ShardedTraceMultiset(int64_t max_entries,
+                                           int64_t max_arena_frames,
+                                           int num_shards)
+    : max_entries_(max_entries),
+      max_arena_frames_(max_arena_frames),
+      num_shards_(num_shards < 1 ? 1
+                                 : (num_shards > kMaxShards ? kMaxShards
+                                                            : num_shards)) {
+  for (int i = 0; i < num_shards_; i++) {
+    shards_[i] = new DoubleBufferedTraceMultiset(max_entries, max_arena_frames);
+  }
+}
+
+ShardedTraceMultiset::~ShardedTraceMultiset() {
+  for (int i = 0; i < num_shards_; i++) {
+    delete shards_[i];
+  }
+}
+
+int ShardedTraceMultiset::DefaultNumShards() {
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  long num_cpus;  // NOLINT
+  if (sched_getaffinity(0, sizeof(cpus), &cpus) == 0) {
+    num_cpus = CPU_COUNT(&cpus);
+  } else {
+    // The mask doesn't fit in cpu_set_t on hosts with more than 1024 CPUs.
+    num_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (num_cpus < 1) {
+    return 1;
+  }
+  return num_cpus > kMaxShards ? kMaxShards : static_cast<int>(num_cpus);
+}
+
+void ShardedTraceMultiset::Reset() {
+  for (int i = 0; i < num_shards_; i++) {
+    shards_[i]->Reset();
+  }
+}
+
+bool ShardedTraceMultiset::Add(const CallTrace *trace, int64_t count,
+                               int64_t weight, uint64_t *hash) {
+  // sched_getcpu reads the CPU number from the vDSO without taking any lock.
+  // The thread may migrate right after, which only costs some contention.
+  int cpu = sched_getcpu();
+  int shard = cpu < 0 ? 0 : cpu % num_shards_;
+  return shards_[shard]->Add(trace, count, weight, hash);
+}
+
+TraceTableStats ShardedTraceMultiset::Stats() const {
+  TraceTableStats stats = TraceTableStats();
+  for (int i = 0; i < num_shards_; i++) {
+    stats.Merge(shards_[i]->Stats());
+  }
+  return stats;
+}
+
+void CallingContextTree::Add(int num_frames, const CallFrame *frames,
+                             int64_t count) {
+  AddValue(Insert(num_frames, frames), 0, count);
+}
+
+size_t CallingContextTree::Insert(int num_frames, const CallFrame *frames) {
+  uint32_t node = kRoot;
+  // Walks from the root frame, which is the last one, down to the leaf frame.
+  for (int i = num_frames - 1; i >= 0; i--) {
+    ChildKey key = {node, frames[i]};
+    auto child = children_.find(key);
+    if (child != children_.end()) {
+      node = child->second;
+      continue;
+    }
+    uint32_t new_node = nodes_.size();
+    nodes_.push_back(Node{frames[i], node, {0}});
+    children_.emplace(key, new_node);
+    node = new_node;
+  }
+  return node;
+}
+
+bool CallingContextTree::HasValues(size_t node) const {
+  for (int i = 0; i < kNumValues; i++) {
+    if (nodes_[node].values[i] != 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void CallingContextTree::Trace(size_t node,
+                               std::vector<CallFrame> *frames) const {
+  frames->clear();
+  for (; node != kRoot; node = nodes_[node].parent) {
+    frames->push_back(nodes_[node].frame);
+  }
+}
+
+void CallingContextTree::Clear() {
+  nodes_.clear();
+  children_.clear();
+  CallFrame root_frame = {kUnknown, 0, nullptr};
+  nodes_.push_back(Node{root_frame, kRoot, {0}});
+}
+
+namespace {
+
+// TraceMultiset only keeps counts.
+void AddHarvested(int num_frames, const CallFrame *frames, int64_t count,
+                  int64_t weight, TraceMultiset *to) {
+  (void)weight;
+  if (count > 0) {
+    to->Add(num_frames, frames, count);
+  }
+}
+
+// Counts go to the first value of the calling context tree, and weights to
+// the second one.
+void AddHarvested(int num_frames, const CallFrame *frames, int64_t count,
+                  int64_t weight, CallingContextTree *to) {
+  size_t node = to->Insert(num_frames, frames);
+  to->AddValue(node, 0, count);
+  to->AddValue(node, 1, weight);
+}
+
+template <typename Aggregate>
+int HarvestSamplesInto(AsyncSafeTraceMultiset *from, Aggregate *to) {
   int trace_count = 0;
-  int64_t num_traces = from->MaxEntries();
-  for (int64_t i = 0; i < num_traces; i++) {
-    CallFrame frame[kMaxFramesToCapture];
+  int64_t num_populated = from->NumPopulated();
+  for (int64_t i = 0; i < num_populated; i++) {
+    const CallFrame *frames;
     int64_t count;
+    int64_t weight;
 
-    int num_frames = from->Extract(i, kMaxFramesToCapture, &frame[0], &count);
-    if (num_frames > 0 && count > 0) {
+    int num_frames = from->ExtractPopulated(i, &frames, &count, &weight);
+    if (num_frames > 0) {
       ++trace_count;
-      to->Add(num_frames, &frame[0], count);
+      AddHarvested(num_frames, frames, count, weight, to);
     }
   }
   return trace_count;
 }
 
+}  // namespace
+
+int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to) {
+  return HarvestSamplesInto(from, to);
+}
+
+int HarvestSamples(AsyncSafeTraceMultiset *from, CallingContextTree *to) {
+  return HarvestSamplesInto(from, to);
+}
+
+int HarvestSamples(DoubleBufferedTraceMultiset *from, CallingContextTree *to) {
+  AsyncSafeTraceMultiset *drained = from->Flip();
+  if (drained == nullptr) {
+    return 0;
+  }
+  int trace_count = HarvestSamplesInto(drained, to);
+  from->Recycle(drained);
+  return trace_count;
+}
+
+int HarvestSamples(ShardedTraceMultiset *from, CallingContextTree *to) {
+  int trace_count = 0;
+  for (int i = 0; i < from->NumShards(); i++) {
+    trace_count += HarvestSamples(from->Shard(i), to);
+  }
+  return trace_count;
+}
+
+namespace {
+
+// Constants and rounds of xxHash64, see
+// https://github.com/Cyan4973/xxHash/blob/dev/doc/xxhash_spec.md.
+const uint64_t kPrime1 = 0x9E3779B185EBCA87ULL;
+const uint64_t kPrime2 = 0xC2B2AE3D27D4EB4FULL;
+const uint64_t kPrime3 = 0x165667B19E3779F9ULL;
+const uint64_t kPrime4 = 0x85EBCA77C2B2AE63ULL;
+const uint64_t kPrime5 = 0x27D4EB2F165667C5ULL;
+
+inline uint64_t RotateLeft(uint64_t value, int bits) {
+  return (value << bits) | (value >> (64 - bits));
+}
+
+inline uint64_t Round(uint64_t acc, uint64_t input) {
+  acc += input * kPrime2;
+  acc = RotateLeft(acc, 31);
+  return acc * kPrime1;
+}
+
+inline uint64_t MergeRound(uint64_t acc, uint64_t lane) {
+  acc ^= Round(0, lane);
+  return acc * kPrime1 + kPrime4;
+}
+
+// Packs a frame into one word. Code object pointers are at least 8-byte
+// aligned and use at most 48 bits, so the line number, or bytecode offset,
+// is folded into the otherwise constant high and low bits. The generation,
+// which is almost always small, is folded into the middle bits.
+inline uint64_t FrameWord(const CallFrame &frame) {
+  uint64_t lineno = static_cast<uint32_t>(frame.lineno);
+  uint64_t generation = static_cast<uint32_t>(frame.generation);
+  return reinterpret_cast<uintptr_t>(frame.py_code) ^ (lineno << 48) ^
+         (lineno >> 16) ^ (generation << 24);
+}
+
+}  // namespace
+
 uint64_t CalculateHash(int num_frames, const CallFrame *frame) {
-  uint64_t h = 0;
-  for (int i = 0; i < num_frames; i++) {
-    h += static_cast<uintptr_t>(frame[i].lineno);
-    h += h << 10;
-    h ^= h >> 6;
-    h += reinterpret_cast<uintptr_t>(frame[i].py_code);
-    h += h << 10;
-    h ^= h >> 6;
-  }
-  h += h << 3;
-  h ^= h >> 11;
+  // Frames are consumed one word at a time into four independent lanes, so
+  // that the multiplications of consecutive frames don't depend on each
+  // other and can be pipelined or vectorized.
+  uint64_t h;
+  int i = 0;
+  if (num_frames >= 4) {
+    uint64_t v1 = kPrime1 + kPrime2;
+    uint64_t v2 = kPrime2;
+    uint64_t v3 = 0;
+    uint64_t v4 = 0 - kPrime1;
+    for (; i + 4 <= num_frames; i += 4) {
+      v1 = Round(v1, FrameWord(frame[i]));
+      v2 = Round(v2, FrameWord(frame[i + 1]));
+      v3 = Round(v3, FrameWord(frame[i + 2]));
+      v4 = Round(v4, FrameWord(frame[i + 3]));
+    }
+    h = RotateLeft(v1, 1) + RotateLeft(v2, 7) + RotateLeft(v3, 12) +
+        RotateLeft(v4, 18);
+    h = MergeRound(h, v1);
+    h = MergeRound(h, v2);
+    h = MergeRound(h, v3);
+    h = MergeRound(h, v4);
+  } else {
+    h = kPrime5;
+  }
+  h += static_cast<uint64_t>(num_frames);
+  for (; i < num_frames; i++) {
+    h ^= Round(0, FrameWord(frame[i]));
+    h = RotateLeft(h, 27) * kPrime1 + kPrime4;
+  }
+  h ^= h >> 33;
+  h *= kPrime2;
+  h ^= h >> 29;
+  h *= kPrime3;
+  h ^= h >> 32;
   return h;
 }
 
 bool Equal(int num_frames, const CallFrame *f1, const CallFrame *f2) {
   for (int i = 0; i < num_frames; i++) {
-    if (f1[i].lineno != f2[i].lineno || f1[i].py_code != f2[i].py_code) {
+    if (f1[i].lineno != f2[i].lineno || f1[i].py_code != f2[i].py_code ||
+        f1[i].generation != f2[i].generation) {
       return false;
     }
   }
@@ -24,7 +24,15 @@
 #include <vector>
 
 typedef struct {
+  // Line number of the frame. On Python 3.11 and later, this is the bytecode
+  // offset of the frame's last instruction until the trace is symbolized, see
+  // PopulateFrames. When py_code is nullptr, this is a CallTraceErrors value.
+  // It is kNativeFrame for native frames, see native_stacks.h, kThreadFrame
+  // for thread frames and kLabelSetFrame for label set frames.
   int lineno;
+  // Generation of py_code, which tells apart code objects allocated at the
+  // same address, see CodeDeallocHook.
+  int generation;
   PyCodeObject *py_code;
 } CallFrame;
 
@@ -38,77 +46,350 @@ enum CallTraceErrors {
   kNoPyState = -1,
 };
 
-// Maximum number of frames to store from the stack traces sampled.
+// Line number of native frames, whose py_code holds a program counter rather
+// than a code object.
+const int kNativeFrame = -2;
+
+// Line number of thread frames, which identify the thread a trace was sampled
+// on rather than a function. A thread frame is the root frame of its trace.
+// Its generation holds the kernel thread ID, and its py_code holds the Python
+// thread identifier, as returned by threading.get_ident(), or 0 for a thread
+// without a Python thread state. See Profiler::EnableThreadLabels().
+const int kThreadFrame = -3;
+
+// Line number of label set frames, which hold the ID of the label set the
+// trace was sampled under as generation, see SampleLabels. A label set frame
+// comes right after the outermost Python or native frame of its trace, before
+// the thread frame if any.
+const int kLabelSetFrame = -4;
+
+// Returns the function name shown for frames with the given error.
+const char *CallTraceErrorToName(CallTraceErrors err);
+
+// Maximum number of frames to store from the stack traces sampled. The thread
+// and label set frames of a trace come on top of these.
 const int kMaxFramesToCapture = 128;
 
+// Size of a cache line. Atomics updated from different CPUs are kept this far
+// apart to avoid false sharing.
+const int kCacheLineSize = 64;
+
+// Returns a hash of the trace. It is async-safe.
 uint64_t CalculateHash(int num_frames, const CallFrame *frame);
 bool Equal(int num_frames, const CallFrame *f1, const CallFrame *f2);
 
+// Statistics of the Add() operations of an AsyncSafeTraceMultiset.
+struct TraceTableStats {
+  // Number of calls to Add().
+  int64_t add_count;
+  // Total number of entries probed by Add(). Divided by add_count, this is
+  // the average probe length.
+  int64_t probe_count;
+  // Largest number of entries probed by a single call to Add().
+  int64_t max_probe_length;
+  // Number of traces which couldn't be added because there was no free
+  // entry.
+  int64_t table_full_count;
+  // Number of traces which couldn't be added because there was no room left
+  // in the frame arena.
+  int64_t arena_full_count;
+
+  // Adds the statistics of other to these.
+  void Merge(const TraceTableStats &other);
+};
+
 // Multiset of stack traces. There is a maximum number of distinct
-// traces that can be held, return by MaxEntries();
+// traces that can be held, return by MaxEntries(), and a maximum number of
+// frames that can be held across all distinct traces, returned by
+// MaxArenaFrames().
 //
 // The Add() operation is async-safe, but will fail and return false
-// if there is no room to store the trace.
+// if there is no room to store the trace. The two reasons for failing are
+// counted separately, see TraceTableStats.
 //
-// The Extract() operation will remove a specific entry, and it can
+// The Extract() operation will take the count of a specific entry, and it can
 // run concurrently with multiple Add() operations. Multiple
 // invocations of Extract() cannot be executed concurrently.
 //
-// The synchronization is implemented by using a sentinel count value
-// to reserve entries. Add() will reserve the first available entry,
-// save the stack frame, and then release the entry for other calls to
-// Add() or Extract(). Extract() will reserve the entry, wait until no
-// additions are in progress, and then release the entry to be reused
-// by a subsequent call to Add(). It is important for Extract() to
-// wait until no additions are in progress to avoid releasing the
-// entry while another thread is inspecting it.
+// Frames are stored in a preallocated arena shared by all entries. Entries
+// only hold the offset and the length of their trace in the arena, so that a
+// shallow trace doesn't cost the space of the deepest possible one. Arena
+// space is handed out by bumping an atomic offset, and is only reclaimed by
+// Reset(). For that reason, once an entry is assigned a trace, it keeps that
+// trace until Reset(), and Extract() only takes its count. To reclaim entries
+// and arena space while collecting, use DoubleBufferedTraceMultiset.
+//
+// Entries are appended to a populated list the first time they are published,
+// so that harvesting and resetting the set only visit populated entries
+// rather than the whole table, see NumPopulated() and ExtractPopulated().
+//
+// The synchronization is implemented by using a per-entry state.
+// Add() will reserve the first empty entry by moving it to the locked state,
+// save the stack frames, and then publish the entry by moving it to the
+// ready state. A ready entry is never modified except for its count, so
+// Add() and Extract() can read its frames without further synchronization.
 class AsyncSafeTraceMultiset {
  public:
-  AsyncSafeTraceMultiset() { Reset(); }
+  // Default maximum number of distinct traces.
+  static const int64_t kDefaultMaxEntries = 2048;
+
+  // Default number of frames in the arena, which is enough for all entries
+  // to hold a trace of 32 frames.
+  static const int64_t kDefaultMaxArenaFrames = kDefaultMaxEntries * 32;
+
+  AsyncSafeTraceMultiset(int64_t max_entries = kDefaultMaxEntries,
+                         int64_t max_arena_frames = kDefaultMaxArenaFrames);
   // Not copyable or assignable.
   AsyncSafeTraceMultiset(const AsyncSafeTraceMultiset &) = delete;
   AsyncSafeTraceMultiset &operator=(const AsyncSafeTraceMultiset &) = delete;
 
-  void Reset() { memset(traces_, 0, sizeof(traces_)); }
+  ~AsyncSafeTraceMultiset();
 
-  // Adds a trace to the set. If it is already present, increments its
-  // count. This operation is thread safe and async safe.
-  bool Add(const CallTrace *trace);
+  // Empties the set and the frame arena. This must not be called concurrently
+  // with any other operation.
+  void Reset();
+
+  // Adds a trace to the set. If it is already present, adds count and weight
+  // to its count and weight. If location is not nullptr, it's assigned the
+  // location of the entry holding the trace, see Frames(). If hash is not
+  // nullptr, it's assigned the hash of the trace, see CalculateHash(), even
+  // if the trace couldn't be added. This operation is thread safe and async
+  // safe.
+  bool Add(const CallTrace *trace, int64_t count = 1, int64_t weight = 0,
+           int64_t *location = nullptr, uint64_t *hash = nullptr);
 
   // Extracts a trace from the array. frames must point to at least
   // max_frames contiguous frames. It will return the number of frames
   // written starting at frames[0], up to max_frames. Returns 0 if
-  // there is no valid trace at this location.  This operation is
-  // thread safe with respect to Add() but only a single call to
-  // Extract can be done at a time.
-  int Extract(int location, int max_frames, CallFrame *frames, int64_t *count);
+  // there is no valid trace at this location, or if the trace wasn't seen
+  // since the previous call to Extract(). count and weight are assigned what
+  // was added since then. This operation is thread safe with respect to Add()
+  // but only a single call to Extract can be done at a time.
+  int Extract(int location, int max_frames, CallFrame *frames, int64_t *count,
+              int64_t *weight);
+
+  // Returns the number of entries appended to the populated list since the
+  // last Reset(). This operation is thread safe with respect to Add().
+  int64_t NumPopulated() const {
+    return num_populated_.load(std::memory_order_acquire);
+  }
+
+  // Same as Extract(), but takes the n-th entry of the populated list, with
+  // n < NumPopulated(), and returns its frames in place instead of copying
+  // them. The frames stay valid until the next Reset().
+  int ExtractPopulated(int64_t n, const CallFrame **frames, int64_t *count,
+                       int64_t *weight);
+
+  // Returns the number of frames of the trace at the location returned by
+  // Add(), and points frames to them, without taking its count. Returns 0 if
+  // the location holds no trace. The frames stay valid until the next
+  // Reset().
+  int Frames(int64_t location, const CallFrame **frames) const;
+
+  int64_t MaxEntries() const { return max_entries_; }
+
+  int64_t MaxArenaFrames() const { return max_arena_frames_; }
 
-  int64_t MaxEntries() const { return kMaxStackTraces; }
+  // Returns the statistics of the Add() operations since the last Reset().
+  TraceTableStats Stats() const;
 
  private:
   struct TraceData {
-    // trace contains the frame count and a pointer to the frames. The
-    // frames are stored in frame_buffer.
-    CallTrace trace;
-    // frame_buffer is the storage for stack frames.
-    CallFrame frame_buffer[kMaxFramesToCapture];
-    // Number of times a trace has been encountered.
-    // 0 indicates that the trace is unused,
-    // <0 values are reserved, used for concurrency control.
+    // Hash of the trace, compared before the frames when probing.
+    uint64_t hash;
+    // Offset of the first frame of the trace in frame_arena_.
+    int64_t offset;
+    // Number of frames of the trace.
+    int num_frames;
+    // One of the entry states below.
+    std::atomic<int> state;
+    // Number of times a trace has been encountered since the last Extract().
     std::atomic<int64_t> count;
-    // Number of active attempts to increase the counter on the trace.
-    std::atomic<int> active_updates;
+    // Sum of the weights the trace was added with since the last Extract().
+    std::atomic<int64_t> weight;
+    // Pads the entry to a full cache line, so that updating the count of a
+    // hot trace doesn't invalidate its neighbours.
+    char padding[kCacheLineSize - 40];
   };
 
-  // TODO: Re-evaluate MaxStackTraces, to minimize storage
-  // consumption while maintaining good performance and avoiding
-  // overflow.
-  static const int kMaxStackTraces = 2048;
+  // The entry holds no trace.
+  static const int kEntryEmpty = 0;
+  // The entry is reserved by Add(), and its frames are being written.
+  static const int kEntryLocked = 1;
+  // The entry holds a trace, which will not change until Reset().
+  static const int kEntryReady = 2;
+
+  const int64_t max_entries_;
+  const int64_t max_arena_frames_;
+
+  // traces_ points into traces_storage_, aligned on a cache line.
+  char *traces_storage_;
+  TraceData *traces_;
+  CallFrame *frame_arena_;
+
+  // Indices in traces_ of the entries published since the last Reset(), in
+  // the order they were published. A slot holds kNotPopulated until the Add()
+  // which reserved it stores the index.
+  static const int64_t kNotPopulated = -1;
+  std::atomic<int64_t> *populated_;
+
+  // The counters below are updated by Add(). The padding around them keeps
+  // them off the cache lines of other objects, such as other shards of a
+  // ShardedTraceMultiset.
+  char leading_padding_[kCacheLineSize];
+
+  std::atomic<int64_t> num_populated_;
+
+  // Number of frames of frame_arena_ handed out since the last Reset(). It may
+  // exceed max_arena_frames_ once the arena is full.
+  std::atomic<int64_t> arena_used_;
+
+  // Returns the entry at location to the empty state.
+  void ClearEntry(int64_t location);
+
+  // Records the number of entries probed by a call to Add().
+  void RecordProbeLength(int64_t probe_length);
+
+  std::atomic<int64_t> table_full_count_;
+  std::atomic<int64_t> arena_full_count_;
+
+  std::atomic<int64_t> add_count_;
+  std::atomic<int64_t> probe_count_;
+  std::atomic<int64_t> max_probe_length_;
+
+  char trailing_padding_[kCacheLineSize];
+};
+
+// DoubleBufferedTraceMultiset holds two AsyncSafeTraceMultisets. Add() records
+// traces into the active one, while the other one is drained and reset. Flip()
+// swaps the two tables, and waits for the Add() operations still using the
+// previously active table to complete, so that it can be drained without any
+// contention with Add(). Entries and frame arena space of the drained table
+// are then reclaimed by Recycle(), so the capacity of a table bounds the
+// number of distinct traces added between two calls to Flip().
+//
+// Add() is async-safe. Flip() and Recycle() must be called by a single thread
+// at a time.
+class DoubleBufferedTraceMultiset {
+ public:
+  DoubleBufferedTraceMultiset(
+      int64_t max_entries = AsyncSafeTraceMultiset::kDefaultMaxEntries,
+      int64_t max_arena_frames = AsyncSafeTraceMultiset::kDefaultMaxArenaFrames);
+  // Not copyable or assignable.
+  DoubleBufferedTraceMultiset(const DoubleBufferedTraceMultiset &) = delete;
+  DoubleBufferedTraceMultiset &operator=(const DoubleBufferedTraceMultiset &) =
+      delete;
+
+  // Empties both tables and clears the statistics. This must not be called
+  // concurrently with any other operation.
+  void Reset();
+
+  // Adds a trace to the active table, see AsyncSafeTraceMultiset::Add(). This
+  // operation is thread safe and async safe.
+  bool Add(const CallTrace *trace, int64_t count = 1, int64_t weight = 0,
+           uint64_t *hash = nullptr);
+
+  // Makes the other table active, and waits for the Add() operations using
+  // the previously active table to complete. Returns the previously active
+  // table, which no Add() operation uses until the next call to Flip(), or
+  // nullptr if the wait timed out. In the latter case, the table is left as
+  // is, and will be returned by a later call.
+  AsyncSafeTraceMultiset *Flip();
+
+  // Resets a table returned by Flip() after it is drained, and accumulates
+  // its statistics.
+  void Recycle(AsyncSafeTraceMultiset *table);
+
+  int64_t MaxEntries() const { return tables_[0].table->MaxEntries(); }
+
+  int64_t MaxArenaFrames() const { return tables_[0].table->MaxArenaFrames(); }
+
+  // Returns the statistics of the Add() operations since the last Reset().
+  // It should be called when no Add() is in progress.
+  TraceTableStats Stats() const;
+
+ private:
+  struct Table {
+    AsyncSafeTraceMultiset *table;
+    // Number of Add() operations in progress on the table.
+    std::atomic<int> writers;
+  };
+
+  // Keeps writers and active_ off the cache lines of other objects, as for
+  // the counters of AsyncSafeTraceMultiset.
+  char leading_padding_[kCacheLineSize];
+  Table tables_[2];
+  // Index of the active table in tables_.
+  std::atomic<int> active_;
+  char trailing_padding_[kCacheLineSize];
+  // Statistics of the recycled tables.
+  TraceTableStats recycled_stats_;
+};
+
+// ShardedTraceMultiset spreads traces over several DoubleBufferedTraceMultiset
+// shards, picking the shard of the CPU that Add() runs on. Threads running on
+// different CPUs then update different entries and counters, so that the cost
+// of sampling doesn't grow with the number of cores running Python code, as
+// with free-threaded builds. The same trace may be held by several shards;
+// harvesting merges them.
+//
+// Each shard has the full capacity, so that a process whose samples all land
+// on one CPU holds as many traces as with a single table. Memory then grows
+// with the number of shards, which is bounded by the CPUs the process may
+// run on.
+//
+// Add() is async-safe. Other operations follow DoubleBufferedTraceMultiset.
+class ShardedTraceMultiset {
+ public:
+  // Maximum number of shards.
+  static const int kMaxShards = 16;
+
+  // max_entries and max_arena_frames are the capacity of each shard. By
+  // default, there is one shard per CPU the process may run on, up to
+  // kMaxShards.
+  ShardedTraceMultiset(
+      int64_t max_entries = AsyncSafeTraceMultiset::kDefaultMaxEntries,
+      int64_t max_arena_frames = AsyncSafeTraceMultiset::kDefaultMaxArenaFrames,
+      int num_shards = DefaultNumShards());
+  // Not copyable or assignable.
+  ShardedTraceMultiset(const ShardedTraceMultiset &) = delete;
+  ShardedTraceMultiset &operator=(const ShardedTraceMultiset &) = delete;
+
+  ~ShardedTraceMultiset();
+
+  // Returns the number of CPUs in the affinity mask of the process, capped at
+  // kMaxShards. A process confined to a few CPUs of a large host, as in a
+  // container, gets as few shards.
+  static int DefaultNumShards();
+
+  // Empties all shards and clears the statistics. This must not be called
+  // concurrently with any other operation.
+  void Reset();
+
+  // Adds a trace to the shard of the current CPU, see
+  // AsyncSafeTraceMultiset::Add(). This operation is thread safe and async
+  // safe.
+  bool Add(const CallTrace *trace, int64_t count = 1, int64_t weight = 0,
+           uint64_t *hash = nullptr);
+
+  int NumShards() const { return num_shards_; }
+
+  DoubleBufferedTraceMultiset *Shard(int i) { return shards_[i]; }
+
+  // Returns the capacity of each shard.
+  int64_t MaxEntries() const { return max_entries_; }
 
-  // Sentinel to use as trace count while the frames are being updated.
-  static const int64_t kTraceCountLocked = -1;
+  int64_t MaxArenaFrames() const { return max_arena_frames_; }
 
-  TraceData traces_[kMaxStackTraces];
+  // Returns the statistics of all shards, see
+  // DoubleBufferedTraceMultiset::Stats().
+  TraceTableStats Stats() const;
+
+ private:
+  const int64_t max_entries_;
+  const int64_t max_arena_frames_;
+  const int num_shards_;
+  DoubleBufferedTraceMultiset *shards_[kMaxShards];
 };
 
 // TraceMultiset implements a growable multi-set of traces. It is not
@@ -146,7 +427,7 @@ class TraceMultiset {
 
   // Add a trace to the array. If it is already in the array,
   // increment its count.
-  void Add(int num_frames, CallFrame *frames, int64_t count);
+  void Add(int num_frames, const CallFrame *frames, int64_t count);
 
   typedef CountMap::iterator iterator;
   typedef CountMap::const_iterator const_iterator;
@@ -165,10 +446,110 @@ class TraceMultiset {
   CountMap traces_;
 };
 
+// CallingContextTree is a growable multiset of traces stored as a trie of
+// frames, from the root frame to the leaf frame, with the count of each trace
+// held by the node of its leaf frame. Traces sharing a common prefix of root
+// frames share the nodes of that prefix, so memory grows with the number of
+// distinct calling contexts rather than with depth times the number of
+// distinct traces. Like TraceMultiset, it is not thread or async safe.
+//
+// Nodes are identified by their index. The root node, at index kRoot, holds
+// no frame; its count is the count of empty traces. A node is always created
+// after its parent, so its index is greater than its parent's.
+class CallingContextTree {
+ public:
+  static const size_t kRoot = 0;
+
+  CallingContextTree() { Clear(); }
+  // Not copyable or assignable.
+  CallingContextTree(const CallingContextTree &) = delete;
+  CallingContextTree &operator=(const CallingContextTree &) = delete;
+
+  // Number of values held by each node. Their meaning is up to the user of
+  // the tree. HarvestSamples() adds counts to the first value and weights to
+  // the second one.
+  static const int kNumValues = 4;
+
+  // Adds a trace to the tree. The leaf frame is at frames[0]. If the trace is
+  // already in the tree, increments its count, which is its first value.
+  void Add(int num_frames, const CallFrame *frames, int64_t count);
+
+  // Adds a trace to the tree if it's not already in it, and returns the node
+  // holding its leaf frame.
+  size_t Insert(int num_frames, const CallFrame *frames);
+
+  void AddValue(size_t node, int index, int64_t value) {
+    nodes_[node].values[index] += value;
+  }
+
+  int64_t Value(size_t node, int index) const {
+    return nodes_[node].values[index];
+  }
+
+  // Returns whether any value of the node is not zero.
+  bool HasValues(size_t node) const;
+
+  // Returns the number of nodes, including the root node.
+  size_t NumNodes() const { return nodes_.size(); }
+
+  const CallFrame &Frame(size_t node) const { return nodes_[node].frame; }
+
+  size_t Parent(size_t node) const { return nodes_[node].parent; }
+
+  // Returns the count of the trace whose leaf frame is held by node.
+  uint64_t Count(size_t node) const { return nodes_[node].values[0]; }
+
+  // Replaces the content of frames with the trace whose leaf frame is held by
+  // node. The leaf frame is at frames[0].
+  void Trace(size_t node, std::vector<CallFrame> *frames) const;
+
+  void Clear();
+
+ private:
+  struct Node {
+    CallFrame frame;
+    uint32_t parent;
+    int64_t values[kNumValues];
+  };
+
+  struct ChildKey {
+    uint32_t parent;
+    CallFrame frame;
+  };
+
+  struct ChildKeyHash {
+    std::size_t operator()(const ChildKey &key) const {
+      return CalculateHash(1, &key.frame) ^ key.parent;
+    }
+  };
+
+  struct ChildKeyEqual {
+    bool operator()(const ChildKey &k1, const ChildKey &k2) const {
+      return k1.parent == k2.parent && Equal(1, &k1.frame, &k2.frame);
+    }
+  };
+
+  std::vector<Node> nodes_;
+  // Maps a parent node and a frame to the child node holding that frame.
+  std::unordered_map<ChildKey, uint32_t, ChildKeyHash, ChildKeyEqual>
+      children_;
+};
+
 // HarvestSamples extracts traces from an asyncsafe trace multiset
 // and copies them into a trace multiset. It returns the number of samples
 // that were copied. This is thread-safe with respect to other threads adding
 // samples into the asyncsafe set.
 int HarvestSamples(AsyncSafeTraceMultiset *from, TraceMultiset *to);
 
+// Same as above, but copies the traces into a calling context tree.
+int HarvestSamples(AsyncSafeTraceMultiset *from, CallingContextTree *to);
+
+// Flips the tables of a double-buffered multiset, then extracts the traces
+// from the previously active table into a calling context tree and recycles
+// it. Returns the number of traces that were copied.
+int HarvestSamples(DoubleBufferedTraceMultiset *from, CallingContextTree *to);
+
+// Harvests every shard of a sharded multiset, as above.
+int HarvestSamples(ShardedTraceMultiset *from, CallingContextTree *to);
+
 #endif  // GOOGLECLOUDPROFILER_SRC_STACKTRACES_H_
@@ -0,0 +1,52 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "string_arena.h"
+
+#include <string.h>
+
+ArenaString StringArena::Add(const char *data, size_t size) {
+  char *dest;
+  if (size > kChunkSize) {
+    // Inserted before the last chunk, so that the last chunk keeps its free
+    // space.
+    dest = new char[size];
+    chunks_.emplace(chunks_.end() - (chunks_.empty() ? 0 : 1), dest);
+  } else {
+    if (used_ + size > kChunkSize) {
+      chunks_.emplace_back(new char[kChunkSize]);
+      used_ = 0;
+    }
+    dest = chunks_.back().get() + used_;
+    used_ += size;
+  }
+  if (size > 0) {
+    memcpy(dest, data, size);
+  }
+  ArenaString result = {dest, size};
+  return result;
+}
+
+void StringArena::Clear() {
+  if (chunks_.empty()) {
+    return;
+  }
+  // The first chunk may be one of the oversized chunks, so keep the last one,
+  // which always has the regular size.
+  if (chunks_.size() > 1) {
+    chunks_.front() = std::move(chunks_.back());
+    chunks_.resize(1);
+  }
+  used_ = 0;
+}
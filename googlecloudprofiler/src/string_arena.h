@@ -0,0 +1,57 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLECLOUDPROFILER_SRC_STRING_ARENA_H_
+#define GOOGLECLOUDPROFILER_SRC_STRING_ARENA_H_
+
+#include <stddef.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+// A string stored in a StringArena. It stays valid until the arena is cleared.
+struct ArenaString {
+  const char *data;
+  size_t size;
+
+  std::string ToString() const { return std::string(data, size); }
+};
+
+// StringArena copies strings into large chunks of memory, so that storing a
+// string only allocates when the current chunk is full. Chunks never move, so
+// the strings keep their address until Clear(). It is not thread safe.
+class StringArena {
+ public:
+  // Size of the chunks. Longer strings get a chunk of their own.
+  static const size_t kChunkSize = 64 * 1024;
+
+  StringArena() : used_(kChunkSize) {}
+  // Not copyable or assignable.
+  StringArena(const StringArena &) = delete;
+  StringArena &operator=(const StringArena &) = delete;
+
+  // Copies size bytes from data into the arena.
+  ArenaString Add(const char *data, size_t size);
+
+  // Releases all strings, keeping the first chunk for reuse.
+  void Clear();
+
+ private:
+  std::vector<std::unique_ptr<char[]>> chunks_;
+  // Number of bytes used in the last chunk.
+  size_t used_;
+};
+
+#endif  // GOOGLECLOUDPROFILER_SRC_STRING_ARENA_H_
@@ -0,0 +1,253 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "symbol_table.h"
+
+#include <sys/types.h>
+
+#include <cstdio>
+#include <string>
+
+#include "native_stacks.h"
+#include "populate_frames.h"
+#include "profiler.h"
+
+namespace {
+
+// Returns the name of the Python thread with the given identifier, as known to
+// the threading module, or an empty string.
+std::string PythonThreadName(uintptr_t ident) {
+  std::string name;
+  // Threads are only named once threading is imported, so it's not imported
+  // here.
+  PyObject *module_name = PyUnicode_FromString("threading");
+  PyObject *threading =
+      module_name != nullptr ? PyImport_GetModule(module_name) : nullptr;
+  Py_XDECREF(module_name);
+  if (threading == nullptr) {
+    PyErr_Clear();
+    return name;
+  }
+  // Maps the identifiers of the running threads to their Thread objects.
+  PyObject *active = PyObject_GetAttrString(threading, "_active");
+  PyObject *key = PyLong_FromUnsignedLongLong(ident);
+  PyObject *thread = active != nullptr && key != nullptr && PyDict_Check(active)
+                         ? PyDict_GetItem(active, key)
+                         : nullptr;
+  PyObject *py_name =
+      thread != nullptr ? PyObject_GetAttrString(thread, "name") : nullptr;
+  const char *utf8 = py_name != nullptr && PyUnicode_Check(py_name)
+                         ? PyUnicode_AsUTF8(py_name)
+                         : nullptr;
+  if (utf8 != nullptr) {
+    name = utf8;
+  }
+  PyErr_Clear();
+  Py_XDECREF(py_name);
+  Py_XDECREF(key);
+  Py_XDECREF(active);
+  Py_DECREF(threading);
+  return name;
+}
+
+// Returns the kernel's name of the thread with the given ID, or an empty
+// string if the thread exited.
+std::string KernelThreadName(pid_t tid) {
+  char path[64];
+  snprintf(path, sizeof(path), "/proc/self/task/%d/comm", tid);
+  FILE *file = fopen(path, "r");
+  if (file == nullptr) {
+    return "";
+  }
+  char comm[64] = "";
+  if (fgets(comm, sizeof(comm), file) == nullptr) {
+    comm[0] = '\0';
+  }
+  fclose(file);
+  std::string name(comm);
+  if (!name.empty() && name.back() == '\n') {
+    name.pop_back();
+  }
+  return name;
+}
+
+}  // namespace
+
+SymbolTable::Symbol SymbolTable::Resolve(const CallFrame &frame) {
+  Symbol symbol;
+  if (frame.lineno == kThreadFrame) {
+    return ResolveThread(frame);
+  }
+  if (frame.lineno == kLabelSetFrame) {
+    symbol.name = Intern("");
+    symbol.filename = Intern("");
+    symbol.line = frame.generation;
+    return symbol;
+  }
+  if (frame.py_code == nullptr) {
+    symbol.name = Intern(
+        CallTraceErrorToName(static_cast<CallTraceErrors>(frame.lineno)));
+    symbol.filename = Intern("");
+    symbol.line = frame.lineno;
+    return symbol;
+  }
+  if (frame.lineno == kNativeFrame) {
+    return ResolveNative(NativeFramePC(frame));
+  }
+  if (!CodeDeallocHook::IsCurrent(frame.generation)) {
+    // The frame was sampled before CodeDeallocHook forgot the code objects
+    // deallocated so far, so its code object may be gone.
+    CallFrame unknown = {kUnknown, 0, nullptr};
+    return Resolve(unknown);
+  }
+
+  // All sampled PyCodeObjects deallocated during profiling should be recorded
+  // by CodeDeallocHook, under the generation stored in the frame. As we are
+  // holding GIL, no deallocation can happen elsewhere now. It's safe to
+  // assume that a PyCodeObject pointer and generation not recorded by
+  // CodeDeallocHook point to a live object.
+  CallFrame code_key = {0, frame.generation, frame.py_code};
+  auto deallocated = deallocated_code_.find(code_key);
+  if (deallocated == deallocated_code_.end()) {
+    FuncLoc func_loc;
+    if (CodeDeallocHook::Find(frame.py_code, frame.generation, &func_loc)) {
+      DeallocatedCode code;
+      code.code.name = Intern(func_loc.name);
+      code.code.filename = Intern(func_loc.filename);
+      code.linetable = std::move(func_loc.linetable);
+      code.firstlineno = func_loc.firstlineno;
+      deallocated = deallocated_code_.emplace(code_key, std::move(code)).first;
+    }
+  }
+  if (deallocated != deallocated_code_.end()) {
+    const DeallocatedCode &code = deallocated->second;
+    symbol.name = code.code.name;
+    symbol.filename = code.code.filename;
+    symbol.line = FrameLineNumberFromTable(code.linetable, code.firstlineno,
+                                           frame.lineno);
+    return symbol;
+  }
+
+  auto live = live_code_.find(frame.py_code);
+  if (live == live_code_.end()) {
+    FuncLoc func_loc;
+    GetFuncLoc(frame.py_code, &func_loc);
+    Code code;
+    code.name = Intern(func_loc.name);
+    code.filename = Intern(func_loc.filename);
+    Py_INCREF(frame.py_code);
+    live = live_code_.emplace(frame.py_code, code).first;
+  }
+  symbol.name = live->second.name;
+  symbol.filename = live->second.filename;
+  CallFrame line_key = {frame.lineno, 0, frame.py_code};
+  auto known_line = live_lines_.find(line_key);
+  if (known_line == live_lines_.end()) {
+    known_line =
+        live_lines_
+            .emplace(line_key, FrameLineNumber(frame.py_code, frame.lineno))
+            .first;
+  }
+  symbol.line = known_line->second;
+  return symbol;
+}
+
+void SymbolTable::EndCollection() {
+  deallocated_code_.clear();
+  if (strings_.size() > kMaxStrings) {
+    Clear();
+    return;
+  }
+  bool released = false;
+  for (auto it = live_code_.begin(); it != live_code_.end();) {
+    if (Py_REFCNT(it->first) == 1) {
+      Py_DECREF(it->first);
+      it = live_code_.erase(it);
+      released = true;
+    } else {
+      ++it;
+    }
+  }
+  if (released) {
+    for (auto it = live_lines_.begin(); it != live_lines_.end();) {
+      if (live_code_.count(it->first.py_code) == 0) {
+        it = live_lines_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+  }
+}
+
+SymbolTable::Symbol SymbolTable::ResolveNative(uintptr_t pc) {
+  auto known = native_code_.find(pc);
+  if (known != native_code_.end()) {
+    return known->second;
+  }
+  if (native_symbolizer_ == nullptr) {
+    native_symbolizer_.reset(new NativeSymbolizer());
+  }
+  std::string name, filename;
+  if (!native_symbolizer_->Resolve(pc, &name, &filename)) {
+    char address[32];
+    snprintf(address, sizeof(address), "0x%llx",
+             static_cast<unsigned long long>(pc));  // NOLINT
+    name = address;
+  }
+  Symbol symbol;
+  symbol.name = Intern(name);
+  symbol.filename = Intern(filename);
+  symbol.line = 0;
+  native_code_.emplace(pc, symbol);
+  return symbol;
+}
+
+SymbolTable::Symbol SymbolTable::ResolveThread(const CallFrame &frame) {
+  std::string name;
+  uintptr_t ident = reinterpret_cast<uintptr_t>(frame.py_code);
+  if (ident != 0) {
+    name = PythonThreadName(ident);
+  }
+  if (name.empty() && frame.generation != 0) {
+    name = KernelThreadName(frame.generation);
+  }
+  Symbol symbol;
+  symbol.name = Intern(name);
+  symbol.filename = Intern("");
+  symbol.line = frame.generation;
+  return symbol;
+}
+
+uint32_t SymbolTable::Intern(const std::string &value) {
+  auto inserted = string_ids_.emplace(value, strings_.size());
+  if (inserted.second) {
+    // Keys of an unordered_map are not moved on rehash, so it's safe to keep
+    // pointers to them.
+    strings_.push_back(&inserted.first->first);
+  }
+  return inserted.first->second;
+}
+
+void SymbolTable::Clear() {
+  for (const auto &code : live_code_) {
+    Py_DECREF(code.first);
+  }
+  live_code_.clear();
+  live_lines_.clear();
+  deallocated_code_.clear();
+  native_code_.clear();
+  // Mappings and symbols are kept, they don't depend on collections.
+  string_ids_.clear();
+  strings_.clear();
+}
@@ -0,0 +1,135 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLECLOUDPROFILER_SRC_SYMBOL_TABLE_H_
+#define GOOGLECLOUDPROFILER_SRC_SYMBOL_TABLE_H_
+
+#include <Python.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "native_stacks.h"
+#include "stacktraces.h"
+
+// SymbolTable resolves sampled frames to interned function names, filenames
+// and line numbers. It outlives collections, so that the code objects seen by
+// one collection don't need to be resolved again by the next one.
+//
+// The table holds a reference to each live code object it resolved, which
+// guarantees that a code object pointer it knows still refers to the same
+// code object. Code objects which are only referenced by the table are
+// released by EndCollection().
+//
+// It is not thread safe. All methods must be called when GIL is held.
+class SymbolTable {
+ public:
+  // A resolved frame. name and filename are string IDs, see String().
+  struct Symbol {
+    uint32_t name;
+    uint32_t filename;
+    int line;
+  };
+
+  SymbolTable() {}
+  // Not copyable or assignable.
+  SymbolTable(const SymbolTable &) = delete;
+  SymbolTable &operator=(const SymbolTable &) = delete;
+
+  // Resolves a frame. It must be called while the CodeDeallocHook of the
+  // collection which sampled the frame is in scope, so that frames of code
+  // objects deallocated since can be resolved.
+  //
+  // A thread frame resolves to the name of the thread and its kernel thread
+  // ID as line, see ResolveThread(). A label set frame resolves to its label
+  // set ID as line.
+  Symbol Resolve(const CallFrame &frame);
+
+  // Returns the string of the given ID.
+  const std::string &String(uint32_t id) const { return *strings_[id]; }
+
+  // Forgets the code objects deallocated during the collection, and releases
+  // the code objects which are only referenced by the table. Everything is
+  // forgotten when the table grows past kMaxStrings strings.
+  void EndCollection();
+
+ private:
+  // Bounds the memory held by the table, which otherwise grows with the
+  // number of distinct functions ever sampled.
+  static const size_t kMaxStrings = 1 << 16;
+
+  struct Code {
+    uint32_t name;
+    uint32_t filename;
+  };
+
+  // A code object deallocated during the collection. Its line table was
+  // copied by CodeDeallocHook.
+  struct DeallocatedCode {
+    Code code;
+    std::string linetable;
+    int firstlineno;
+  };
+
+  struct FrameHash {
+    std::size_t operator()(const CallFrame &frame) const {
+      return CalculateHash(1, &frame);
+    }
+  };
+
+  struct FrameEqual {
+    bool operator()(const CallFrame &f1, const CallFrame &f2) const {
+      return Equal(1, &f1, &f2);
+    }
+  };
+
+  // Resolves the program counter of a native frame.
+  Symbol ResolveNative(uintptr_t pc);
+
+  // Resolves a thread frame. The name is the one given by the threading
+  // module, or the kernel's name of the thread, from /proc/self/task/*/comm,
+  // for threads unknown to threading. Names are not cached, as a thread can
+  // be renamed and thread IDs are reused. The name is empty for a thread
+  // which already exited.
+  Symbol ResolveThread(const CallFrame &frame);
+
+  // Finds the string ID, adds the string if not yet exists.
+  uint32_t Intern(const std::string &value);
+
+  // Releases all code objects and strings.
+  void Clear();
+
+  std::unordered_map<std::string, uint32_t> string_ids_;
+  std::vector<const std::string *> strings_;
+
+  // Live code objects, each holding a reference.
+  std::unordered_map<PyCodeObject *, Code> live_code_;
+  // Line numbers of the frames of live code objects, keyed by frames with
+  // generation set to 0, as a held code object can't be deallocated.
+  std::unordered_map<CallFrame, int, FrameHash, FrameEqual> live_lines_;
+  // Code objects deallocated during the collection, keyed by frames with
+  // lineno set to 0.
+  std::unordered_map<CallFrame, DeallocatedCode, FrameHash, FrameEqual>
+      deallocated_code_;
+  // Symbols of the native program counters. Native code is assumed not to be
+  // unloaded while profiling.
+  std::unordered_map<uintptr_t, Symbol> native_code_;
+  // Created on the first native frame.
+  std::unique_ptr<NativeSymbolizer> native_symbolizer_;
+};
+
+#endif  // GOOGLECLOUDPROFILER_SRC_SYMBOL_TABLE_H_
@@ -0,0 +1,148 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#include "timeline.h"
+
+namespace {
+
+uint64_t RoundUpToPowerOf2(int64_t value) {
+  uint64_t power = 1;
+  while (power < static_cast<uint64_t>(value)) {
+    power <<= 1;
+  }
+  return power;
+}
+
+void PutZigZag(int64_t value, std::string *out) {
+  PutVarint((static_cast<uint64_t>(value) << 1) ^
+                static_cast<uint64_t>(value >> 63),
+            out);
+}
+
+}  // namespace
+
+SampleTimeline::SampleTimeline(int64_t max_capacity)
+    : num_slots_(RoundUpToPowerOf2(max_capacity)),
+      slots_(new Slot[num_slots_]) {
+  Reset(max_capacity);
+}
+
+SampleTimeline::~SampleTimeline() { delete[] slots_; }
+
+void SampleTimeline::Reset(int64_t capacity) {
+  uint64_t mask = RoundUpToPowerOf2(capacity) - 1;
+  if (mask >= num_slots_) {
+    mask = num_slots_ - 1;
+  }
+  for (uint64_t i = 0; i <= mask; i++) {
+    slots_[i].sequence.store(0, std::memory_order_relaxed);
+  }
+  mask_.store(mask, std::memory_order_relaxed);
+  next_.store(0, std::memory_order_release);
+}
+
+void SampleTimeline::Append(int64_t timestamp_nanos, pid_t tid,
+                            uint64_t trace_hash) {
+  uint64_t index = next_.fetch_add(1, std::memory_order_relaxed);
+  Slot &slot = slots_[index & mask_.load(std::memory_order_relaxed)];
+  slot.sequence.store(0, std::memory_order_relaxed);
+  // Orders the store above before the stores of the fields, so that a reader
+  // which sees the new fields also sees the sequence number change.
+  std::atomic_thread_fence(std::memory_order_release);
+  slot.timestamp_nanos.store(timestamp_nanos, std::memory_order_relaxed);
+  slot.tid.store(tid, std::memory_order_relaxed);
+  slot.trace_hash.store(trace_hash, std::memory_order_relaxed);
+  slot.sequence.store(index + 1, std::memory_order_release);
+}
+
+int64_t SampleTimeline::Read(std::vector<Record> *records) const {
+  records->clear();
+  uint64_t mask = mask_.load(std::memory_order_relaxed);
+  uint64_t end = next_.load(std::memory_order_acquire);
+  uint64_t begin = end > mask + 1 ? end - (mask + 1) : 0;
+  records->reserve(end - begin);
+  for (uint64_t index = begin; index < end; index++) {
+    const Slot &slot = slots_[index & mask];
+    uint64_t sequence = slot.sequence.load(std::memory_order_acquire);
+    Record record;
+    record.timestamp_nanos =
+        slot.timestamp_nanos.load(std::memory_order_relaxed);
+    record.tid = static_cast<pid_t>(slot.tid.load(std::memory_order_relaxed));
+    record.trace_hash = slot.trace_hash.load(std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_acquire);
+    if (sequence == index + 1 &&
+        slot.sequence.load(std::memory_order_relaxed) == sequence) {
+      records->push_back(record);
+    }
+  }
+  return end - records->size();
+}
+
+void AddTimelineSamples(const ResolvedTimeline &timeline,
+                        ProfileBuilder *builder) {
+  builder->AddSampleType("sample", "count");
+  std::vector<uint64_t> function_ids;
+  function_ids.reserve(timeline.functions.size());
+  for (const auto &function : timeline.functions) {
+    function_ids.push_back(builder->FunctionId(function.first, function.second));
+  }
+  std::vector<uint64_t> frame_location_ids;
+  frame_location_ids.reserve(timeline.frames.size());
+  for (const ResolvedTimeline::Frame &frame : timeline.frames) {
+    frame_location_ids.push_back(
+        builder->LocationId(function_ids[frame.function], frame.line));
+  }
+  std::vector<uint64_t> location_ids;
+  std::vector<ProfileBuilder::Label> labels(2);
+  labels[0].key = "timestamp";
+  labels[0].num_unit = "nanoseconds";
+  labels[1].key = "thread_id";
+  for (const ResolvedTimeline::Record &record : timeline.records) {
+    location_ids.clear();
+    for (uint32_t frame = record.frame; frame != 0;
+         frame = timeline.frames[frame - 1].parent) {
+      location_ids.push_back(frame_location_ids[frame - 1]);
+    }
+    labels[0].num = record.timestamp_nanos;
+    labels[1].num = record.tid;
+    builder->AddSample(location_ids, {1}, labels);
+  }
+}
+
+std::string EncodeTimeline(const ResolvedTimeline &timeline) {
+  const uint64_t kVersion = 1;
+  std::string out("GCPT");
+  PutVarint(kVersion, &out);
+  PutVarint(timeline.dropped_records, &out);
+  PutVarint(timeline.functions.size(), &out);
+  for (const auto &function : timeline.functions) {
+    PutString(function.first, &out);
+    PutString(function.second, &out);
+  }
+  PutVarint(timeline.frames.size(), &out);
+  for (const ResolvedTimeline::Frame &frame : timeline.frames) {
+    PutVarint(frame.parent, &out);
+    PutVarint(frame.function, &out);
+    PutZigZag(frame.line, &out);
+  }
+  PutVarint(timeline.records.size(), &out);
+  int64_t previous_nanos = 0;
+  for (const ResolvedTimeline::Record &record : timeline.records) {
+    PutZigZag(record.timestamp_nanos - previous_nanos, &out);
+    previous_nanos = record.timestamp_nanos;
+    PutVarint(record.tid, &out);
+    PutVarint(record.frame, &out);
+  }
+  return out;
+}
@@ -0,0 +1,156 @@
+// Copyright 2026 Google LLC
+//
+// Licensed under the Apache License, Version 2.0 (the "License");
+// you may not use this file except in compliance with the License.
+// You may obtain a copy of the License at
+//
+//      https://www.apache.org/licenses/LICENSE-2.0
+//
+// Unless required by applicable law or agreed to in writing, software
+// distributed under the License is distributed on an "AS IS" BASIS,
+// WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+// See the License for the specific language governing permissions and
+// limitations under the License.
+
+#ifndef GOOGLECLOUDPROFILER_SRC_TIMELINE_H_
+#define GOOGLECLOUDPROFILER_SRC_TIMELINE_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#include <atomic>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "profile_builder.h"
+#include "stacktraces.h"
+
+// SampleTimeline records when each sample was taken, by which thread, and of
+// which trace, in a preallocated ring of records. The trace multisets only
+// keep the count of each trace, so the timeline is what tells a steady load
+// from a short stall. Traces are identified by their hash, see
+// CalculateHash(), and are resolved against the aggregated traces at the end
+// of the collection.
+//
+// Append() is async-safe and lock-free: it claims the next record by
+// bumping an atomic index, and the oldest records are overwritten once the
+// ring is full. Each record carries a sequence number, written last, so that
+// Read() skips the records being written or overwritten concurrently.
+class SampleTimeline {
+ public:
+  struct Record {
+    // CLOCK_MONOTONIC time of the sample, in nanoseconds.
+    int64_t timestamp_nanos;
+    // Kernel ID of the sampled thread.
+    pid_t tid;
+    // Hash of the trace, or 0 if the trace couldn't be recorded.
+    uint64_t trace_hash;
+  };
+
+  // Largest capacity supported, about 10 seconds of samples of 100 threads at
+  // 1 kHz.
+  static const int64_t kMaxCapacity = 1 << 20;
+
+  // Allocates a ring of up to max_capacity records, rounded up to a power of
+  // 2. max_capacity must not exceed kMaxCapacity.
+  explicit SampleTimeline(int64_t max_capacity);
+  // Not copyable or assignable.
+  SampleTimeline(const SampleTimeline &) = delete;
+  SampleTimeline &operator=(const SampleTimeline &) = delete;
+
+  ~SampleTimeline();
+
+  // Empties the ring, and sets the number of records it keeps to capacity
+  // rounded up to a power of 2, so that a ring can be reused for a smaller
+  // capacity. capacity must not exceed MaxCapacity(). This must not be called
+  // concurrently with Append().
+  void Reset(int64_t capacity);
+
+  // Appends a record, overwriting the oldest one if the ring is full. This
+  // operation is thread safe and async safe.
+  void Append(int64_t timestamp_nanos, pid_t tid, uint64_t trace_hash);
+
+  // Replaces the content of records with the records in the ring, oldest
+  // first. Returns the number of records appended since the last Reset()
+  // which are not returned, because they were overwritten or were being
+  // written.
+  int64_t Read(std::vector<Record> *records) const;
+
+  int64_t Capacity() const {
+    return mask_.load(std::memory_order_relaxed) + 1;
+  }
+
+  int64_t MaxCapacity() const { return num_slots_; }
+
+ private:
+  struct Slot {
+    // Index of the record plus one once written, 0 while being written.
+    std::atomic<uint64_t> sequence;
+    std::atomic<int64_t> timestamp_nanos;
+    std::atomic<int64_t> tid;
+    std::atomic<uint64_t> trace_hash;
+  };
+
+  const uint64_t num_slots_;
+  Slot *slots_;
+  // Capacity() minus one. A late Append() may still use the mask of the
+  // previous Reset(), which stays within the slots.
+  std::atomic<uint64_t> mask_;
+
+  char leading_padding_[kCacheLineSize];
+  // Index of the next record to append.
+  std::atomic<uint64_t> next_;
+  char trailing_padding_[kCacheLineSize];
+};
+
+// A timeline whose traces are resolved, which can outlive the collection and
+// its symbol table.
+struct ResolvedTimeline {
+  // A frame of the traces. Frames are stored as a tree, so that traces share
+  // the frames of their common callers.
+  struct Frame {
+    // Index of the caller frame plus one, or 0 for a root frame.
+    uint32_t parent;
+    // Index in functions.
+    uint32_t function;
+    int line;
+  };
+
+  struct Record {
+    // Time of the sample, in nanoseconds since the epoch.
+    int64_t timestamp_nanos;
+    pid_t tid;
+    // Index of the leaf frame of the trace plus one, or 0 for an empty trace.
+    uint32_t frame;
+  };
+
+  // Names and filenames.
+  std::vector<std::pair<std::string, std::string>> functions;
+  // A frame comes after its caller.
+  std::vector<Frame> frames;
+  // Oldest first.
+  std::vector<Record> records;
+  // Number of samples which are missing from records, see
+  // SampleTimeline::Read().
+  int64_t dropped_records = 0;
+};
+
+// Adds the records of the timeline to builder, as samples with a count of 1
+// and the numeric labels "timestamp", in nanoseconds since the epoch, and
+// "thread_id". The sample type is set to ("sample", "count").
+void AddTimelineSamples(const ResolvedTimeline &timeline,
+                        ProfileBuilder *builder);
+
+// Encodes the timeline in a compact binary format, made of unsigned LEB128
+// varints and length-prefixed strings:
+//   "GCPT", version (1), dropped_records,
+//   number of functions, then for each: name, filename,
+//   number of frames, then for each: parent, function, zigzag(line),
+//   number of records, then for each: zigzag(timestamp_nanos - previous
+//   record's timestamp_nanos, starting from 0), tid, frame.
+// Indices follow ResolvedTimeline. googlecloudprofiler.timeline.decode()
+// decodes it.
+std::string EncodeTimeline(const ResolvedTimeline &timeline);
+
+#endif  // GOOGLECLOUDPROFILER_SRC_TIMELINE_H_
@@ -0,0 +1,111 @@
+# Copyright 2026 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Sample timelines of the native profilers.
+
+A CPU profile collected with timeline_records set, see
+cpu_profiler.CPUProfiler and cpu_profiler.start_burst(), also records the
+time, the thread and the trace of each sample in a ring of that many records.
+The timeline of the last such profile is returned by last(), either as a
+profile proto with one sample per record, or in a compact binary format
+decoded by decode().
+"""
+
+from googlecloudprofiler import _profiler
+
+_MAGIC = b'GCPT'
+_VERSION = 1
+
+
+def last(fmt='pprof'):
+  """Returns the timeline of the last profile which recorded one.
+
+  Args:
+    fmt: 'pprof' for a gzip-compressed profile proto whose samples have a count
+      of 1 and the numeric labels 'timestamp', in nanoseconds since the epoch,
+      and 'thread_id', or 'binary' for the format decoded by decode(). Defaults
+      to 'pprof'.
+
+  Returns:
+    A bytes object, or None if no profile recorded a timeline.
+  """
+  return _profiler.timeline(format=fmt)
+
+
+class _Reader:
+  """Reads the varints and strings of a binary timeline."""
+
+  def __init__(self, data):
+    self._data = data
+    self._pos = 0
+
+  def varint(self):
+    result = 0
+    shift = 0
+    while True:
+      byte = self._data[self._pos]
+      self._pos += 1
+      result |= (byte & 0x7f) << shift
+      if byte < 0x80:
+        return result
+      shift += 7
+
+  def zigzag(self):
+    value = self.varint()
+    return (value >> 1) ^ -(value & 1)
+
+  def string(self):
+    size = self.varint()
+    value = self._data[self._pos:self._pos + size].decode('utf-8', 'replace')
+    self._pos += size
+    return value
+
+
+def decode(data):
+  """Decodes a timeline in binary format.
+
+  Args:
+    data: A bytes object returned by last('binary').
+
+  Returns:
+    A dict with 'records', a list of (timestamp, thread ID, trace) tuples
+    ordered by sample, where the timestamp is in nanoseconds since the epoch
+    and the trace is a tuple of (function name, filename, line) frames with
+    the leaf frame first, and 'dropped_records', the number of samples
+    missing from the records as the ring was full.
+
+  Raises:
+    ValueError: If data is not a timeline in binary format.
+  """
+  if data[:len(_MAGIC)] != _MAGIC:
+    raise ValueError('not a binary timeline')
+  reader = _Reader(data[len(_MAGIC):])
+  if reader.varint() != _VERSION:
+    raise ValueError('unsupported timeline version')
+  dropped_records = reader.varint()
+  functions = [(reader.string(), reader.string())
+               for _ in range(reader.varint())]
+  # The trace of each frame, computed from its caller's as callers come first.
+  traces = [()]
+  for _ in range(reader.varint()):
+    parent = reader.varint()
+    name, filename = functions[reader.varint()]
+    line = reader.zigzag()
+    traces.append(((name, filename, line),) + traces[parent])
+  records = []
+  timestamp = 0
+  for _ in range(reader.varint()):
+    timestamp += reader.zigzag()
+    tid = reader.varint()
+    records.append((timestamp, tid, traces[reader.varint()]))
+  return {'records': records, 'dropped_records': dropped_records}
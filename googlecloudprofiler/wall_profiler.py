@@ -0,0 +1,55 @@
+# Copyright 2026 Google LLC
+#
+# Licensed under the Apache License, Version 2.0 (the "License");
+# you may not use this file except in compliance with the License.
+# You may obtain a copy of the License at
+#
+#    https://www.apache.org/licenses/LICENSE-2.0
+#
+# Unless required by applicable law or agreed to in writing, software
+# distributed under the License is distributed on an "AS IS" BASIS,
+# WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+# See the License for the specific language governing permissions and
+# limitations under the License.
+"""Native wall time profiler."""
+
+import logging
+from googlecloudprofiler import _profiler
+
+logger = logging.getLogger(__name__)
+
+
+class WallProfiler:
+  """Wall time profiler.
+
+  Unlike pythonprofiler.WallProfiler, this profiler samples all Python threads,
+  not only the main thread, and it doesn't need the main thread to acquire the
+  GIL to take a sample. It uses SIGPROF, so it must not run concurrently with
+  the CPU profiler.
+  """
+
+  def __init__(self, period_ms=10, thread_labels=False):
+    """Constructs the wall time profiler.
+
+    Args:
+      period_ms: An optional integer specifying the sampling interval in
+        milliseconds. Defaults to 10.
+      thread_labels: An optional bool specifying whether samples should be
+        labelled with the ID and the name of their thread, see
+        cpu_profiler.CPUProfiler. Defaults to False.
+    """
+    self._profile_type = 'WALL'
+    self._period_ms = period_ms
+    self._thread_labels = thread_labels
+
+  def profile(self, duration_ns):
+    """Profiles the wall time of all threads for the given duration.
+
+    Args:
+      duration_ns: An integer specifying the duration to profile in nanoseconds.
+
+    Returns:
+      A bytes object containing gzip-compressed profile proto.
+    """
+    return _profiler.profile_wall(duration_ns, self._period_ms,
+                                  thread_labels=self._thread_labels)